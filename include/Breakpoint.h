@@ -2,6 +2,8 @@
 #define SPYTESTER_BREAKPOINT_H
 
 
+#include <chrono>
+#include <memory>
 #include <queue>
 #include <string>
 #include <vector>
@@ -11,21 +13,38 @@
 #include "Tracer.h"
 #include "CallbackHandler.h"
 #include "SpiedThread.h"
+#include "X86Instruction.h"
 
-class BreakPoint {
+// Owned through a shared_ptr, hits and their queued callbacks keep the breakpoint alive until they are done
+class BreakPoint : public std::enable_shared_from_this<BreakPoint> {
 private:
 
     using BreakpointCallback = std::function<void(BreakPoint&, SpiedThread&)>;
     using Mutex = std::recursive_mutex;
     using LockGuard = std::lock_guard<Mutex>;
 
-    const static uint8_t INT3 = 0xCC;
+    constexpr static uint8_t INT3 = 0xCC;
+    constexpr static std::chrono::seconds stepTimeout{5};
 
     Mutex _breakPointMutex;
     const std::string _name;
     uint64_t * const _addr;
+    const uint8_t _originalByte;
     uint64_t _backup;
     bool _isSet;
+
+    // Copy of the original instruction executed out of line, so that the breakpoint never has to be removed
+    X86Instruction _instruction;
+    bool _isDisplacementPrepared;
+    void* _displacedCode;
+    size_t _displacedLength;
+
+    // Transactions committed by the tracer thread itself, which cannot wait for the stop they are parked on.
+    // A thread may be stepping in the displaced code until they complete.
+    std::vector<Tracer::Completion> _pendingSteps;
+    // A failed displaced step may leave its thread in the displaced code
+    bool _isDisplacedCodeLeaked;
+
     Tracer& _tracer;
     CallbackHandler& _callbackHandler;
 
@@ -35,19 +54,43 @@ private:
     // default callback function
     static void defaultOnHit(BreakPoint& breakPoint, SpiedThread& spiedThread);
 
+    // Wait for the transaction and return whether every step succeeded
+    bool commit(Tracer::Transaction&& transaction);
+
+    // One transaction step per breakpoint, the ones whose step failed are left in their previous state
+    static bool changeAll(const std::vector<BreakPoint*>& breakPoints, bool set);
+
+    // Return false if the instruction cannot be displaced (unsupported, out of reach)
+    bool prepareDisplacement();
+
+    // In-process patching, usable as transaction sync steps
+    static long arm(void* breakPoint);
+    static long disarm(void* breakPoint);
+
 public:
 
     BreakPoint(Tracer &tracer, CallbackHandler &callbackHandler, const std::string &&name, void* addr);
-    ~BreakPoint() = default;
+    ~BreakPoint();
 
     void* getAddr() const;
 
     bool set();
     bool unset();
 
+    // (Un)set several breakpoints of the same spied program with one transaction, the in-process patches of a
+    // page are then written with a single pair of mprotect calls
+    static bool setAll(const std::vector<BreakPoint*>& breakPoints);
+    static bool unsetAll(const std::vector<BreakPoint*>& breakPoints);
+
+    // Append the memory writes (un)setting the breakpoint to a transaction
+    void prepareSet(Tracer::Transaction& transaction);
+    void prepareUnset(Tracer::Transaction& transaction);
+
     void setOnHitCallback(BreakpointCallback&& callback);
     void hit(SpiedThread& spiedThread);
 
+    // Return once the thread is resumed, after the step over the breakpoint for resumeAndSet (not waited for when
+    // called by the tracer thread, e.g. from a single-threaded engine callback)
     bool resumeAndUnset(SpiedThread &spiedThread);
     bool resumeAndSet(SpiedThread &spiedThread);
 
@@ -0,0 +1,73 @@
+#ifndef SPYTESTER_CALLPROFILER_H
+#define SPYTESTER_CALLPROFILER_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <x86intrin.h>
+
+#include "ThreadIndex.h"
+
+// Call count and latency histogram of a function, recorded by the calling threads in their own
+// cache line aligned slot (no shared write) and merged only when a report is requested.
+// Latencies are measured in TSC cycles and stored in log-linear buckets (8 per power of 2, 12.5% precision).
+class CallProfiler {
+public:
+    struct Report {
+        std::string name;
+        uint64_t callNb;
+        double meanNs;
+        double p50Ns;
+        double p90Ns;
+        double p99Ns;
+        double maxNs;
+    };
+
+    // Record the latency of the enclosing scope
+    class Timer {
+    public:
+        explicit Timer(CallProfiler& profiler) : _profiler(profiler), _start(__rdtsc()) {}
+        Timer(const Timer&) = delete;
+        ~Timer() { _profiler.record(__rdtsc() - _start); }
+
+    private:
+        CallProfiler& _profiler;
+        uint64_t _start;
+    };
+
+    explicit CallProfiler(std::string name);
+    CallProfiler(const CallProfiler&) = delete;
+    ~CallProfiler();
+
+    bool isActive() const { return _isActive.load(std::memory_order_relaxed); }
+    void setActive(bool active) { _isActive.store(active, std::memory_order_relaxed); }
+
+    void record(uint64_t cycles);
+
+    // Can be called while the spied threads are recording, the result may miss the last calls
+    Report getReport() const;
+
+private:
+    static const uint32_t subBucketBits = 3;
+    static const uint32_t bucketNb = (64 - subBucketBits + 1) << subBucketBits;
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> callNb{0};
+        std::atomic<uint64_t> totalCycles{0};
+        std::atomic<uint64_t> maxCycles{0};
+        std::atomic<uint64_t> buckets[bucketNb]{};
+    };
+
+    static uint32_t getBucket(uint64_t cycles);
+    static uint64_t getBucketUpperBound(uint32_t bucket);
+    static double getCyclesPerNs();
+
+    const std::string _name;
+    std::atomic<bool> _isActive;
+
+    ThreadSlots<Slot> _slots;
+};
+
+
+#endif //SPYTESTER_CALLPROFILER_H
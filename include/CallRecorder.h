@@ -0,0 +1,82 @@
+#ifndef SPYTESTER_CALLRECORDER_H
+#define SPYTESTER_CALLRECORDER_H
+
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ThreadIndex.h"
+
+// Recorded calls of a function, written in a file made of a header followed by fixed size records :
+// a RecordHeader then the raw bytes of the arguments and of the return value, padded to 8 bytes.
+// The file can be mapped and indexed directly (see CallReplayer).
+class CallRecorder {
+public:
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t argsSize;
+        uint32_t returnSize;
+        uint32_t recordSize;
+        uint64_t recordNb;
+    };
+
+    struct RecordHeader {
+        uint64_t timestamp;     // TSC
+        uint32_t tid;
+        uint32_t reserved;
+    };
+
+    static constexpr char magic[8] = {'S', 'P', 'Y', 'R', 'E', 'C', 'O', 'R'};
+    static const uint32_t version = 1;
+
+    static uint32_t getRecordSize(uint32_t argsSize, uint32_t returnSize);
+
+    // Throw std::invalid_argument if the file cannot be created
+    CallRecorder(const std::string& path, uint32_t argsSize, uint32_t returnSize);
+    CallRecorder(const CallRecorder&) = delete;
+    // Flush the remaining records and complete the header
+    ~CallRecorder();
+
+    // Called by the spied threads, never blocks : the call is dropped if the thread ring is full
+    void record(const void* args, const void* returnValue);
+
+    uint64_t getRecordNb() const;
+    uint64_t getDroppedNb() const;
+
+private:
+    static const uint32_t ringCapacity = 4096;
+    static constexpr std::chrono::milliseconds flushPeriod{1};
+
+    // Single producer (its thread) / single consumer (the flusher) ring of records
+    struct Ring {
+        alignas(64) std::atomic<uint64_t> head{0};
+        alignas(64) std::atomic<uint64_t> tail{0};
+        std::atomic<uint64_t> droppedNb{0};
+        std::unique_ptr<uint8_t[]> records;
+    };
+
+    void flush();
+    void flushLoop();
+
+    const uint32_t _argsSize;
+    const uint32_t _returnSize;
+    const uint32_t _recordSize;
+    int _fd;
+
+    ThreadSlots<Ring> _rings;
+    std::atomic<bool> _isSharedRingBusy;
+
+    std::vector<uint8_t> _buffer;
+    std::atomic<uint64_t> _recordNb;
+    std::atomic<bool> _isRunning;
+    std::thread _flusher;
+};
+
+
+#endif //SPYTESTER_CALLRECORDER_H
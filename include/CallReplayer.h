@@ -0,0 +1,38 @@
+#ifndef SPYTESTER_CALLREPLAYER_H
+#define SPYTESTER_CALLREPLAYER_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "CallRecorder.h"
+
+// Return values of a file written by CallRecorder, served back in the recorded order (all threads merged)
+class CallReplayer {
+public:
+    // Throw std::invalid_argument if the file cannot be mapped or was not recorded for this signature
+    CallReplayer(const std::string& path, uint32_t argsSize, uint32_t returnSize);
+    CallReplayer(const CallReplayer&) = delete;
+    ~CallReplayer();
+
+    // Copy the next recorded return value, return false once they were all served
+    bool next(void* returnValue);
+
+    uint64_t getRecordNb() const;
+
+private:
+    const uint32_t _argsSize;
+    const uint32_t _returnSize;
+
+    void* _map;
+    size_t _mapSize;
+
+    // Records sorted by timestamp
+    std::vector<const uint8_t*> _records;
+    std::atomic<uint64_t> _next;
+};
+
+
+#endif //SPYTESTER_CALLREPLAYER_H
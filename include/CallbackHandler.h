@@ -2,6 +2,7 @@
 #define SPYTESTER_CALLBACKHANDLER_H
 
 
+#include <atomic>
 #include <functional>
 #include <mutex>
 #include <queue>
@@ -21,6 +22,7 @@ private :
 
     // Attributs
     bool _running;
+    std::atomic<bool> _isInline;
     std::thread _callbackHandler;
     CallbackQueue _callbacks;
     std::mutex _callbackMutex;
@@ -34,6 +36,9 @@ public :
     CallbackHandler();
     ~CallbackHandler();
     void executeCallback(const Callback& callback);
+    // Run the callbacks on the calling thread (e.g. the tracer thread of a single-threaded event engine)
+    // instead of queuing them for the callback thread
+    void setInline(bool isInline);
 };
 
 
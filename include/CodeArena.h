@@ -0,0 +1,49 @@
+#ifndef SPYTESTER_CODEARENA_H
+#define SPYTESTER_CODEARENA_H
+
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+// Executable memory allocated close (±1GB) to a given address, so that code copied there can still
+// reach the original code and data with 32 bits displacements.
+// Regions are mapped read/execute and written through MemoryPatcher.
+class CodeArena {
+public:
+    static const uint64_t reach = 1ULL << 30;
+    static const size_t regionSize = 1 << 20;
+
+    CodeArena() = default;
+    CodeArena(const CodeArena&) = delete;
+    ~CodeArena();
+
+    // Return nullptr if no memory is available in reach of near
+    void* allocate(size_t size, const void* near);
+    void release(void* addr, size_t size);
+
+    // Copy code to an allocated block
+    static bool write(void* addr, const void* code, size_t size);
+
+private:
+    struct Region {
+        uint64_t begin;
+        uint64_t end;
+        uint64_t next;
+    };
+
+    static const size_t alignment = 16;
+
+    static bool isInReach(uint64_t addr, uint64_t near);
+    static uint64_t mapRegion(uint64_t near);
+
+    std::mutex _mutex;
+    std::vector<Region> _regions;
+    // Released blocks by size
+    std::multimap<size_t, uint64_t> _freeBlocks;
+};
+
+
+#endif //SPYTESTER_CODEARENA_H
@@ -2,11 +2,11 @@
 #define TEST_ELFBIN_H
 
 
-#include <functional>
 #include <link.h>
 #include <map>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "ElfFile.h"
 #include "Relinkage.h"
@@ -19,22 +19,36 @@ private:
     const std::string _name;
     void* _handle;
     LinkMap* _lm;
-    ElfFile& _elf;
+    ElfFile::Handle _elf;
 
     std::set<Relinkage*> _inRelinkages;
     std::map<std::string, Relinkage> _outRelinkages;
 
+    void* getDynamicSymbol(const Elf64_Sym* symb) const;
+
 public:
     DynamicModule(const std::string &name, Lmid_t id);
     ~DynamicModule();
 
     [[nodiscard]] const std::string& getName() const;
     [[nodiscard]] void* getDynamicSymbol(const std::string& symbName) const;
+    // symbolId from ElfFile::getSymbolNames
+    [[nodiscard]] void* getDynamicSymbol(uint32_t symbolId) const;
+    // Same as getDynamicSymbol for functions, indirect functions (STT_GNU_IFUNC) are resolved
+    [[nodiscard]] void* getDynamicFunction(const std::string& symbName) const;
     [[nodiscard]] void* getSymbol(const std::string& symbName) const;
     void* getSymbol(void* symbolPtr) const;
     [[nodiscard]] void* getEntryPoint() const;
+    // First instruction of a source line (see ElfFile::findLineAddress), nullptr if the module has none
+    [[nodiscard]] void* getLineAddress(const std::string& fileName, uint32_t line) const;
 
-    void iterateOverRelocations(const std::function<bool(uint32_t, const std::string&, uint64_t*)>& f);
+    // Symbol relocations of the module grouped by symbol
+    Span<const ElfFile::Relocation> getRelocations() const;
+    [[nodiscard]] uint32_t getSymbolId(const ElfFile::Relocation& rela) const;
+    [[nodiscard]] uint64_t* getRelocationAddress(const ElfFile::Relocation& rela) const;
+    // GOT slots through which the module reaches symbName
+    std::vector<uint64_t*> getFunctionRelocations(const std::string& symbName) const;
+    std::vector<uint64_t*> getFunctionRelocations(uint32_t symbolId) const;
 
     void relink(DynamicModule& module);
     void unrelink(const std::string& libName);
@@ -2,9 +2,13 @@
 #define SPYTESTER_DYNAMICNAMESPACE_H
 
 
+#include <functional>
 #include <map>
+#include <memory>
+#include <unordered_map>
 
 #include "DynamicModule.h"
+#include "ModulePrewarmer.h"
 
 class SpyLoader;
 
@@ -26,8 +30,24 @@ public :
 
     bool iterateOverModule(const std::function<bool(DynamicModule&)>& f);
 
+    typedef enum {
+        MODULE_ADDED,   // Loaded or found by syncModules
+        MODULE_REMOVED  // Unloaded, called while the module is still mapped
+    } E_ModuleEvent;
+
+    // Called with each module added to or removed from the namespace afterwards
+    using ModuleObserver = std::function<void(DynamicModule&, E_ModuleEvent)>;
+    uint32_t addModuleObserver(ModuleObserver&& observer);
+    void removeModuleObserver(uint32_t id);
+
+    // Pick up the modules the spied program loaded since the last call
+    void syncModules();
+
     static void createMainThread(DynamicNamespace* ns);
 
+    // Definition of a function used by the namespace modules, looked up in load order (as the dynamic linker does)
+    void* findFunction(const std::string& symbName);
+
     // improve remove this method and improve WrappedFunction class
     void* convertDynSymbolAddr(void* addr) const;
 
@@ -38,6 +58,8 @@ private:
 
     Lmid_t _id;
     struct link_map* _lm;
+    // Indexes the modules of the namespace in the background until the first syncModules
+    std::unique_ptr<ModulePrewarmer> _prewarmer;
 
     const int _argc;
     const char** const _argv;
@@ -49,8 +71,15 @@ private:
 
     decltype(&DynamicNamespace::createMainThread) _createMainThread;
 
+    // Resolved by findFunction, cleared when a module is unloaded
+    std::unordered_map<std::string, void*> _functions;
+
+    std::map<uint32_t, ModuleObserver> _moduleObservers;
+    uint32_t _nextObserverId = 0;
+
     void loadExecutable();
-    void syncModules();
+    void waitPrewarm();
+    void notifyModule(DynamicModule& module, E_ModuleEvent event = MODULE_ADDED);
 };
 
 
@@ -2,45 +2,226 @@
 #define SPYTESTER_ELFFILE_H
 
 
+#include <atomic>
 #include <elf.h>
-#include <map>
+#include <link.h>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
+#include "helpers/FlatHashMap.h"
+#include "helpers/Span.h"
+#include "helpers/StringInterner.h"
+
+class LineTable;
+
+// ELF file mapped read-only, the section accessors are views in the mapping. The image of a loaded module
+// (getElfImage) reads the dynamic tables in memory instead, its file is only opened for .symtab.
+// The derived indexes (symtab hash, address ranges, relocations by symbol) are built on first use. If the
+// SPYTESTER_INDEX_CACHE directory is set, each one is saved in an index cache file keyed by the build id (or by
+// the path, mtime and size) when it is built, later runs map it instead of building it again.
+// Files are shared through a registry keyed by (dev, inode), lookups and lazy index builds are thread-safe.
 class ElfFile {
 public:
+    using Handle = std::shared_ptr<ElfFile>;
+
+    // Relocation of .rela.* referencing a named dynamic symbol, symbol is its index in the relocated symbols
+    struct Relocation {
+        Elf64_Addr offset;
+        uint32_t symbol;
+        uint32_t type;
+    };
+
+    // Symbol referenced by relocations, with the [first, last) range of its relocations
+    struct RelocatedSymbol {
+        uint32_t nameOffset;    // In .dynstr
+        uint32_t first;
+        uint32_t last;
+    };
+
+    // Function or object of .dynsym or .symtab
+    struct SymbolRange {
+        Elf64_Addr start;
+        Elf64_Xword size;
+        uint64_t nameOffset;    // In the file
+    };
+
     explicit ElfFile(const std::string& filePath);
+    explicit ElfFile(const struct link_map* lm);
+    ElfFile(const ElfFile&) = delete;
     ~ElfFile();
 
     Elf64_Addr getEntryPoint() const;
-    const std::vector<Elf64_Dyn>& getDynamic();
-    const std::vector<Elf64_Sym>& getSymTab();
-    const std::vector<Elf64_Sym>& getDynSymTab();
-    const std::vector<char>& getStrTab();
-    const std::vector<char>& getDynStrTab();
-    const std::vector<Elf64_Rela>& getRela();
-    const std::vector<Elf64_Shdr>& getShdr();
+    Span<const Elf64_Dyn> getDynamic() const;
+    // Empty for an image
+    Span<const Elf64_Sym> getSymTab() const;
+    Span<const Elf64_Sym> getDynSymTab() const;
+    // Empty for an image
+    Span<const char> getStrTab() const;
+    Span<const char> getDynStrTab() const;
+    // Relocation tables of the dynamic section (DT_RELA then DT_JMPREL)
+    const std::vector<Span<const Elf64_Rela>>& getRela() const;
+    Span<const Elf64_Shdr> getShdr() const;
+
+    // Symbol relocations grouped by symbol (in position order), built on the first call
+    Span<const Relocation> getSymbolRelocations();
+    Span<const Relocation> getSymbolRelocations(uint32_t symbolId);
+    // Id (in getSymbolNames) of the symbol of a relocation
+    uint32_t getSymbolId(const Relocation& rela);
+    // Defined function, object or indirect function (first one of the table), nullptr if there is none.
+    // Dynamic symbols are found through .gnu.hash, the other ones through a hash index built on the first lookup.
+    const Elf64_Sym* getDefinedDynSym(std::string_view name);
+    const Elf64_Sym* getDefinedDynSym(uint32_t symbolId);
+    // Opens the file of an image
+    const Elf64_Sym* getDefinedSym(std::string_view name);
+
+    // Symbol containing offset (from the load address), nullptr if there is none.
+    // The sorted ranges are built once, the lookup is then a lock-free binary search.
+    // An image uses the ranges of its file, or the dynamic symbols only if the file cannot be opened.
+    const SymbolRange* findSymbolRange(Elf64_Addr offset);
+    const char* getName(const SymbolRange& range) const;
+    // Lowest address of the first line >= line having code in fileName (a path or its end, e.g. "test/main.cpp"),
+    // from .debug_line. The line table of a compilation unit is decoded on the first lookup of one of its files.
+    // Opens the file of an image.
+    bool findLineAddress(std::string_view fileName, uint32_t line, Elf64_Addr& address);
+
+    // [first, last) addresses of the allocated sections (of the loaded segments for an image)
+    std::pair<Elf64_Addr, Elf64_Addr> getLoadedRange() const;
+
+    // Build the lazy indexes now (e.g. on a prewarm thread) instead of on the first lookups, the file of an image
+    // is not opened
+    void buildIndexes();
+    // Mappings and built indexes
+    size_t getMemoryUsage() const;
+
+    // Names of the dynamic symbols of every file, ids can be compared between files
+    static StringInterner& getSymbolNames();
 
-    static ElfFile& getElfFile(const std::string& filePath);
+    // Throw std::invalid_argument if the file cannot be mapped, an empty path is the executable
+    static Handle getElfFile(const std::string& filePath);
+    // Image of a loaded module, shared while a handle is held. It is only valid while the module is loaded.
+    // Throw std::invalid_argument if its program headers or dynamic tables cannot be found.
+    static Handle getElfImage(const struct link_map* lm);
+    // Memory of the registry files (256 MiB by default). Beyond it, the built indexes of the files without
+    // handle are dropped (they are rebuilt on the next lookup), then these files are closed, least recently used first.
+    static void setMemoryBudget(size_t budget);
+    // Apply the budget, called when handles are released
+    static void trimRegistry();
 
 private:
-    void readSection(Elf64_Shdr &sect, void *buf);
+    // Slot of an open addressing table of name hashes, idx is the symbol index + 1 (0 for an empty slot)
+    struct HashSlot {
+        uint32_t hash;
+        uint32_t idx;
+    };
+
+    // Indexes are stored in a vector when they are built, or mapped from the index cache
+    template<typename T>
+    struct Index {
+        Span<const T> view;
+        std::vector<T> storage;
+        std::atomic<bool> isReady{false};
+
+        void set(std::vector<T>&& built) { storage = std::move(built); map({storage.data(), storage.size()}); }
+        void map(Span<const T> mapped) { view = mapped; isReady.store(true, std::memory_order_release); }
+        bool isBuilt() const { return isReady.load(std::memory_order_relaxed) && view.data() == storage.data(); }
+        size_t getMemoryUsage() const { return isBuilt() ? storage.capacity() * sizeof(T) : 0; }
+        // Mapped indexes cost no heap, they are kept
+        void drop() {
+            if(isBuilt()) {
+                isReady.store(false, std::memory_order_relaxed);
+                view = {};
+                storage = {};
+            }
+        }
+    };
+
+    class Registry;
+
+    template<typename T>
+    Span<const T> getSection(const Elf64_Shdr& section) const;
+    // Run build under _indexMutex if ready is not set yet
+    template<typename F>
+    void ensure(const std::atomic<bool>& ready, F&& build);
+    void dropIndexes();
+    bool hasGnuHash() const;
+    // Pointer of the dynamic section to size bytes of the image or of the mapping, nullptr if they are not there
+    const uint8_t* getDynamicTable(Elf64_Addr addr, size_t size) const;
+    void findRelocations();
+    // This file, the file of an image (nullptr if it cannot be opened)
+    ElfFile* getSymbolFile();
+    const uint8_t* getNameBase() const;
+    void buildSymbolIndex();
+    void buildSymbolIds();
+    void buildSymbolRanges();
+
+    static uint32_t hashName(std::string_view name);
+    static bool isDefined(const Elf64_Sym& symb);
+    static std::vector<HashSlot> buildHashIndex(Span<const Elf64_Sym> symbols, Span<const char> strings);
+    static const Elf64_Sym* findInHashIndex(Span<const HashSlot> index, Span<const Elf64_Sym> symbols,
+                                            Span<const char> strings, std::string_view name);
+
+    // Index cache (see ElfFile.cpp for the layout)
+    std::string getCachePath() const;
+    bool loadIndexCache();
+    // Rewrite the cache with all the ready indexes, called under _indexMutex
+    void saveIndexCache();
+    // Mask of the ready indexes which can be cached (bit E_CachedIndex)
+    uint32_t getReadyIndexes() const;
+
+    const std::string _filePath;
+    const uint8_t* _map;
+    size_t _mapSize;
+    int64_t _mtime;
+
+    const Elf64_Ehdr* _elfHeader;
+    Span<const Elf64_Shdr> _sectHeader;
+
+    // Image backend
+    const bool _isImage;
+    const Elf64_Addr _imageBase;
+    Span<const Elf64_Phdr> _progHeader;
+    std::atomic<bool> _isSymbolFileOpen;
+    Handle _symbolFile;
+
+    // Views found when the file is mapped
+    Span<const Elf64_Dyn> _dynamic;
+    Span<const Elf64_Sym> _symtab;
+    Span<const Elf64_Sym> _dynsym;
+    Span<const char> _strtab;
+    Span<const char> _dynstr;
+    std::vector<Span<const Elf64_Rela>> _rela;
+    Span<const uint32_t> _gnuHash;
+    Span<const uint8_t> _buildId;
+    Span<const uint8_t> _debugLine;
+    Span<const uint8_t> _debugLineStr;
+    Span<const uint8_t> _debugStr;
+
+    std::string _cachePath;
+    const uint8_t* _cacheMap;
+    size_t _cacheMapSize;
+    // Mask of the indexes in the cache file
+    uint32_t _cachedIndexes;
 
-    static std::map<std::string, ElfFile> elfFiles;
+    // Held by the lazy builds and when the indexes are dropped
+    mutable std::mutex _indexMutex;
 
-    const std::string& _filePath;
-    int _fd;
+    Index<HashSlot> _dynsymIndex;
+    Index<HashSlot> _symtabIndex;
+    Index<SymbolRange> _symbolRanges;
 
-    Elf64_Ehdr _elfHeader;
-    std::vector<Elf64_Shdr> _sectHeader;
+    Index<Relocation> _symbolRelocations;
+    Index<RelocatedSymbol> _relocatedSymbols;
+    // Process dependent, built from the relocated symbols names
+    std::atomic<bool> _areSymbolIdsReady;
+    std::vector<uint32_t> _symbolIds;
+    FlatHashMap<uint32_t, uint32_t> _relocatedSymbolsById;
 
-    std::optional<std::vector<Elf64_Dyn>> _dynamic;
-    std::optional<std::vector<Elf64_Sym>> _symtab;
-    std::optional<std::vector<Elf64_Sym>> _dynsym;
-    std::optional<std::vector<char>> _strtab;
-    std::optional<std::vector<char>> _dynstr;
-    std::optional<std::vector<Elf64_Rela>> _rela;
+    std::atomic<bool> _isLineTableReady;
+    std::unique_ptr<LineTable> _lineTable;
 
 };
 #endif //SPYTESTER_ELFFILE_H
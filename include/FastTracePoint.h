@@ -0,0 +1,84 @@
+#ifndef SPYTESTER_FASTTRACEPOINT_H
+#define SPYTESTER_FASTTRACEPOINT_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CodeArena.h"
+#include "X86Instruction.h"
+
+// Tracepoint patched as a 5 bytes jump to a trampoline which calls the callback directly on the spied thread
+// (no trap, no tracer round trip), then executes the relocated original instructions and jumps back.
+// The covered instructions must not be jump targets : use it at function entries or other safe addresses.
+// Only usable in the address space shared with the spied program.
+class FastTracePoint {
+public:
+    // Registers of the spied thread when it reached the tracepoint, modifications are applied on return
+    struct Context {
+        uint64_t r15, r14, r13, r12, r11, r10, r9, r8;
+        uint64_t rdi, rsi, rbp, rbx, rdx, rcx, rax;
+        uint64_t rflags;
+
+        uint64_t getRsp() const { return (uint64_t)this + sizeof(Context) + redZoneSize; }
+    };
+
+    // Called concurrently by the spied threads, it must not block
+    using Callback = void(*)(FastTracePoint& tracePoint, Context& context, void* data);
+
+    // Throw std::invalid_argument if the jump cannot be written with a single store (it would straddle an aligned
+    // word) or if the covered instructions cannot be relocated
+    FastTracePoint(CodeArena& arena, std::string&& name, void* addr, Callback callback, void* data);
+    FastTracePoint(const FastTracePoint&) = delete;
+    ~FastTracePoint();
+
+    void* getAddr() const;
+    const std::string& getName() const;
+    uint64_t getHitNb() const;
+    bool isSet() const;
+
+    // The jump (and the original bytes) are written with a single store, the spied threads may be running
+    bool set();
+    bool unset();
+
+    void setCallback(Callback callback, void* data);
+
+private:
+    static const size_t jumpSize = 5;
+    static const size_t redZoneSize = 128;
+    static const size_t trampolineSize = 512;
+
+    // Referenced by the trampoline, which is never released : both outlive the tracepoint.
+    // The tracepoint is detached once no thread is dispatching, the later calls only count the hit.
+    struct Dispatch {
+        std::atomic<FastTracePoint*> tracePoint;
+        std::atomic<uint32_t> activeNb;
+        std::atomic<Callback> callback;
+        std::atomic<void*> data;
+        std::atomic<uint64_t> hitNb;
+    };
+
+    static void dispatch(Dispatch* dispatch, Context* context);
+
+    bool buildTrampoline();
+    bool patch(const uint8_t* bytes);
+
+    CodeArena& _arena;
+    const std::string _name;
+    uint8_t* const _addr;
+
+    std::mutex _mutex;
+    bool _isSet;
+
+    // Original bytes overwritten by the jump (whole instructions)
+    std::vector<uint8_t> _originalCode;
+    void* _trampoline;
+
+    Dispatch* _dispatch;
+};
+
+
+#endif //SPYTESTER_FASTTRACEPOINT_H
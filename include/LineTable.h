@@ -0,0 +1,77 @@
+#ifndef SPYTESTER_LINETABLE_H
+#define SPYTESTER_LINETABLE_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <elf.h>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "helpers/Span.h"
+
+// (source file, line) to address index of the DWARF line tables (.debug_line, versions 2 to 5).
+// The unit headers are read once to know the files of each compilation unit, the line program of a unit is only
+// run on the first lookup of one of its files, its rows are then kept sorted by (file, line, address).
+class LineTable {
+public:
+    // debugLineStr and debugStr hold the names of the DWARF 5 file tables
+    LineTable(Span<const uint8_t> debugLine, Span<const uint8_t> debugLineStr, Span<const uint8_t> debugStr);
+    LineTable(const LineTable&) = delete;
+
+    // Lowest address of the first line >= line having code in fileName, which is a path or the end of one
+    // (e.g. "test/main.cpp"). Thread-safe.
+    bool find(std::string_view fileName, uint32_t line, Elf64_Addr& address);
+
+    size_t getMemoryUsage() const;
+
+private:
+    struct Row {
+        uint32_t file;      // In _files
+        uint32_t line;
+        Elf64_Addr address;
+    };
+
+    struct Unit {
+        size_t offset;
+        size_t end;
+        size_t program;
+        uint16_t version;
+        uint8_t minInstLength;
+        bool defaultIsStmt;
+        int8_t lineBase;
+        uint8_t lineRange;
+        uint8_t opcodeBase;
+        const uint8_t* opcodeLengths;
+        // File register value to file id (DWARF 5 numbers files from 0, the previous versions from 1)
+        std::vector<uint32_t> files;
+
+        std::atomic<bool> isDecoded{false};
+        std::vector<Row> rows;
+    };
+
+    bool readUnit(size_t offset, Unit& unit);
+    void decode(Unit& unit);
+    uint32_t addFile(std::string&& path);
+
+    Span<const uint8_t> _debugLine;
+    Span<const uint8_t> _debugLineStr;
+    Span<const uint8_t> _debugStr;
+
+    // Paths of the file tables, file ids index them
+    std::deque<std::string> _files;
+    std::unordered_map<std::string_view, uint32_t> _fileIds;
+    std::unordered_map<std::string_view, std::vector<uint32_t>> _filesByName;
+    std::vector<std::vector<uint32_t>> _unitsOfFile;
+    std::deque<Unit> _units;
+
+    // Held while a unit is decoded
+    mutable std::mutex _mutex;
+};
+
+
+#endif //SPYTESTER_LINETABLE_H
@@ -0,0 +1,55 @@
+#ifndef SPYTESTER_MEMORYPATCHER_H
+#define SPYTESTER_MEMORYPATCHER_H
+
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// Direct stores into the current address space (which the spied program shares), temporarily
+// adding write permission to the touched pages.
+class MemoryPatcher {
+public:
+    // Writes applied together : pages are made writable once and their protection restored afterwards.
+    // A write within an aligned word is a single atomic store, keeping the bytes around it.
+    class Batch {
+    public:
+        Batch& write(void* addr, const void* data, size_t len);
+        Batch& writeByte(void* addr, uint8_t val);
+        Batch& writeWord(void* addr, uint64_t val);
+
+        bool empty() const;
+        // Forget the writes, keeping the capacity for the next ones
+        void clear();
+        bool commit();
+
+    private:
+        struct Patch {
+            uint8_t* addr;
+            size_t offset;
+            size_t len;
+        };
+
+        std::vector<Patch> _patches;
+        std::vector<uint8_t> _data;
+    };
+
+    static bool write(void* addr, const void* data, size_t len);
+
+private:
+    struct PageRange {
+        uint64_t begin;
+        uint64_t end;
+        int prot;
+    };
+
+    // Protections of the patched pages (sorted, unique), read from /proc/self/maps by every commit : the spied
+    // program may change them at any time (mprotect, dlopen) and only protections read for a commit are restored
+    static std::vector<PageRange> getPageRanges(const std::vector<uint64_t>& pages);
+
+    // Prevent a batch from restoring the protection of a page another batch is writing to
+    static std::mutex patchMutex;
+};
+
+
+#endif //SPYTESTER_MEMORYPATCHER_H
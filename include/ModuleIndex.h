@@ -0,0 +1,74 @@
+#ifndef SPYTESTER_MODULEINDEX_H
+#define SPYTESTER_MODULEINDEX_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <link.h>
+#include <mutex>
+#include <vector>
+
+#include "ElfFile.h"
+#include "helpers/Rcu.h"
+
+// Address to (module, symbol, offset) lookup replacing dladdr, which takes the loader lock and only knows the
+// dynamic symbols. The modules of the registered namespaces are kept sorted by address in a snapshot read
+// lock-free, it is rebuilt from the link maps when a namespace or a module is added or removed. A lookup missing
+// the snapshot only rebuilds it if the loader counted a load or an unload since (e.g. by the spied program).
+// Symbols come from the ranges of the module images, which use the ones of their file (shared by all the namespaces).
+class ModuleIndex {
+public:
+    struct Location {
+        struct link_map* module;
+        const char* fileName;
+        // nullptr if no symbol contains the address
+        const char* symbolName;
+        void* symbolAddr;
+        // From the symbol, or from the module base address if there is no symbol
+        uint64_t offset;
+    };
+
+    static ModuleIndex& getModuleIndex();
+
+    ModuleIndex();
+    ModuleIndex(const ModuleIndex&) = delete;
+    ~ModuleIndex();
+
+    // head is the first link map of the namespace
+    void addNamespace(struct link_map* head);
+    void removeNamespace(struct link_map* head);
+    // Drop the modules unloaded since the last update and add the new ones. The unloading module is dropped
+    // even though it is still loaded, so that no lookup uses it while it is being unmapped.
+    void update(const struct link_map* unloading = nullptr);
+
+    // The location strings belong to the loader and the ElfFile, they are valid while the module is loaded
+    bool find(const void* addr, Location& location);
+
+private:
+    struct Module {
+        uint64_t start;
+        uint64_t end;
+        struct link_map* lm;
+        // The link map of an unloaded module may be reused by another one, they are told apart by these
+        uint64_t base;
+        const void* dynamic;
+        ElfFile::Handle elf;
+    };
+
+    using Snapshot = std::vector<Module>;
+
+    bool findInSnapshot(uint64_t addr, Location& location);
+    // Loads and unloads counted by the loader since the process started
+    static std::pair<uint64_t, uint64_t> getLoadCounters();
+
+    std::atomic<Snapshot*> _snapshot;
+    Rcu _rcu;
+    std::atomic<uint64_t> _loadNb;
+    std::atomic<uint64_t> _unloadNb;
+
+    std::mutex _mutex;
+    std::vector<struct link_map*> _namespaces;
+};
+
+
+#endif //SPYTESTER_MODULEINDEX_H
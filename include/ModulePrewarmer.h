@@ -0,0 +1,37 @@
+#ifndef SPYTESTER_MODULEPREWARMER_H
+#define SPYTESTER_MODULEPREWARMER_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <link.h>
+#include <thread>
+#include <vector>
+
+#include "ElfFile.h"
+
+// Index the images of the modules of a link map on a small pool of threads, started right after dlmopen so that
+// it overlaps with the rest of the setup. The DynamicModules created afterwards find their images ready in the
+// registry (or wait for the thread indexing them).
+class ModulePrewarmer {
+public:
+    // head is the first link map of the namespace
+    explicit ModulePrewarmer(struct link_map* head);
+    ModulePrewarmer(const ModulePrewarmer&) = delete;
+    // Wait for the threads, the prewarmed images are then only held by the modules using them
+    ~ModulePrewarmer();
+
+    // SPYTESTER_PREWARM_THREADS environment variable (up to 4 by default), 0 disables the prewarm
+    static uint32_t getThreadNb();
+
+private:
+    void run();
+
+    std::vector<const struct link_map*> _modules;
+    std::vector<ElfFile::Handle> _images;
+    std::atomic<size_t> _next;
+    std::vector<std::thread> _threads;
+};
+
+
+#endif //SPYTESTER_MODULEPREWARMER_H
@@ -0,0 +1,85 @@
+#ifndef SPYTESTER_MPSCRING_H
+#define SPYTESTER_MPSCRING_H
+
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Bounded multi-producer / single-consumer queue of fixed-size records (Vyukov's sequence based ring).
+// Push and pop never allocate nor lock, a full ring makes tryPush fail.
+template<typename T, size_t Capacity>
+class MpscRing {
+    static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of 2");
+    static_assert(std::is_trivially_copyable_v<T>, "Records are copied in and out of the ring");
+
+public:
+    MpscRing() : _enqueuePos(0), _dequeuePos(0) {
+        for(size_t idx = 0; idx < Capacity; idx++)
+            _cells[idx].sequence.store(idx, std::memory_order_relaxed);
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    bool tryPush(const T& data) {
+        Cell* cell;
+        size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+
+        for(;;) {
+            cell = &_cells[pos & (Capacity - 1)];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            auto diff = (intptr_t)seq - (intptr_t)pos;
+
+            if(diff == 0) {
+                if(_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if(diff < 0) {
+                return false;
+            } else {
+                pos = _enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = data;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        return true;
+    }
+
+    // Must only be called by the consumer
+    bool tryPop(T& data) {
+        Cell& cell = _cells[_dequeuePos & (Capacity - 1)];
+        size_t seq = cell.sequence.load(std::memory_order_acquire);
+
+        if((intptr_t)seq - (intptr_t)(_dequeuePos + 1) < 0)
+            return false;
+
+        data = cell.data;
+        cell.sequence.store(_dequeuePos + Capacity, std::memory_order_release);
+        _dequeuePos++;
+
+        return true;
+    }
+
+    // Must only be called by the consumer
+    bool empty() const {
+        const Cell& cell = _cells[_dequeuePos & (Capacity - 1)];
+        return (intptr_t)cell.sequence.load(std::memory_order_acquire) - (intptr_t)(_dequeuePos + 1) < 0;
+    }
+
+private:
+    struct alignas(64) Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    Cell _cells[Capacity];
+
+    alignas(64) std::atomic<size_t> _enqueuePos;
+    alignas(64) size_t _dequeuePos;
+};
+
+
+#endif //SPYTESTER_MPSCRING_H
@@ -0,0 +1,101 @@
+#ifndef SPYTESTER_REGISTERCACHE_H
+#define SPYTESTER_REGISTERCACHE_H
+
+
+#include <cstdint>
+#include <mutex>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <vector>
+
+#include "Tracer.h"
+
+// Registers of a stopped thread, fetched on first access and written back only if modified.
+// Each register set (general purpose, debug, extended state) is tracked separately.
+class RegisterCache {
+public:
+    typedef enum {
+        GPR,
+        DEBUG,
+        XSTATE,
+        REGSET_NB
+    } E_RegSet;
+
+    using Gpr = unsigned long long user_regs_struct::*;
+
+    struct Vec128 {
+        uint64_t low;
+        uint64_t high;
+    };
+
+    struct Vec256 {
+        Vec128 low;
+        Vec128 high;
+    };
+
+    static const uint32_t debugRegNb = 8;
+    static const uint32_t vecRegNb = 16;
+
+    RegisterCache(Tracer& tracer, pid_t tid);
+    RegisterCache(const RegisterCache&) = delete;
+
+    // Drop every cached value, to be called each time the thread state changes
+    void invalidate();
+
+    // Accessors return false if their register set cannot be fetched, a failed set is neither applied nor written
+    // back. e.g. getGpr(&user_regs_struct::rip, rip)
+    bool getGpr(Gpr reg, uint64_t& val);
+    bool setGpr(Gpr reg, uint64_t val);
+    bool getGprs(user_regs_struct& regs);
+    void setGprs(const user_regs_struct& regs);
+
+    bool getDebugReg(uint32_t idx, uint64_t& val);
+    void setDebugReg(uint32_t idx, uint64_t val);
+
+    bool getMxcsr(uint32_t& mxcsr);
+    bool getXmm(uint32_t idx, Vec128& val);
+    bool setXmm(uint32_t idx, const Vec128& val);
+    // Also return false if AVX state is not available
+    bool getYmm(uint32_t idx, Vec256& val);
+    bool setYmm(uint32_t idx, const Vec256& val);
+
+    bool isDirty() const;
+
+    // Append the write back of the dirty register sets to a transaction, only fetched (or fully set) ones can be dirty
+    void prepareFlush(Tracer::Transaction& transaction);
+
+private:
+    // Offsets in the XSAVE area (standard format, as returned by PTRACE_GETREGSET)
+    static const size_t mxcsrOffset = 24;
+    static const size_t xmmOffset = 160;
+    static const size_t xstateHeaderOffset = 512;
+    static const size_t ymmHighOffset = 576;
+    static const uint64_t avxFeature = 1 << 2;
+
+    static uint64_t debugRegOffset(uint32_t idx);
+    static size_t xstateSize();
+
+    bool fetch(E_RegSet regSet);
+    bool fetchDebugReg(uint32_t idx);
+
+    Tracer& _tracer;
+    const pid_t _tid;
+
+    std::mutex _mutex;
+
+    bool _isValid[REGSET_NB];
+    bool _isDirty[REGSET_NB];
+
+    user_regs_struct _gprs;
+
+    // Debug registers are accessed one by one (PEEKUSER/POKEUSER)
+    uint64_t _debugRegs[debugRegNb];
+    uint32_t _validDebugRegs;
+    uint32_t _dirtyDebugRegs;
+
+    std::vector<uint8_t> _xstate;
+    struct iovec _xstateIov;
+};
+
+
+#endif //SPYTESTER_REGISTERCACHE_H
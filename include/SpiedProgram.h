@@ -5,6 +5,8 @@
 #include <map>
 #include <numeric>
 #include <set>
+#include <shared_mutex>
+#include <signal.h>
 #include <string>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -13,14 +15,29 @@
 #include "Breakpoint.h"
 #include "CallbackHandler.h"
 #include "DynamicNamespace.h"
+#include "FastTracePoint.h"
 #include "SpiedThread.h"
 #include "SpyLoader.h"
+#include "SymbolWrapper.h"
 #include "Tracer.h"
 #include "WatchPoint.h"
 #include "WrappedFunction.h"
+#include "helpers/FlatHashMap.h"
 
 class SpiedProgram {
+public:
+    // THREADED : a dedicated thread waits for the spied threads events
+    // SINGLE_THREADED : the tracer thread multiplexes commands and events in one loop
+    typedef enum {
+        THREADED,
+        SINGLE_THREADED
+    } E_EventEngine;
+
 private:
+    // Signal mask of the creating thread, SIGCHLD is blocked before the tester threads are spawned so that they
+    // all inherit it : the single-threaded engine only receives SIGCHLD through the tracer signalfd
+    sigset_t _initialSigMask;
+
     std::vector<std::string> _argvStr;
     std::vector<const char*> _argv;
 
@@ -32,17 +49,30 @@ private:
 
     std::thread _eventListener;
 
-    std::vector<std::unique_ptr<SpiedThread>> _spiedThreads;
-    std::vector<std::unique_ptr<BreakPoint>> _breakPoints;
+    // Looked up on every event, indexed by tid and by address
+    FlatHashMap<pid_t, std::unique_ptr<SpiedThread>> _spiedThreads;
+    // Shared with the hits being dispatched and their queued callbacks, a deleted breakpoint lives until they are done
+    FlatHashMap<void*, std::shared_ptr<BreakPoint>> _breakPoints;
+    std::shared_mutex _spiedThreadsMutex;
+    std::shared_mutex _breakPointsMutex;
+    SpiedThread* _mainThread = nullptr;
+    FlatHashMap<void*, std::unique_ptr<FastTracePoint>> _fastTracePoints;
+    std::mutex _fastTracePointsMutex;
     std::map<
         std::pair<void*, std::string>,
         std::unique_ptr<AbstractWrappedFunction>
     > _wrappedFunctions;
+    std::map<std::pair<std::string, std::string>, std::unique_ptr<SymbolWrapper>> _symbolWrappers;
 
     std::mutex _threadCreationMutex;
     std::function<void(SpiedThread&)> _onThreadCreation;
 
     void listenEvent();
+    void dispatchEvent(pid_t tid, int wstatus);
+    // The SIGTRAP stopping the thread comes from an INT3
+    bool isInt3Trap(pid_t tid);
+
+    static sigset_t blockChildSignal();
 
 public:
     template<typename ...ARGS>
@@ -55,22 +85,50 @@ public:
     bool relink(const std::string &libName);
 
     BreakPoint* createBreakPoint(void* addr, std::string&& name);
+    // At the first instruction of a source line (of the next line having code), looked up in the debug
+    // information of the spied namespace modules. Return nullptr if no module has it.
+    BreakPoint* createBreakPoint(const std::string& fileName, uint32_t line);
+    // Unset and destroy the breakpoint, it must not be used by a running callback
+    bool deleteBreakPoint(BreakPoint* breakPoint);
+
+    // Return nullptr if the instructions at addr cannot be displaced to a trampoline
+    FastTracePoint* createFastTracePoint(void* addr, std::string&& name, FastTracePoint::Callback callback, void* data);
+    bool deleteFastTracePoint(FastTracePoint* tracePoint);
 
+    // An empty binName wraps the calls from every module of the spied namespace
     template<auto faddr>
     WrappedFunction<faddr>* wrapFunction(const std::string& binName);
     template<auto faddr>
     void unwrapFunction(const std::string& binName);
 
-    void start();
-    void resume();
-    void stop();
+    // Wrap the calls made by binName (every module if empty) to any dynamic symbol of the spied namespace,
+    // return nullptr on failure
+    SymbolWrapper* wrapFunction(const std::string& binName, const std::string& symbolName,
+                                SymbolWrapper::Handler&& handler);
+    void unwrapFunction(const std::string& binName, const std::string& symbolName);
+
+    // Reports of the wrapped functions being profiled, the spied program does not need to be stopped
+    std::vector<CallProfiler::Report> getProfile() const;
+
+    // Direct access to the spied threads and memory (transactions, bulk transfers)
+    Tracer& getTracer();
+
+    // SINGLE_THREADED : the callbacks are run by the tracer thread, they must not wait for a spied thread state
+    // change (e.g. stop or single step). SIGCHLD stays blocked on the thread having created the spied program,
+    // threads created before it must block it too.
+    void start(E_EventEngine engine = THREADED);
+    // All-stop : the threads are interrupted (or resumed) together, stop waits for all of them to report
+    bool resume();
+    bool stop();
     void terminate();
 };
 
 static const size_t stackSize = 1<<23;
+static const std::chrono::seconds stopTimeout(5);
 
 template<typename ... ARGS>
 SpiedProgram::SpiedProgram(const std::string& progName, ARGS ... args) :
+_initialSigMask(blockChildSignal()),
 _argvStr({progName, args ...}),
 _argv(std::accumulate( _argvStr.begin(), _argvStr.end(), std::vector<const char*>(),
                        [](auto& v, const std::string& s) {
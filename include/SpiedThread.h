@@ -7,11 +7,15 @@
 #include <future>
 #include <mutex>
 #include <sys/user.h>
+#include <vector>
 
 #include "CallbackHandler.h"
+#include "RegisterCache.h"
+#include "ThreadBarrier.h"
+#include "Tracer.h"
 #include "WatchPoint.h"
+#include "X86Instruction.h"
 
-class Tracer;
 class SpiedProgram;
 
 class SpiedThread {
@@ -32,22 +36,41 @@ public:
 
     pid_t getTid() const;
 
+    E_State getState();
     void setState(E_State state);
 
     bool handleEvent(E_State state, int signal, int status, uint16_t ptraceEvent);
 
-    void jump(void* addr);
+    // Return false if the registers of the thread cannot be read
+    bool jump(void* addr);
 
     bool resume(int signum = 0);
     bool singleStep();
     bool stop();
     bool terminate();
 
+    // Append the requests needed to resume/single step the thread to a transaction
+    void prepareResume(Tracer::Transaction& transaction, int signum = 0);
+    void prepareSingleStep(Tracer::Transaction& transaction);
+    // Single step the instruction located at from, relocated to to, and continue as if it had been executed in place.
+    // Return false, appending nothing, if the registers of the thread cannot be read.
+    bool prepareDisplacedStep(Tracer::Transaction& transaction, uint64_t from, uint64_t to,
+                              const X86Instruction& instruction, size_t relocatedLength);
+
+    // Append a PTRACE_INTERRUPT to the transaction (unless one is already pending) and make barrier wait for the
+    // thread to stop, return false if the thread is already stopped (or dead)
+    bool prepareStop(Tracer::Transaction& transaction, ThreadBarrier& barrier);
+    // Stop reporting to the barrier, e.g. after it timed out
+    void leaveBarrier(ThreadBarrier& barrier);
     bool backtrace();
     bool detach();
 
+    // 0 if the registers of the thread cannot be read
     uint64_t getRip();
 
+    // Registers are fetched on first access and only modified sets are written back when resuming
+    RegisterCache& getRegisters();
+
     inline bool operator==(pid_t tid) const{
         return tid == _tid;
     }
@@ -56,14 +79,10 @@ public:
     void deleteWatchPoint(WatchPoint* watchPoint);
 
 private:
-    typedef enum {
-        OLD,
-        SYNC,
-        NEW
-    } E_RegSync;
+    void prepareRegisters(Tracer::Transaction& transaction);
 
-    void readRegisters();
-    void writeRegisters();
+    static long markContinued(void* spiedThread);
+    static long fixupDisplacedStep(void* spiedThread);
 
     uint64_t getRbp();
     uint64_t getDr6();
@@ -71,13 +90,16 @@ private:
 
     const pid_t _tid;
 
-    struct user_regs_struct _regs;
-    std::future<std::pair<long, int>> _futureRegs;
+    RegisterCache _registers;
 
-    uint64_t _dr6;
-    std::future<std::pair<long, int>> _futureDr6;
-
-    E_RegSync _regSync;
+    // At most one displaced step in flight per thread
+    struct {
+        uint64_t from;
+        uint64_t to;
+        size_t length;
+        size_t relocatedLength;
+        bool isCall;
+    } _displacedStep;
 
     std::recursive_mutex _stateMutex;
     std::condition_variable_any _stateCV;
@@ -85,6 +107,10 @@ private:
     E_State _state;
 
     bool _isSigTrapExpected;
+    bool _isInterruptPending;
+
+    // Every stop request waiting for the thread, overlapping requests share its pending interrupt
+    std::vector<ThreadBarrier*> _barriers;
 
     std::vector<std::pair<std::unique_ptr<WatchPoint>, bool>> _watchPoints;
     Tracer& _tracer;
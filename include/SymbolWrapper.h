@@ -0,0 +1,91 @@
+#ifndef SPYTESTER_SYMBOLWRAPPER_H
+#define SPYTESTER_SYMBOLWRAPPER_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+#include "DynamicNamespace.h"
+#include "Tracer.h"
+#include "WrapScope.h"
+#include "helpers/Rcu.h"
+
+// Wrapper of a dynamic symbol known by its name only, called through a generic trampoline patched in the
+// relocations of a module (or of every module of the namespace if binName is empty). The handler receives the System V argument registers and the caller stack,
+// so any signature (including variadic functions) can be inspected.
+class SymbolWrapper {
+public:
+    struct Vec128 {
+        uint64_t low;
+        uint64_t high;
+    };
+
+    // Saved by the trampoline, modifications are applied when the call goes on
+    struct CallContext {
+        uint64_t rdi, rsi, rdx, rcx, r8, r9;
+        // Number of vector registers used by a variadic call (al), return value
+        uint64_t rax;
+        // First argument passed on the stack (just above the return address)
+        uint64_t* stack;
+        Vec128 xmm[8];
+
+        // Integer class argument, idx is its rank among the integer arguments
+        uint64_t getArg(uint32_t idx) const;
+        void setArg(uint32_t idx, uint64_t val);
+        uint64_t getReturnAddress() const { return stack[-1]; }
+    };
+
+    typedef enum {
+        CALL_ORIGINAL,  // Jump to the wrapped function with the (modified) registers
+        RETURN          // Return to the caller, rax/rdx/xmm0/xmm1 of the context being the return value
+    } E_Action;
+
+    // Called concurrently by the spied threads
+    using Handler = std::function<E_Action(CallContext&)>;
+
+    // Throw std::invalid_argument if the symbol or its relocation in binName cannot be found
+    SymbolWrapper(Tracer& tracer, DynamicNamespace& spiedNamespace, const std::string& binName,
+                  std::string symbolName);
+    SymbolWrapper(const SymbolWrapper&) = delete;
+    // Wait for the calls still running the handler, it must not be called from a handler
+    ~SymbolWrapper();
+
+    const std::string& getSymbolName() const;
+    void* getWrappedFunction() const;
+
+    // Wait for the calls still running the previous handler, it must not be called from a handler
+    void setHandler(Handler&& handler);
+    bool wrapping(bool active);
+
+private:
+    static const size_t trampolineSize = 384;
+    static const size_t contextSize = 192;
+
+    // Referenced by the trampoline, which is never released : both outlive the wrapper.
+    // The handler is removed before the wrapper goes away, the later calls go on to the wrapped function.
+    struct Dispatch {
+        std::atomic<Handler*> handler;
+        Rcu rcu;
+        const std::string symbolName;
+    };
+
+    static uint64_t dispatch(CallContext* context, Dispatch* dispatch);
+
+    bool buildTrampoline();
+    void replaceHandler(Handler* handler);
+
+    Tracer& _tracer;
+    const std::string _binName;
+    const std::string _symbolName;
+
+    void* _wrappedFunction;
+    WrapScope _scope;
+    void* _trampoline;
+
+    Dispatch* _dispatch;
+};
+
+
+#endif //SPYTESTER_SYMBOLWRAPPER_H
@@ -0,0 +1,46 @@
+#ifndef SPYTESTER_THREADBARRIER_H
+#define SPYTESTER_THREADBARRIER_H
+
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// Completes once every expected spied thread has reported the awaited state
+class ThreadBarrier {
+public:
+    ThreadBarrier() : _expectedNb(0) {}
+    ThreadBarrier(const ThreadBarrier&) = delete;
+    ThreadBarrier& operator=(const ThreadBarrier&) = delete;
+
+    void expect() {
+        std::lock_guard lk(_mutex);
+        _expectedNb++;
+    }
+
+    void arrive() {
+        std::lock_guard lk(_mutex);
+        if(_expectedNb > 0 && --_expectedNb == 0)
+            _cv.notify_all();
+    }
+
+    template<typename Rep, typename Period>
+    bool waitFor(const std::chrono::duration<Rep, Period>& timeout) {
+        std::unique_lock lk(_mutex);
+        return _cv.wait_for(lk, timeout, [this]{ return _expectedNb == 0; });
+    }
+
+    size_t remaining() {
+        std::lock_guard lk(_mutex);
+        return _expectedNb;
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    size_t _expectedNb;
+};
+
+
+#endif //SPYTESTER_THREADBARRIER_H
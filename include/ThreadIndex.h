@@ -0,0 +1,68 @@
+#ifndef SPYTESTER_THREADINDEX_H
+#define SPYTESTER_THREADINDEX_H
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <sys/types.h>
+
+// Small index given to each thread on its first call (0, 1, 2...), used to pick a per-thread slot,
+// and cached tid. Both are kept in initial-exec TLS so the spied threads read them without a call.
+// The index of an exited thread is given to the next new thread, so the indexes stay dense.
+class ThreadIndex {
+public:
+    // Index of a thread which is exiting (greater than any other)
+    static const uint32_t released = UINT32_MAX - 1;
+
+    static uint32_t get();
+    static pid_t getTid();
+};
+
+// Objects allocated on the first use of each thread, indexed by ThreadIndex.
+// The last one is shared by the threads beyond maxThreadNb, its writes must be synchronized by the user.
+template<typename T>
+class ThreadSlots {
+public:
+    static const uint32_t maxThreadNb = 256;
+
+    ThreadSlots() : _slots(new std::atomic<T*>[maxThreadNb]) {
+        for(uint32_t idx = 0; idx < maxThreadNb; idx++)
+            _slots[idx].store(nullptr, std::memory_order_relaxed);
+    }
+    ThreadSlots(const ThreadSlots&) = delete;
+    ~ThreadSlots() {
+        for(uint32_t idx = 0; idx < maxThreadNb; idx++)
+            delete _slots[idx].load(std::memory_order_relaxed);
+    }
+
+    static uint32_t getIndex() { return std::min(ThreadIndex::get(), maxThreadNb - 1); }
+    static bool isShared(uint32_t idx) { return idx == maxThreadNb - 1; }
+
+    // Slot of idx, built by create() if it does not exist yet
+    template<typename F>
+    T* get(uint32_t idx, F&& create) {
+        T* slot = _slots[idx].load(std::memory_order_acquire);
+        if(slot != nullptr)
+            return slot;
+
+        // Only the shared slot may be allocated concurrently
+        T* newSlot = create();
+        if(!_slots[idx].compare_exchange_strong(slot, newSlot, std::memory_order_acq_rel)) {
+            delete newSlot;
+            return slot;
+        }
+
+        return newSlot;
+    }
+
+    // nullptr if no thread used idx yet
+    T* find(uint32_t idx) const { return _slots[idx].load(std::memory_order_acquire); }
+
+private:
+    std::unique_ptr<std::atomic<T*>[]> _slots;
+};
+
+
+#endif //SPYTESTER_THREADINDEX_H
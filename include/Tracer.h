@@ -1,28 +1,133 @@
 #ifndef SPYTESTER_TRACER_H
 #define SPYTESTER_TRACER_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
 #include <cstring>
 #include <functional>
+#include <future>
 #include <iostream>
-#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
-#include <queue>
-#include <semaphore.h>
 #include <set>
 #include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
 #include <thread>
+#include <type_traits>
+#include <vector>
 
+#include "CodeArena.h"
 #include "DynamicNamespace.h"
-#include "SpiedThread.h"
+#include "MemoryPatcher.h"
+#include "MpscRing.h"
+#include "helpers/Span.h"
 
 class SpiedProgram;
 class DynamicLinker;
 
 class Tracer {
+private:
+    struct PendingTransaction;
+
 public :
+    using Result = std::pair<long, int>;
+
+    // Longest transaction accepted by commit, the result of every step is kept in its preallocated record
+    static const size_t maxSteps = 64;
+
+    // Sequence of ptrace requests executed back to back by the tracer thread, with a single wake-up
+    class Transaction {
+    public:
+        using SyncFunction = long(*)(void*);
+
+        Transaction& setRegs(pid_t tid, struct user_regs_struct* regs);
+        Transaction& setRegSet(pid_t tid, uint64_t type, struct iovec* regSet);
+        Transaction& peekUser(pid_t tid, uint64_t offset);
+        Transaction& pokeUser(pid_t tid, uint64_t offset, uint64_t val);
+        Transaction& modifyUser(pid_t tid, uint64_t offset, uint64_t clearMask, uint64_t setMask);
+        Transaction& pokeData(void* addr, uint64_t val);
+        // In-process store of up to 8 bytes, consecutive patches are written as one MemoryPatcher batch
+        Transaction& patch(void* addr, const void* data, size_t len);
+        Transaction& singleStep(pid_t tid);
+        Transaction& cont(pid_t tid, int signum = 0);
+        Transaction& interrupt(pid_t tid);
+
+        // Park the remaining steps until Tracer::notifyStop(tid) is called
+        Transaction& awaitStop(pid_t tid);
+        // Call function(param) from the tracer thread, it must return -1 and set errno on failure
+        Transaction& sync(SyncFunction function, void* param);
+
+        // Steps do not rely on each other (e.g. one request per thread), a failure does not cancel the following ones
+        Transaction& independent();
+
+        bool isAwaiting(pid_t tid) const;
+        bool empty() const;
+        size_t size() const;
+
+    private:
+        friend Tracer;
+
+        typedef enum {
+            PTRACE,
+            POKEDATA,
+            MODIFY_USER,
+            PATCH,
+            AWAIT_STOP,
+            SYNC
+        } E_StepType;
+
+        struct Step {
+            E_StepType type;
+            enum __ptrace_request request;
+            pid_t tid;
+            void* addr;
+            void* data;
+            uint64_t mask;
+            SyncFunction function;
+        };
+
+        Transaction& append(const Step& step);
+
+        std::vector<Step> _steps;
+        bool _isIndependent = false;
+    };
+
+    // Handle on a preallocated completion slot, to be polled or waited on instead of using a future.
+    // Dropping a handle before the request is executed gives the slot back once it is.
+    class Completion {
+    public:
+        Completion() : _tracer(nullptr), _ticket(0), _transaction(nullptr) {}
+        Completion(Completion&& other) noexcept;
+        Completion(const Completion&) = delete;
+        ~Completion();
+
+        Completion& operator=(Completion&& other) noexcept;
+        Completion& operator=(const Completion&) = delete;
+
+        bool valid() const { return _ticket != 0; }
+
+        // Result of every step of a transaction, in order, once it has been polled or waited for (empty before).
+        // Steps cancelled by a previous failure report ECANCELED.
+        Span<const Result> getResults() const;
+
+    private:
+        friend Tracer;
+        Completion(Tracer* tracer, uint64_t ticket, PendingTransaction* transaction = nullptr)
+        : _tracer(tracer), _ticket(ticket), _transaction(transaction) {}
+
+        void reset();
+
+        Tracer* _tracer;
+        uint64_t _ticket;
+        // Kept reserved until the handle is dropped, so that the step results stay readable
+        PendingTransaction* _transaction;
+    };
+
+    using EventHandler = std::function<void(pid_t, int)>;
 
     Tracer();
     Tracer(const Tracer&) = delete;
@@ -31,15 +136,57 @@ public :
 
     pid_t startTracing(DynamicNamespace& spiedNamespace);
 
-    template<typename ... Args>
-    std::future<std::pair<long, int>>
-    commandPTrace(enum __ptrace_request request, Args ... args);
+    // Synchronous request, submitPTrace then wait
+    template<typename TADDR, typename TDATA>
+    Result commandPTrace(enum __ptrace_request request, pid_t tid, TADDR addr, TDATA data);
+
+    template<typename TADDR, typename TDATA>
+    Completion submitPTrace(enum __ptrace_request request, pid_t tid, TADDR addr, TDATA data);
+
+    // Return true and release the slot once the request has been executed
+    bool poll(Completion& completion, Result& result);
+    // Spin for a while then sleep until the request has been executed
+    Result wait(Completion& completion);
+    // Same, return false if the request has not been executed before timeout
+    bool waitFor(Completion& completion, std::chrono::milliseconds timeout, Result& result);
+
+    Result writeWord(void* addr, uint64_t val);
+
+    // Synchronous bulk transfers (process_vm_readv/writev, /proc/<pid>/mem for protected pages),
+    // return the number of bytes transferred or -1 if nothing could be transferred
+    ssize_t readMemory(const void* addr, void* buf, size_t len);
+    ssize_t writeMemory(void* addr, const void* buf, size_t len);
+    ssize_t readMemory(const struct iovec* local, size_t localNb, const struct iovec* remote, size_t remoteNb);
+    ssize_t writeMemory(const struct iovec* local, size_t localNb, const struct iovec* remote, size_t remoteNb);
+
+    // Synchronously write a word, either with a direct store in the shared address space or with PTRACE_POKEDATA
+    bool patchWord(void* addr, uint64_t val);
+    // Same for several words, written in one batch (or one transaction)
+    bool patchWords(const std::vector<std::pair<void*, uint64_t>>& words);
 
-    std::future<std::pair<long, int>>
-    writeWord(void* addr, uint64_t val);
+    // The tracee shares our address space (CLONE_VM), so code and GOT patches can bypass ptrace
+    void setInProcessPatching(bool active);
+    bool isPatchingInProcess() const;
+
+    // Executable memory shared with the spied program, for code relocated out of its original location
+    CodeArena& getCodeArena();
+
+    // The result of a transaction is the one of its first failed step, or of its last step. Transactions longer than
+    // maxSteps are rejected with E2BIG.
+    Completion commit(Transaction&& transaction);
+    void notifyStop(pid_t tid);
+    // Drop the remaining steps of a transaction parked on a stop, it then completes with ECANCELED. Return false if
+    // it was not parked anymore (e.g. the stop was reported meanwhile), its completion then holds its actual result.
+    bool cancel(Completion& completion);
+
+    static bool succeeded(const Result& result);
 
     int tkill(pid_t tid, int sig);
 
+    // Let the tracer thread wait for the spied program state changes and call handler(tid, wstatus) itself
+    void startEventLoop(EventHandler&& handler);
+    bool isTracerThread() const;
+
 private:
     typedef enum {
         NOT_STARTED,
@@ -48,45 +195,156 @@ private:
         STOPPED,
     } E_State;
 
+    typedef enum {
+        FREE,
+        PENDING,
+        WAITED,
+        ABANDONED,
+        DONE
+    } E_CompletionState;
+
+    struct alignas(64) CompletionSlot {
+        std::atomic<uint32_t> state;
+        uint64_t ticket;
+        Result result;
+    };
+
+    // Preallocated record of a committed transaction, the steps are copied in so that its capacity is reused
+    struct PendingTransaction {
+        std::atomic<bool> isUsed;
+        // The tracer thread and the completion handle, the last one to let go frees the record
+        std::atomic<uint32_t> owners;
+        std::vector<Transaction::Step> steps;
+        bool isIndependent;
+        size_t next;
+        Result result;
+        Result results[maxSteps];
+        CompletionSlot* completion;
+        // Set while the remaining steps are parked until notifyStop(awaitedTid)
+        pid_t awaitedTid;
+    };
+
+    typedef enum {
+        PTRACE_REQUEST,
+        TKILL,
+        TRANSACTION,
+        NOTIFY_STOP,
+        ENABLE_EVENT_LOOP,
+        CANCEL
+    } E_CommandType;
+
+    // Fixed-size record stored in the command ring
+    struct Command {
+        E_CommandType type;
+        enum __ptrace_request request;
+        pid_t tid;
+        void* addr;
+        void* data;
+        CompletionSlot* completion;
+        PendingTransaction* transaction;
+    };
+
+    static const size_t commandsNb = 1024;
+    static const size_t completionsNb = 256;
+    static const size_t transactionsNb = 64;
+    static const uint32_t spinNb = 4096;
+    static const int eventLoopTimeoutMs = 10;
+
     static int preStart(void* param);
 
+    template<typename T>
+    static void* toWord(T val);
+
     void* _stack;
 
     pid_t _traceePid;
+    int _memFd;
+
+    // The starter waits for this flag before running anything, it is set once the tracer seized it
+    DynamicNamespace* _spiedNamespace;
+    std::atomic<bool> _isTraceeSeized;
 
     std::thread _tracer;
+    std::thread::id _tracerId;
 
     volatile E_State _state;
     std::mutex _stateMutex;
     std::condition_variable _stateCV;
 
-    sem_t _cmdsSem;
-    std::mutex _cmdsMutex;
+    std::atomic<bool> _inProcessPatching;
+
+    CodeArena _codeArena;
+
+    MpscRing<Command, commandsNb> _commands;
+    std::atomic<bool> _sleeping;
+
+    // Tracer thread wakes up on commands (eventfd) and, in event loop mode, on children state changes
+    int _epollFd;
+    int _wakeFd;
+    int _signalFd;
+    int _pidFd;
+    bool _isEventLoop;
+    EventHandler _eventHandler;
+
+    CompletionSlot _completions[completionsNb];
+    std::atomic<uint64_t> _completionTicket;
+
+    PendingTransaction _transactions[transactionsNb];
+    std::atomic<uint64_t> _transactionTicket;
+
+    // Only used by the tracer thread
+    MemoryPatcher::Batch _patchBatch;
 
-    std::queue<std::function<void()>, std::list<std::function<void()>>> _commands;
+    void push(const Command& command);
+    CompletionSlot& reserveCompletion(uint64_t& ticket);
+    PendingTransaction& reserveTransaction();
+    void release(Completion& completion);
+    static void release(PendingTransaction& pending);
+    static void complete(CompletionSlot& slot, const Result& result);
+    void handleCommand(Command& command);
+
+    void waitEvents();
+    void reapChildren();
+    void enableEventLoop();
+
+    ssize_t transferMemory(bool write, const struct iovec* local, size_t localNb,
+                           const struct iovec* remote, size_t remoteNb);
+    ssize_t transferMemoryFallback(bool write, const struct iovec* local, size_t localNb,
+                                   const struct iovec* remote, size_t remoteNb, size_t offset);
 
     void setState(E_State state);
+    void run(PendingTransaction& pending);
+    Result execute(const Transaction::Step& step);
+    Result executePatches(PendingTransaction& pending);
     void trace(DynamicNamespace &spiedNamespace, std::promise<pid_t> promise);
     void createTracee(DynamicNamespace &spiedNamespace);
 };
 
-template<typename ... Args>
-std::future<std::pair<long, int>>
-Tracer::commandPTrace(enum __ptrace_request request, Args ... args)
+template<typename T>
+void* Tracer::toWord(T val) {
+    if constexpr (std::is_pointer_v<T> || std::is_null_pointer_v<T>) {
+        return (void*)val;
+    } else {
+        return (void*)(uintptr_t)val;
+    }
+}
+
+template<typename TADDR, typename TDATA>
+Tracer::Result Tracer::commandPTrace(enum __ptrace_request request, pid_t tid, TADDR addr, TDATA data)
 {
-    auto promise = std::make_shared< std::promise<std::pair<long, int>> >();
-    auto future = promise->get_future();
+    auto completion = submitPTrace(request, tid, addr, data);
+    return wait(completion);
+}
 
-    _cmdsMutex.lock();
-    _commands.emplace([promise, request, args ...]{
-        long res = ptrace(request, args ...);
-        promise->set_value(std::make_pair(res, errno));
-    });
+template<typename TADDR, typename TDATA>
+Tracer::Completion Tracer::submitPTrace(enum __ptrace_request request, pid_t tid, TADDR addr, TDATA data)
+{
+    uint64_t ticket;
+    CompletionSlot& slot = reserveCompletion(ticket);
 
-    _cmdsMutex.unlock();
-    sem_post(&_cmdsSem);
+    push({PTRACE_REQUEST, request, tid, toWord(addr), toWord(data), &slot, nullptr});
 
-    return future;
+    return Completion(this, ticket);
 }
 
 #endif //SPYTESTER_TRACER_H
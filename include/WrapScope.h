@@ -0,0 +1,50 @@
+#ifndef SPYTESTER_WRAPSCOPE_H
+#define SPYTESTER_WRAPSCOPE_H
+
+
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "DynamicNamespace.h"
+#include "Tracer.h"
+
+// GOT slots (GLOB_DAT and JUMP_SLOT relocations) through which a module, or every module of a namespace
+// when binName is empty, calls a function. In the namespace case, the modules added later are redirected too.
+// The slots of a module unloaded from the namespace are restored and dropped.
+class WrapScope {
+public:
+    WrapScope(Tracer& tracer, DynamicNamespace& spiedNamespace, const std::string& binName,
+              std::string symbolName, void* original);
+    WrapScope(const WrapScope&) = delete;
+    // Restore the original function in all the slots
+    ~WrapScope();
+
+    // Write target (the original function if nullptr) in all the slots, in one batch.
+    // The slots are left untouched until a first target is set.
+    bool redirect(void* target);
+
+    bool empty() const;
+    // False if binName cannot be loaded
+    bool isValid() const;
+
+private:
+    void addModule(DynamicModule& module);
+    // Restore the original function in the slots of the module and forget them
+    void removeModule(DynamicModule& module);
+
+    Tracer& _tracer;
+    DynamicNamespace& _spiedNamespace;
+    const std::string _symbolName;
+    void* const _original;
+
+    mutable std::mutex _mutex;
+    bool _isValid;
+    std::vector<uint64_t*> _slots;
+    void* _target;
+    std::optional<uint32_t> _observerId;
+};
+
+
+#endif //SPYTESTER_WRAPSCOPE_H
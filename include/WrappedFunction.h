@@ -10,16 +10,32 @@
 #include <string>
 #include <sys/ptrace.h>
 
+#include "CallProfiler.h"
+#include "CallRecorder.h"
+#include "CallReplayer.h"
 #include "Tracer.h"
-#include "Meta.h"
 #include "Logger.h"
-
-#ifndef WRAPPER_MAX_NB
-#define WRAPPER_MAX_NB 10
-#endif
+#include "WrapScope.h"
+#include "WrapperThunk.h"
+#include "helpers/Rcu.h"
 
 struct AbstractWrappedFunction{
     virtual ~AbstractWrappedFunction() = default;
+    virtual const CallProfiler& getProfiler() const = 0;
+};
+
+template<typename T>
+struct FunctionSignature;
+
+template<typename TRET, typename ... TARGS>
+struct FunctionSignature<TRET(*)(TARGS ...)> {
+    static constexpr uint32_t argsSize = (0 + ... + (uint32_t)sizeof(TARGS));
+    static constexpr uint32_t returnSize = []{
+        if constexpr (std::is_void_v<TRET>) return 0U; else return (uint32_t)sizeof(TRET);
+    }();
+    // Arguments and return value are recorded as raw bytes (pointed data is not)
+    static constexpr bool isRecordable = (std::is_trivially_copyable_v<TARGS> && ...)
+            && (std::is_void_v<TRET> || (std::is_trivially_copyable_v<TRET> && std::is_default_constructible_v<TRET>));
 };
 
 template<auto faddr>
@@ -27,163 +43,241 @@ class WrappedFunction : public AbstractWrappedFunction{
 
     using FctPtrType = decltype(faddr);
     using FctType = decltype(std::function(std::declval<FctPtrType>()));
+    using Signature = FunctionSignature<FctPtrType>;
 
 public:
+    // An empty binName wraps the calls made by every module of the namespace, including the ones loaded later
     WrappedFunction(Tracer& tracer, DynamicNamespace& dynamicNamespace, std::string binName);
 
+    // Wait for the calls still running the previous wrapper, it must not be called from a wrapper
     void setWrapper(FctType&& wrapper);
     bool wrapping(bool active);
 
+    // Count and time the calls going through the wrapper (whether a dynamic wrapper is set or not)
+    void profiling(bool active);
+    const CallProfiler& getProfiler() const override;
+
+    // Record the arguments and return value of each call in path. Return false if the file cannot be created
+    bool startRecording(const std::string& path);
+    void stopRecording();
+    // Return the values recorded in path instead of calling the function, until they were all served
+    bool startReplay(const std::string& path);
+    void stopReplay();
+
+    // Wait for the calls still running the wrappers, it must not be called from a wrapper
     ~WrappedFunction() override;
 
 private:
+    // Context of the thunk patched in the relocation. A thread may be anywhere between the thunk and the
+    // dispatcher when the relocation is restored : neither is ever released, like the tracepoint trampolines.
     struct Wrapper {
-        FctPtrType staticWrapper;
         FctPtrType wrappedFunction;
-        FctType dynamicWrapper;
-        std::mutex wrapperMutex;
-        Wrapper() : wrappedFunction(faddr), staticWrapper(nullptr){}
-    };
-
-    struct Wrappers {
-        std::array<Wrapper, WRAPPER_MAX_NB> wrappers;
-        std::vector<Wrapper*> available;
-
-        Wrappers(){
-            constexpr_for<0, WRAPPER_MAX_NB, 1U>([this](auto idx){
-                wrappers[idx].staticWrapper = getStaticWrapper<idx>(faddr);
-                available.push_back(&wrappers[idx]);
-            });
-        }
-
-        Wrapper& operator[](uint32_t idx){ return wrappers[idx];}
+        // Read without lock by the dispatcher, the replaced one is freed once no call uses it
+        std::atomic<FctType*> dynamicWrapper;
+        // Held across the dynamic wrapper calls
+        Rcu rcu;
+        std::atomic<CallRecorder*> recorder;
+        std::atomic<CallReplayer*> replayer;
+        // Only held around the recorder and replayer accesses, never across a call
+        Rcu traceRcu;
+        void* thunk;
+        CallProfiler profiler;
+        Wrapper(FctPtrType wrappedFunction, std::string name) :
+            wrappedFunction(wrappedFunction), dynamicWrapper(nullptr), recorder(nullptr), replayer(nullptr),
+            thunk(nullptr), profiler(std::move(name)){}
     };
 
-    static std::mutex freeWrappersMutex;
-    static Wrappers wrappers;
+    // Publish obj and free the previous one once no reader of rcu uses it
+    template<typename T>
+    static void replace(Rcu& rcu, std::atomic<T*>& published, T* obj);
 
-    static Wrapper& getWrapper(FctPtrType wrappedFunction);
-    static void releaseWrapper(Wrapper& wrapper);
-
-    template<uint32_t idx, typename TRET, typename ... TARGS>
-    static FctPtrType getStaticWrapper(TRET(*fct)(TARGS ...));
+    // Shared by all the thunks of the function
+    template<typename TRET, typename ... TARGS>
+    static FctPtrType getDispatcher(TRET(*fct)(TARGS ...));
 
     Tracer& _tracer;
     DynamicNamespace& _spiedNamespace;
+    const std::string _symbolName;
     Wrapper& _wrapper;
     std::string _binName;
-    void* _relaAddr;
+    WrapScope _scope;
 };
 
 template<auto faddr>
-void WrappedFunction<faddr>::releaseWrapper(WrappedFunction::Wrapper &wrapper) {
-    std::lock_guard lk(freeWrappersMutex);
-
-        wrapper.wrapperMutex.lock();
-    wrapper.dynamicWrapper = FctType();
-    wrapper.wrapperMutex.unlock();
-
-    wrappers.available.push_back(&wrapper);
-}
-
-template<auto faddr>
-typename WrappedFunction<faddr>::Wrapper &WrappedFunction<faddr>::getWrapper(FctPtrType wrappedFunction) {
-    std::lock_guard lk(freeWrappersMutex);
-    if(wrappers.available.empty())
-        error_log("No available wrapper for "<< (void*)faddr);
-
-
-    Wrapper& wrapper = *wrappers.available.back();
-    wrapper.wrappedFunction = wrappedFunction;
-    wrappers.available.pop_back();
-
-    return wrapper;
+template<typename T>
+void WrappedFunction<faddr>::replace(Rcu &rcu, std::atomic<T*> &published, T *obj) {
+    T* previous = published.exchange(obj, std::memory_order_seq_cst);
+    if(previous != nullptr) {
+        rcu.synchronize();
+        delete previous;
+    }
 }
 
 template<auto faddr>
-std::mutex WrappedFunction<faddr>::freeWrappersMutex;
-
-template<auto faddr>
-typename WrappedFunction<faddr>::Wrappers WrappedFunction<faddr>::wrappers;
-
-template<auto faddr>
-template<uint32_t idx, typename TRET, typename ... TARGS>
+template<typename TRET, typename ... TARGS>
 typename WrappedFunction<faddr>::FctPtrType
-WrappedFunction<faddr>::getStaticWrapper(TRET(*fct)(TARGS ...)) {
+WrappedFunction<faddr>::getDispatcher(TRET(*fct)(TARGS ...)) {
     return [](TARGS ... args) noexcept {
-        std::lock_guard lk(wrappers[idx].wrapperMutex);
-
-        try {
-            return wrappers[idx].dynamicWrapper(args ...);
-        } catch (const std::bad_function_call& e){
-            error_log("WrapperFctPtr : " << e.what());
-            return wrappers[idx].wrappedFunction(args ...);
-        }
+        Wrapper& wrapper = *(Wrapper*)WrapperThunk::getContext();
+
+        auto call = [](Wrapper& wrapper, TARGS ... args) {
+            // Pass-through without entering the wrapper read section
+            if(wrapper.dynamicWrapper.load(std::memory_order_relaxed) == nullptr)
+                return wrapper.wrappedFunction(args ...);
+
+            Rcu::ReadGuard guard(wrapper.rcu);
+            FctType* dynamicWrapper = wrapper.dynamicWrapper.load(std::memory_order_seq_cst);
+
+            return dynamicWrapper != nullptr ? (*dynamicWrapper)(args ...) : wrapper.wrappedFunction(args ...);
+        };
+
+        // Recorded once the call returned : a blocked call does not delay stopRecording
+        auto record = [](Wrapper& wrapper, const void* packedArgs, const void* ret) {
+            Rcu::ReadGuard guard(wrapper.traceRcu);
+            CallRecorder* recorder = wrapper.recorder.load(std::memory_order_seq_cst);
+            if(recorder != nullptr)
+                recorder->record(packedArgs, ret);
+        };
+
+        auto tracedCall = [call, record](Wrapper& wrapper, TARGS ... args) -> TRET {
+            if constexpr (Signature::isRecordable) {
+                if(wrapper.recorder.load(std::memory_order_relaxed) == nullptr
+                   && wrapper.replayer.load(std::memory_order_relaxed) == nullptr)
+                    return call(wrapper, args ...);
+
+                // Once the recorded values are exhausted, the function is called again
+                if(wrapper.replayer.load(std::memory_order_relaxed) != nullptr) {
+                    Rcu::ReadGuard guard(wrapper.traceRcu);
+                    CallReplayer* replayer = wrapper.replayer.load(std::memory_order_seq_cst);
+
+                    if constexpr (std::is_void_v<TRET>) {
+                        if(replayer != nullptr && replayer->next(nullptr))
+                            return;
+                    } else {
+                        TRET ret;
+                        if(replayer != nullptr && replayer->next(&ret))
+                            return ret;
+                    }
+                }
+
+                if(wrapper.recorder.load(std::memory_order_relaxed) == nullptr)
+                    return call(wrapper, args ...);
+
+                uint8_t packedArgs[Signature::argsSize + 1];
+                uint8_t* argPtr = packedArgs;
+                ((memcpy(argPtr, &args, sizeof(TARGS)), argPtr += sizeof(TARGS)), ...);
+
+                // Recorded by the recorder set when the call returns
+                if constexpr (std::is_void_v<TRET>) {
+                    call(wrapper, args ...);
+                    record(wrapper, packedArgs, nullptr);
+                } else {
+                    TRET ret = call(wrapper, args ...);
+                    record(wrapper, packedArgs, &ret);
+                    return ret;
+                }
+            } else {
+                return call(wrapper, args ...);
+            }
+        };
+
+        if(!wrapper.profiler.isActive())
+            return tracedCall(wrapper, args ...);
+
+        CallProfiler::Timer timer(wrapper.profiler);
+        return tracedCall(wrapper, args ...);
     };
 }
 
 template<auto faddr>
 void WrappedFunction<faddr>::setWrapper(FctType&& wrapper){
-    std::lock_guard lk(_wrapper.wrapperMutex);
-    _wrapper.dynamicWrapper = wrapper;
+    replace(_wrapper.rcu, _wrapper.dynamicWrapper, wrapper ? new FctType(std::move(wrapper)) : nullptr);
 }
 
 template<auto faddr>
 WrappedFunction<faddr>::WrappedFunction(Tracer& tracer, DynamicNamespace& dynamicNamespace, std::string binName):
     _tracer(tracer), 
     _spiedNamespace(dynamicNamespace),
-    _relaAddr(nullptr), 
+    _symbolName(DynamicModule::getMangledName((void*)faddr)),
+    _wrapper(*new Wrapper((FctPtrType)_spiedNamespace.convertDynSymbolAddr((void*)faddr), _symbolName)),
     _binName(std::move(binName)),
-    _wrapper(getWrapper((FctPtrType)_spiedNamespace.convertDynSymbolAddr((void*)faddr))) {
+    _scope(tracer, dynamicNamespace, _binName, _symbolName, (void*)_wrapper.wrappedFunction) {
     if(!this->_wrapper.wrappedFunction) {
         error_log("Failed to find function (" << (void*)faddr << ") definition in spied namespace");
         std::invalid_argument("Cannot find function definition");
     }
 
-    DynamicModule* dynamicModule = _spiedNamespace.load(_binName);
-    if(!dynamicModule) {
-        error_log(_binName << " cannot be found or loaded in the spied namespace");
-        std::invalid_argument("Cannot find "+ _binName +" in the spied namespace");
-    }
+    _wrapper.thunk = WrapperThunk::create(_tracer.getCodeArena(), &_wrapper, (void*)getDispatcher(faddr));
 
-    std::string mangledFunctionName = DynamicModule::getMangledName((void*)faddr);
+    if(!_binName.empty() && _scope.empty())
+        error_log("Failed to find " << _symbolName << " in relocation table of " << _binName);
+}
 
-    auto findRela = [this, &mangledFunctionName](uint32_t type, const std::string& name, uint64_t* addr){
-        if((type == R_X86_64_GLOB_DAT || type == R_X86_64_JUMP_SLOT) && (name == mangledFunctionName))
-        {
-            _relaAddr = addr;
-            return false;
-        }
-        return true;
-    };
+template<auto faddr>
+bool WrappedFunction<faddr>::wrapping(bool active){
+    if(active && _wrapper.thunk == nullptr)
+        return false;
+
+    return _scope.redirect(active ? _wrapper.thunk : nullptr);
+}
+
+template<auto faddr>
+void WrappedFunction<faddr>::profiling(bool active) {
+    _wrapper.profiler.setActive(active);
+}
 
-    dynamicModule->iterateOverRelocations(findRela);
+template<auto faddr>
+const CallProfiler &WrappedFunction<faddr>::getProfiler() const {
+    return _wrapper.profiler;
+}
 
-    if(!_relaAddr) {
-        error_log("Failed to find for " << _wrapper.wrappedFunction << " in relocation table of " << _binName);
-        std::invalid_argument("Cannot find function in relocation table");
+template<auto faddr>
+bool WrappedFunction<faddr>::startRecording(const std::string &path) {
+    static_assert(Signature::isRecordable, "Arguments and return value must be trivially copyable");
+
+    try {
+        replace(_wrapper.traceRcu, _wrapper.recorder,
+                new CallRecorder(path, Signature::argsSize, Signature::returnSize));
+    } catch(std::invalid_argument&) {
+        return false;
     }
+    return true;
 }
 
 template<auto faddr>
-bool WrappedFunction<faddr>::wrapping(bool active){
-    void* addr = active ? (void*)_wrapper.staticWrapper : (void*)_wrapper.wrappedFunction;
-
-    if(_relaAddr != nullptr){
-        auto futureRes = _tracer.writeWord(_relaAddr, (uint64_t)addr);
-        auto res = futureRes.get();
-        if ( res.first == -1) {
-            error_log("WriteWord failed : " << strerror(res.second));
-            return false;
-        }
+void WrappedFunction<faddr>::stopRecording() {
+    replace(_wrapper.traceRcu, _wrapper.recorder, (CallRecorder*)nullptr);
+}
+
+template<auto faddr>
+bool WrappedFunction<faddr>::startReplay(const std::string &path) {
+    static_assert(Signature::isRecordable, "Arguments and return value must be trivially copyable");
+
+    try {
+        replace(_wrapper.traceRcu, _wrapper.replayer,
+                new CallReplayer(path, Signature::argsSize, Signature::returnSize));
+    } catch(std::invalid_argument& e) {
+        error_log("Cannot replay " << path << " (" << e.what() << ")");
+        return false;
     }
     return true;
 }
 
+template<auto faddr>
+void WrappedFunction<faddr>::stopReplay() {
+    replace(_wrapper.traceRcu, _wrapper.replayer, (CallReplayer*)nullptr);
+}
+
 template<auto faddr>
 WrappedFunction<faddr>::~WrappedFunction() {
-    this->_tracer.writeWord(_relaAddr, (uint64_t)_wrapper.wrappedFunction);
-    releaseWrapper(_wrapper);
+    _scope.redirect(nullptr);
+
+    // The calls still going through the thunk are then passed through, the thunk and its context are kept
+    replace(_wrapper.rcu, _wrapper.dynamicWrapper, (FctType*)nullptr);
+    replace(_wrapper.traceRcu, _wrapper.recorder, (CallRecorder*)nullptr);
+    replace(_wrapper.traceRcu, _wrapper.replayer, (CallReplayer*)nullptr);
+
+    info_log("Thunk of " << _symbolName << " at " << _wrapper.thunk << " is kept");
 }
 
 #endif //SPYTESTER_WRAPPEDFUNCTION_H
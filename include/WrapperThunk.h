@@ -0,0 +1,28 @@
+#ifndef SPYTESTER_WRAPPERTHUNK_H
+#define SPYTESTER_WRAPPERTHUNK_H
+
+
+#include <cstddef>
+
+#include "CodeArena.h"
+
+// Context of the wrapper being called, set by its thunk right before jumping to the dispatcher
+extern thread_local void* wrapperThunkContext __attribute__((tls_model("initial-exec")));
+
+// Stub generated at runtime in the code arena, patched in place of a wrapped function :
+//     movabs $context, %r11 ; mov %r11, %fs:wrapperThunkContext ; movabs $dispatcher, %r11 ; jmp *%r11
+// The arguments are left untouched, so one dispatcher per function type serves any number of wrappers.
+class WrapperThunk {
+public:
+    static const size_t thunkSize = 32;
+
+    // Return nullptr if no executable memory is available. Never released : a thread may be running it (or be
+    // about to) after it was unpatched, the context must outlive it too
+    static void* create(CodeArena& arena, void* context, void* dispatcher);
+
+    // Must be called first thing in the dispatcher, before anything which may go through another thunk
+    static void* getContext() { return wrapperThunkContext; }
+};
+
+
+#endif //SPYTESTER_WRAPPERTHUNK_H
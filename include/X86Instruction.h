@@ -0,0 +1,60 @@
+#ifndef SPYTESTER_X86INSTRUCTION_H
+#define SPYTESTER_X86INSTRUCTION_H
+
+
+#include <cstddef>
+#include <cstdint>
+
+// Length decoder for x86-64 instructions, keeping what is needed to execute a copy of the instruction
+// at another address (RIP-relative operand, relative branch).
+class X86Instruction {
+public:
+    static const size_t maxLength = 15;
+    // Size of the longest relocated instruction (prefixes + jcc rel32)
+    static const size_t maxRelocatedLength = maxLength + 6;
+
+    typedef enum {
+        NONE,
+        JMP_REL,
+        JCC_REL,
+        CALL_REL,
+        LOOP_REL,       // loop/jrcxz, only available with a 8 bits displacement
+        CALL_INDIRECT,
+        JMP_INDIRECT,
+        RET
+    } E_Branch;
+
+    // Return false if the bytes are not a valid (or supported) instruction
+    static bool decode(const uint8_t* code, size_t maxLen, X86Instruction& instruction);
+
+    // Write in out the equivalent of the instruction located at from, to be executed at to.
+    // Return the length of the relocated instruction or 0 if it cannot be relocated (out of reach displacement,
+    // loop/jrcxz, repeated string instruction whose single step would stop in the middle of the copy).
+    size_t relocate(const uint8_t* code, uint64_t from, uint64_t to, uint8_t* out) const;
+
+    size_t getLength() const { return _length; }
+    E_Branch getBranch() const { return _branch; }
+    bool isRipRelative() const { return _dispOffset != 0; }
+    bool isCall() const { return _branch == CALL_REL || _branch == CALL_INDIRECT; }
+    // rep/repne string instruction, stepped one iteration at a time
+    bool isRepeated() const { return _isRepeated; }
+
+    // Absolute target of a relative branch located at addr
+    uint64_t getBranchTarget(uint64_t addr) const;
+
+private:
+    uint8_t _length = 0;
+    uint8_t _prefixesLength = 0;
+    // Offset of the RIP-relative disp32 (0 if none)
+    uint8_t _dispOffset = 0;
+    // Offset and size of a relative branch displacement
+    uint8_t _relOffset = 0;
+    uint8_t _relSize = 0;
+    int32_t _rel = 0;
+    uint8_t _condition = 0;
+    E_Branch _branch = NONE;
+    bool _isRepeated = false;
+};
+
+
+#endif //SPYTESTER_X86INSTRUCTION_H
@@ -0,0 +1,48 @@
+#ifndef SPYTESTER_CODEEMITTER_H
+#define SPYTESTER_CODEEMITTER_H
+
+
+#include <cstdint>
+#include <initializer_list>
+#include <vector>
+
+// Machine code buffer for code generated at a known address
+class CodeEmitter {
+public:
+    explicit CodeEmitter(uint64_t base) : _base(base) {}
+
+    CodeEmitter& bytes(std::initializer_list<uint8_t> code) {
+        _code.insert(_code.end(), code);
+        return *this;
+    }
+
+    CodeEmitter& imm32(uint32_t val) {
+        for(uint32_t idx = 0; idx < sizeof(val); idx++)
+            _code.push_back((uint8_t)(val >> (8 * idx)));
+        return *this;
+    }
+
+    CodeEmitter& imm64(uint64_t val) {
+        for(uint32_t idx = 0; idx < sizeof(val); idx++)
+            _code.push_back((uint8_t)(val >> (8 * idx)));
+        return *this;
+    }
+
+    // Patch a rel32 previously emitted at offset so that it targets the current position
+    void bindRel32(size_t offset) {
+        auto rel = (uint32_t)(int32_t)(_code.size() - (offset + sizeof(uint32_t)));
+        for(uint32_t idx = 0; idx < sizeof(rel); idx++)
+            _code[offset + idx] = (uint8_t)(rel >> (8 * idx));
+    }
+
+    uint64_t here() const { return _base + _code.size(); }
+    size_t size() const { return _code.size(); }
+    std::vector<uint8_t>& code() { return _code; }
+
+private:
+    uint64_t _base;
+    std::vector<uint8_t> _code;
+};
+
+
+#endif //SPYTESTER_CODEEMITTER_H
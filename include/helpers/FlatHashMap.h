@@ -0,0 +1,154 @@
+#ifndef SPYTESTER_FLATHASHMAP_H
+#define SPYTESTER_FLATHASHMAP_H
+
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template<typename K>
+struct FlatHash {
+    uint64_t operator()(K key) const {
+        if constexpr (std::is_pointer_v<K>) {
+            return (uint64_t)(uintptr_t)key;
+        } else {
+            return (uint64_t)key;
+        }
+    }
+};
+
+// Open addressing hash map (linear probing, backward shift deletion) for small trivially comparable keys
+// (tids, addresses). Slots are stored in a single array, lookups touch one or two cache lines.
+// Not thread-safe.
+template<typename K, typename V, typename Hash = FlatHash<K>>
+class FlatHashMap {
+public:
+    FlatHashMap() : _size(0), _shift(64) {}
+
+    V* find(const K& key) {
+        if(_slots.empty())
+            return nullptr;
+
+        for(size_t idx = home(key);; idx = next(idx)) {
+            Slot& slot = _slots[idx];
+            if(!slot.isUsed)
+                return nullptr;
+            if(slot.key == key)
+                return &slot.value;
+        }
+    }
+
+    const V* find(const K& key) const {
+        return const_cast<FlatHashMap*>(this)->find(key);
+    }
+
+    // Return the value stored for key and whether it has just been inserted
+    std::pair<V*, bool> emplace(const K& key, V&& value) {
+        if((_size + 1) * 2 > _slots.size())
+            rehash(_slots.empty() ? minCapacity : _slots.size() * 2);
+
+        size_t idx = home(key);
+        for(; _slots[idx].isUsed; idx = next(idx)) {
+            if(_slots[idx].key == key)
+                return {&_slots[idx].value, false};
+        }
+
+        _slots[idx].key = key;
+        _slots[idx].value = std::move(value);
+        _slots[idx].isUsed = true;
+        _size++;
+
+        return {&_slots[idx].value, true};
+    }
+
+    bool erase(const K& key) {
+        if(_slots.empty())
+            return false;
+
+        size_t idx = home(key);
+        for(; _slots[idx].isUsed; idx = next(idx)) {
+            if(_slots[idx].key == key)
+                break;
+        }
+
+        if(!_slots[idx].isUsed)
+            return false;
+
+        // Shift back the following entries of the cluster instead of leaving a tombstone
+        for(size_t cur = next(idx); _slots[cur].isUsed; cur = next(cur)) {
+            size_t curHome = home(_slots[cur].key);
+            if(((cur - curHome) & mask()) >= ((cur - idx) & mask())) {
+                _slots[idx].key = _slots[cur].key;
+                _slots[idx].value = std::move(_slots[cur].value);
+                idx = cur;
+            }
+        }
+
+        _slots[idx].value = V();
+        _slots[idx].isUsed = false;
+        _size--;
+
+        return true;
+    }
+
+    template<typename F>
+    void forEach(F&& f) {
+        for(auto& slot : _slots) {
+            if(slot.isUsed)
+                f(slot.key, slot.value);
+        }
+    }
+
+    void clear() {
+        _slots.clear();
+        _size = 0;
+        _shift = 64;
+    }
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+private:
+    static const size_t minCapacity = 16;
+
+    struct Slot {
+        K key{};
+        V value{};
+        bool isUsed = false;
+    };
+
+    // Fibonacci hashing spreads sequential tids and aligned addresses over the table
+    size_t home(const K& key) const {
+        return (size_t)((Hash()(key) * 0x9E3779B97F4A7C15ULL) >> _shift);
+    }
+
+    size_t next(size_t idx) const {
+        return (idx + 1) & mask();
+    }
+
+    size_t mask() const {
+        return _slots.size() - 1;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> slots(capacity);
+        std::swap(slots, _slots);
+
+        _shift = 64 - (uint32_t)__builtin_ctzll(capacity);
+        _size = 0;
+
+        for(auto& slot : slots) {
+            if(slot.isUsed)
+                emplace(slot.key, std::move(slot.value));
+        }
+    }
+
+    std::vector<Slot> _slots;
+    size_t _size;
+    uint32_t _shift;
+};
+
+
+#endif //SPYTESTER_FLATHASHMAP_H
@@ -0,0 +1,65 @@
+#ifndef SPYTESTER_RCU_H
+#define SPYTESTER_RCU_H
+
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Two counters epoch based read-copy-update : readers never wait (two atomic increments),
+// the writer publishes the new object, then waits in synchronize() for the readers which may still
+// use the old one before freeing it.
+// A reader must not call synchronize() on the Rcu it is reading.
+class Rcu {
+public:
+    class ReadGuard {
+    public:
+        explicit ReadGuard(Rcu& rcu) : _rcu(rcu), _epoch(rcu.readLock()) {}
+        ReadGuard(const ReadGuard&) = delete;
+        ~ReadGuard() { _rcu.readUnlock(_epoch); }
+
+    private:
+        Rcu& _rcu;
+        uint32_t _epoch;
+    };
+
+    Rcu() : _epoch(0) {}
+    Rcu(const Rcu&) = delete;
+
+    uint32_t readLock() {
+        uint32_t epoch = _epoch.load(std::memory_order_seq_cst) & 1;
+        _readers[epoch].count.fetch_add(1, std::memory_order_seq_cst);
+        return epoch;
+    }
+
+    void readUnlock(uint32_t epoch) {
+        _readers[epoch].count.fetch_sub(1, std::memory_order_release);
+    }
+
+    // Wait for the readers which started before the call.
+    // A reader may load the epoch just before a flip and register after the drain, so both counters
+    // are drained one after the other.
+    void synchronize() {
+        std::lock_guard lk(_writerMutex);
+
+        for(uint32_t phase = 0; phase < 2; phase++) {
+            uint32_t epoch = _epoch.fetch_add(1, std::memory_order_seq_cst) & 1;
+            while(_readers[epoch].count.load(std::memory_order_acquire) != 0)
+                std::this_thread::yield();
+        }
+    }
+
+private:
+    // Each counter on its own cache line
+    struct alignas(64) Readers {
+        std::atomic<uint64_t> count{0};
+    };
+
+    std::atomic<uint32_t> _epoch;
+    Readers _readers[2];
+    std::mutex _writerMutex;
+};
+
+
+#endif //SPYTESTER_RCU_H
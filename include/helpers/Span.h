@@ -0,0 +1,29 @@
+#ifndef SPYTESTER_SPAN_H
+#define SPYTESTER_SPAN_H
+
+
+#include <cstddef>
+
+// Non owning view of contiguous elements (std::span is C++20)
+template<typename T>
+class Span {
+public:
+    Span() : _data(nullptr), _size(0) {}
+    Span(T* data, size_t size) : _data(data), _size(size) {}
+
+    T* data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    T& operator[](size_t idx) const { return _data[idx]; }
+
+    T* begin() const { return _data; }
+    T* end() const { return _data + _size; }
+
+private:
+    T* _data;
+    size_t _size;
+};
+
+
+#endif //SPYTESTER_SPAN_H
@@ -0,0 +1,59 @@
+#ifndef SPYTESTER_STRINGINTERNER_H
+#define SPYTESTER_STRINGINTERNER_H
+
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Unique id for each distinct string, so that names can be stored and compared as integers.
+// Ids are never released. Thread-safe.
+class StringInterner {
+public:
+    static const uint32_t invalidId = UINT32_MAX;
+
+    uint32_t intern(std::string_view str) {
+        {
+            std::shared_lock lk(_mutex);
+            auto it = _ids.find(str);
+            if(it != _ids.end())
+                return it->second;
+        }
+
+        std::unique_lock lk(_mutex);
+        auto it = _ids.find(str);
+        if(it != _ids.end())
+            return it->second;
+
+        // Deque elements are never moved, the views stay valid
+        auto id = (uint32_t)_strings.size();
+        const std::string& stored = _strings.emplace_back(str);
+        _ids.emplace(stored, id);
+
+        return id;
+    }
+
+    // Return invalidId if the string was never interned
+    uint32_t find(std::string_view str) const {
+        std::shared_lock lk(_mutex);
+        auto it = _ids.find(str);
+        return it != _ids.end() ? it->second : invalidId;
+    }
+
+    std::string_view get(uint32_t id) const {
+        std::shared_lock lk(_mutex);
+        return _strings[id];
+    }
+
+private:
+    mutable std::shared_mutex _mutex;
+    std::deque<std::string> _strings;
+    std::unordered_map<std::string_view, uint32_t> _ids;
+};
+
+
+#endif //SPYTESTER_STRINGINTERNER_H
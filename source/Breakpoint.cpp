@@ -1,54 +1,300 @@
+#include <algorithm>
 #include <iostream>
 #include <sys/procfs.h>
 
 #include "Breakpoint.h"
+#include "MemoryPatcher.h"
 
 BreakPoint::BreakPoint(Tracer &tracer, CallbackHandler &callbackHandler, const std::string &&name, void *addr) :
-    _addr((uint64_t *)addr),
     _name(name),
+    _addr((uint64_t *)addr),
+    _originalByte(*(uint8_t*)addr),
+    _backup(0),
     _isSet(false),
+    _isDisplacementPrepared(false),
+    _displacedCode(nullptr),
+    _displacedLength(0),
+    _isDisplacedCodeLeaked(false),
     _tracer(tracer),
     _callbackHandler(callbackHandler),
     _onHit(BreakPoint::defaultOnHit) {}
 
-void* BreakPoint::getAddr() const { return this->_addr; }
+BreakPoint::~BreakPoint() {
+    bool isStepping = this->_isDisplacedCodeLeaked;
 
-bool BreakPoint::set() {
-    if (!this->_isSet) {
-        this->_backup = *this->_addr;
+    // The displaced code cannot be reused while a thread may still be stepping in it
+    for (auto& completion : this->_pendingSteps) {
+        Tracer::Result res;
+        bool isDone = this->_tracer.isTracerThread() ? this->_tracer.poll(completion, res)
+                                                     : this->_tracer.waitFor(completion, stepTimeout, res);
+        isStepping = isStepping || !isDone;
+    }
 
-        uint64_t newWord = (this->_backup & (~0xFF)) | INT3;
-        this->_tracer.writeWord(this->_addr, newWord);
+    if (isStepping) {
+        error_log("BreakPoint (" << _name << ") : a thread may still be stepping, its displaced code is leaked");
+        return;
+    }
 
-        info_log("Breakpoint (" << _name << ") set at " << _addr);
+    if (this->_displacedCode != nullptr)
+        this->_tracer.getCodeArena().release(this->_displacedCode, X86Instruction::maxRelocatedLength);
 
+    // A step over the breakpoint parked before it was unset sets it back once done
+    if (*(volatile uint8_t*)this->_addr == INT3 && this->_originalByte != INT3) {
         this->_isSet = true;
+        if (!unset())
+            error_log("BreakPoint (" << _name << ") : set back by a step, it cannot be removed");
     }
+}
+
+void* BreakPoint::getAddr() const { return this->_addr; }
+
+bool BreakPoint::set() {
+    if (this->_tracer.isPatchingInProcess()) {
+        // Synchronous store, no need to go through the tracer thread
+        if (!this->_isSet && arm(this) == 0) {
+            info_log("Breakpoint (" << _name << ") set at " << _addr);
+            this->_isSet = true;
+        }
+        return this->_isSet;
+    }
+
+    Tracer::Transaction transaction;
+    prepareSet(transaction);
+
+    if (!commit(std::move(transaction)))
+        this->_isSet = false;
 
     return this->_isSet;
 }
 
 
 bool BreakPoint::unset() {
+    if (this->_tracer.isPatchingInProcess()) {
+        if (this->_isSet && disarm(this) == 0) {
+            info_log("BreakPoint (" << _name << ") unset");
+            this->_isSet = false;
+        }
+        return !this->_isSet;
+    }
+
+    Tracer::Transaction transaction;
+    prepareUnset(transaction);
+
+    if (!commit(std::move(transaction)))
+        this->_isSet = true;
+
+    return !this->_isSet;
+}
+
+bool BreakPoint::setAll(const std::vector<BreakPoint*>& breakPoints) {
+    return changeAll(breakPoints, true);
+}
+
+bool BreakPoint::unsetAll(const std::vector<BreakPoint*>& breakPoints) {
+    return changeAll(breakPoints, false);
+}
+
+bool BreakPoint::changeAll(const std::vector<BreakPoint*>& breakPoints, bool set) {
+    bool res = true;
+    std::vector<BreakPoint*> changed;
+
+    // One step per breakpoint, a transaction holds at most Tracer::maxSteps of them
+    auto it = breakPoints.begin();
+    while (it != breakPoints.end()) {
+        Tracer::Transaction transaction;
+        transaction.independent();
+
+        changed.clear();
+        for (; it != breakPoints.end() && changed.size() < Tracer::maxSteps; ++it) {
+            if ((*it)->_isSet != set) {
+                if (set)
+                    (*it)->prepareSet(transaction);
+                else
+                    (*it)->prepareUnset(transaction);
+                changed.push_back(*it);
+            }
+        }
+
+        if (changed.empty())
+            break;
+
+        // No step awaits a stop, the transaction is done once wait returns (even on the tracer thread)
+        auto& tracer = changed.front()->_tracer;
+        auto completion = tracer.commit(std::move(transaction));
+        tracer.wait(completion);
+
+        auto results = completion.getResults();
+        for (size_t idx = 0; idx < changed.size(); idx++) {
+            if (idx < results.size() && Tracer::succeeded(results[idx]))
+                continue;
+
+            error_log("BreakPoint (" << changed[idx]->_name << ") could not be " << (set ? "set" : "unset"));
+            changed[idx]->_isSet = !set;
+            res = false;
+        }
+    }
+
+    return res;
+}
+
+void BreakPoint::prepareSet(Tracer::Transaction &transaction) {
+    if (!this->_isSet) {
+        if (this->_tracer.isPatchingInProcess()) {
+            transaction.patch(this->_addr, &INT3, sizeof(INT3));
+        } else {
+            // The low byte may still be an INT3 not yet removed by a previous step of the transaction
+            this->_backup = (*this->_addr & ~uint64_t{0xFF}) | this->_originalByte;
+
+            uint64_t newWord = (this->_backup & ~uint64_t{0xFF}) | INT3;
+            transaction.pokeData(this->_addr, newWord);
+        }
+
+        info_log("Breakpoint (" << _name << ") set at " << _addr);
+
+        this->_isSet = true;
+    }
+}
+
+void BreakPoint::prepareUnset(Tracer::Transaction &transaction) {
     if (this->_isSet) {
-        this->_tracer.writeWord(this->_addr, this->_backup);
+        if (this->_tracer.isPatchingInProcess()) {
+            transaction.patch(this->_addr, &this->_originalByte, sizeof(this->_originalByte));
+        } else {
+            transaction.pokeData(this->_addr, this->_backup);
+        }
         info_log("BreakPoint (" << _name << ") unset");
         this->_isSet = false;
     }
-    return !this->_isSet;
+}
+
+long BreakPoint::arm(void *breakPoint) {
+    auto bp = static_cast<BreakPoint*>(breakPoint);
+
+    if (!MemoryPatcher::write(bp->_addr, &INT3, sizeof(INT3))) {
+        errno = EFAULT;
+        return -1;
+    }
+    return 0;
+}
+
+long BreakPoint::disarm(void *breakPoint) {
+    auto bp = static_cast<BreakPoint*>(breakPoint);
+
+    if (!MemoryPatcher::write(bp->_addr, &bp->_originalByte, sizeof(bp->_originalByte))) {
+        errno = EFAULT;
+        return -1;
+    }
+    return 0;
+}
+
+bool BreakPoint::commit(Tracer::Transaction &&transaction) {
+    if (transaction.empty())
+        return true;
+
+    auto completion = this->_tracer.commit(std::move(transaction));
+    Tracer::Result res;
+
+    // Executed inline by the tracer thread, up to the stop it may be parked on
+    if (this->_tracer.isTracerThread() && !this->_tracer.poll(completion, res)) {
+        const LockGuard lk(this->_breakPointMutex);
+
+        this->_pendingSteps.erase(std::remove_if(this->_pendingSteps.begin(), this->_pendingSteps.end(),
+                                                 [this](Tracer::Completion& pending){
+                                                     Tracer::Result pendingRes;
+                                                     return this->_tracer.poll(pending, pendingRes);
+                                                 }),
+                                  this->_pendingSteps.end());
+        this->_pendingSteps.push_back(std::move(completion));
+        return true;
+    }
+
+    if (completion.valid())
+        res = this->_tracer.wait(completion);
+
+    if (!Tracer::succeeded(res)) {
+        error_log("BreakPoint (" << _name << ") transaction failed (" << strerror(res.second) << ")");
+        return false;
+    }
+
+    return true;
+}
+
+bool BreakPoint::prepareDisplacement() {
+    const LockGuard lk(this->_breakPointMutex);
+
+    if(this->_isDisplacementPrepared)
+        return this->_displacedCode != nullptr;
+
+    this->_isDisplacementPrepared = true;
+
+    uint8_t code[X86Instruction::maxLength];
+    ssize_t codeLen = this->_tracer.readMemory(this->_addr, code, sizeof(code));
+    if(codeLen <= 0)
+        return false;
+
+    code[0] = this->_originalByte;
+
+    if(!X86Instruction::decode(code, (size_t)codeLen, this->_instruction)) {
+        info_log("BreakPoint (" << _name << ") : unsupported instruction, stepped in place");
+        return false;
+    }
+
+    auto& arena = this->_tracer.getCodeArena();
+    void* displacedCode = arena.allocate(X86Instruction::maxRelocatedLength, this->_addr);
+    if(displacedCode == nullptr)
+        return false;
+
+    uint8_t relocated[X86Instruction::maxRelocatedLength];
+    size_t len = this->_instruction.relocate(code, (uint64_t)this->_addr, (uint64_t)displacedCode, relocated);
+
+    if(len == 0 || !CodeArena::write(displacedCode, relocated, len)) {
+        info_log("BreakPoint (" << _name << ") : instruction cannot be relocated, stepped in place");
+        arena.release(displacedCode, X86Instruction::maxRelocatedLength);
+        return false;
+    }
+
+    this->_displacedCode = displacedCode;
+    this->_displacedLength = len;
+
+    return true;
 }
 
 bool BreakPoint::resumeAndSet(SpiedThread &spiedThread)
 {
+    // Displaced step : the breakpoint stays armed and other threads can hit it meanwhile. Step and fixup failures
+    // are reported once the thread stopped after the step.
+    if(this->_isSet && prepareDisplacement()) {
+        Tracer::Transaction transaction;
+        if (!spiedThread.prepareDisplacedStep(transaction, (uint64_t)this->_addr, (uint64_t)this->_displacedCode,
+                                              this->_instruction, this->_displacedLength)) {
+            error_log("BreakPoint (" << _name << ") : registers of thread " << spiedThread.getTid() << " unavailable");
+            return false;
+        }
+        spiedThread.prepareResume(transaction);
+
+        if (!commit(std::move(transaction))) {
+            this->_isDisplacedCodeLeaked = true;
+            return false;
+        }
+        return true;
+    }
+
     struct timeval start, stop;
     gettimeofday(&start, nullptr);
 
-    spiedThread.jump((void*)(spiedThread.getRip()-1));
-    bool res =
-            unset()
-            && spiedThread.singleStep()
-            && set()
-            && spiedThread.resume();
+    // unset -> single step -> set -> resume, executed by the tracer with a single command
+    Tracer::Transaction transaction;
+    if (!spiedThread.jump((void*)(spiedThread.getRip()-1))) {
+        error_log("BreakPoint (" << _name << ") : registers of thread " << spiedThread.getTid() << " unavailable");
+        return false;
+    }
+
+    prepareUnset(transaction);
+    spiedThread.prepareSingleStep(transaction);
+    prepareSet(transaction);
+    spiedThread.prepareResume(transaction);
+
+    bool res = commit(std::move(transaction));
 
     gettimeofday(&stop, nullptr);
 
@@ -58,8 +304,16 @@ bool BreakPoint::resumeAndSet(SpiedThread &spiedThread)
 }
 
 bool BreakPoint::resumeAndUnset(SpiedThread &spiedThread) {
-    spiedThread.jump((void*)(spiedThread.getRip()-1));
-    return unset() && spiedThread.resume();
+    Tracer::Transaction transaction;
+    if (!spiedThread.jump((void*)(spiedThread.getRip()-1))) {
+        error_log("BreakPoint (" << _name << ") : registers of thread " << spiedThread.getTid() << " unavailable");
+        return false;
+    }
+
+    prepareUnset(transaction);
+    spiedThread.prepareResume(transaction);
+
+    return commit(std::move(transaction));
 }
 
 void BreakPoint::setOnHitCallback(BreakpointCallback&& callback) {
@@ -74,7 +328,7 @@ void BreakPoint::defaultOnHit(BreakPoint& breakPoint, SpiedThread& spiedThread)
 void BreakPoint::hit(SpiedThread &spiedThread) {
     defaultOnHit(*this, spiedThread);
     _breakPointMutex.lock();
-    _callbackHandler.executeCallback([this, &spiedThread]{_onHit(*this, spiedThread);});
+    _callbackHandler.executeCallback([self = shared_from_this(), &spiedThread]{self->_onHit(*self, spiedThread);});
     _breakPointMutex.unlock();
 }
 
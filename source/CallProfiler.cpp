@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "CallProfiler.h"
+
+namespace {
+    // Only the owner thread writes in its slot, no need for an atomic read-modify-write
+    void add(std::atomic<uint64_t>& counter, uint64_t val, bool isShared) {
+        if(isShared)
+            counter.fetch_add(val, std::memory_order_relaxed);
+        else
+            counter.store(counter.load(std::memory_order_relaxed) + val, std::memory_order_relaxed);
+    }
+
+    void max(std::atomic<uint64_t>& counter, uint64_t val) {
+        uint64_t current = counter.load(std::memory_order_relaxed);
+        while(val > current && !counter.compare_exchange_weak(current, val, std::memory_order_relaxed));
+    }
+}
+
+CallProfiler::CallProfiler(std::string name) :
+_name(std::move(name)), _isActive(false)
+{}
+
+CallProfiler::~CallProfiler() = default;
+
+void CallProfiler::record(uint64_t cycles) {
+    uint32_t idx = ThreadSlots<Slot>::getIndex();
+    bool isShared = ThreadSlots<Slot>::isShared(idx);
+    Slot* slot = _slots.get(idx, []{ return new Slot(); });
+
+    add(slot->callNb, 1, isShared);
+    add(slot->totalCycles, cycles, isShared);
+    add(slot->buckets[getBucket(cycles)], 1, isShared);
+    max(slot->maxCycles, cycles);
+}
+
+CallProfiler::Report CallProfiler::getReport() const {
+    uint64_t callNb = 0;
+    uint64_t totalCycles = 0;
+    uint64_t maxCycles = 0;
+    std::vector<uint64_t> buckets(bucketNb, 0);
+
+    for(uint32_t idx = 0; idx < ThreadSlots<Slot>::maxThreadNb; idx++) {
+        Slot* slot = _slots.find(idx);
+        if(slot == nullptr)
+            continue;
+
+        callNb += slot->callNb.load(std::memory_order_relaxed);
+        totalCycles += slot->totalCycles.load(std::memory_order_relaxed);
+        maxCycles = std::max(maxCycles, slot->maxCycles.load(std::memory_order_relaxed));
+        for(uint32_t bucket = 0; bucket < bucketNb; bucket++)
+            buckets[bucket] += slot->buckets[bucket].load(std::memory_order_relaxed);
+    }
+
+    // The buckets are read after the call counter, their sum is used for the percentiles
+    uint64_t recordedNb = 0;
+    for(auto nb : buckets)
+        recordedNb += nb;
+
+    auto percentile = [&](double ratio) {
+        auto rank = (uint64_t)((double)recordedNb * ratio);
+        uint64_t count = 0;
+
+        for(uint32_t bucket = 0; bucket < bucketNb; bucket++) {
+            count += buckets[bucket];
+            if(count > rank)
+                return std::min(getBucketUpperBound(bucket), maxCycles);
+        }
+        return maxCycles;
+    };
+
+    double cyclesPerNs = getCyclesPerNs();
+
+    Report report;
+    report.name = _name;
+    report.callNb = callNb;
+    report.meanNs = callNb != 0 ? (double)totalCycles / (double)callNb / cyclesPerNs : 0;
+    report.p50Ns = (double)percentile(0.5) / cyclesPerNs;
+    report.p90Ns = (double)percentile(0.9) / cyclesPerNs;
+    report.p99Ns = (double)percentile(0.99) / cyclesPerNs;
+    report.maxNs = (double)maxCycles / cyclesPerNs;
+
+    return report;
+}
+
+uint32_t CallProfiler::getBucket(uint64_t cycles) {
+    if(cycles < (1U << subBucketBits))
+        return (uint32_t)cycles;
+
+    auto exp = (uint32_t)(63 - __builtin_clzll(cycles));
+    auto sub = (uint32_t)(cycles >> (exp - subBucketBits)) & ((1U << subBucketBits) - 1);
+
+    return ((exp - subBucketBits + 1) << subBucketBits) | sub;
+}
+
+uint64_t CallProfiler::getBucketUpperBound(uint32_t bucket) {
+    if(bucket < (1U << subBucketBits))
+        return bucket;
+
+    uint32_t exp = (bucket >> subBucketBits) + subBucketBits - 1;
+    uint32_t sub = bucket & ((1U << subBucketBits) - 1);
+
+    // Wraps to UINT64_MAX for the last bucket
+    return ((uint64_t)((1U << subBucketBits) + sub + 1) << (exp - subBucketBits)) - 1;
+}
+
+double CallProfiler::getCyclesPerNs() {
+    static const double cyclesPerNs = []{
+        auto start = std::chrono::steady_clock::now();
+        uint64_t startCycles = __rdtsc();
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        uint64_t cycles = __rdtsc() - startCycles;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+
+        return (double)cycles / (double)ns.count();
+    }();
+
+    return cyclesPerNs;
+}
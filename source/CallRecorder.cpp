@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "CallRecorder.h"
+#include "Logger.h"
+
+namespace {
+    bool writeAll(int fd, const uint8_t* data, size_t size, off_t offset) {
+        while(size != 0) {
+            ssize_t written = pwrite(fd, data, size, offset);
+            if(written == -1) {
+                if(errno == EINTR)
+                    continue;
+                return false;
+            }
+
+            data += written;
+            size -= (size_t)written;
+            offset += written;
+        }
+
+        return true;
+    }
+}
+
+uint32_t CallRecorder::getRecordSize(uint32_t argsSize, uint32_t returnSize) {
+    return ((uint32_t)sizeof(RecordHeader) + argsSize + returnSize + 7) & ~7U;
+}
+
+CallRecorder::CallRecorder(const std::string &path, uint32_t argsSize, uint32_t returnSize) :
+_argsSize(argsSize), _returnSize(returnSize), _recordSize(getRecordSize(argsSize, returnSize)),
+_fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)),
+_isSharedRingBusy(false), _recordNb(0), _isRunning(true)
+{
+    if(_fd == -1) {
+        error_log("Failed to create " << path << " : " << strerror(errno));
+        throw std::invalid_argument("Cannot create record file " + path);
+    }
+
+    _flusher = std::thread(&CallRecorder::flushLoop, this);
+}
+
+CallRecorder::~CallRecorder() {
+    _isRunning.store(false, std::memory_order_relaxed);
+    _flusher.join();
+    flush();
+
+    FileHeader header{};
+    memcpy(header.magic, magic, sizeof(magic));
+    header.version = version;
+    header.argsSize = _argsSize;
+    header.returnSize = _returnSize;
+    header.recordSize = _recordSize;
+    header.recordNb = getRecordNb();
+
+    if(!writeAll(_fd, (const uint8_t*)&header, sizeof(header), 0))
+        error_log("Failed to write record file header : " << strerror(errno));
+
+    if(getDroppedNb() != 0)
+        info_log(getDroppedNb() << " calls were not recorded (full ring)");
+
+    close(_fd);
+}
+
+void CallRecorder::record(const void *args, const void *returnValue) {
+    uint32_t idx = ThreadSlots<Ring>::getIndex();
+    Ring* ring = _rings.get(idx, [this]{
+        auto newRing = new Ring();
+        newRing->records = std::make_unique<uint8_t[]>((size_t)ringCapacity * _recordSize);
+        return newRing;
+    });
+
+    // The shared ring has several producers, one at a time
+    bool isShared = ThreadSlots<Ring>::isShared(idx);
+    if(isShared && _isSharedRingBusy.exchange(true, std::memory_order_acquire)) {
+        ring->droppedNb.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if(tail - ring->head.load(std::memory_order_acquire) >= ringCapacity) {
+        ring->droppedNb.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        uint8_t* record = &ring->records[(tail % ringCapacity) * _recordSize];
+        RecordHeader header{__rdtsc(), (uint32_t)ThreadIndex::getTid(), 0};
+
+        memcpy(record, &header, sizeof(header));
+        memcpy(record + sizeof(header), args, _argsSize);
+        memcpy(record + sizeof(header) + _argsSize, returnValue, _returnSize);
+
+        ring->tail.store(tail + 1, std::memory_order_release);
+    }
+
+    if(isShared)
+        _isSharedRingBusy.store(false, std::memory_order_release);
+}
+
+uint64_t CallRecorder::getRecordNb() const {
+    return _recordNb.load(std::memory_order_relaxed);
+}
+
+uint64_t CallRecorder::getDroppedNb() const {
+    uint64_t droppedNb = 0;
+
+    for(uint32_t idx = 0; idx < ThreadSlots<Ring>::maxThreadNb; idx++) {
+        Ring* ring = _rings.find(idx);
+        if(ring != nullptr)
+            droppedNb += ring->droppedNb.load(std::memory_order_relaxed);
+    }
+
+    return droppedNb;
+}
+
+void CallRecorder::flush() {
+    for(uint32_t idx = 0; idx < ThreadSlots<Ring>::maxThreadNb; idx++) {
+        Ring* ring = _rings.find(idx);
+        if(ring == nullptr)
+            continue;
+
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+
+        // Copied in at most two chunks (before and after the end of the ring)
+        while(head != tail) {
+            uint64_t first = head % ringCapacity;
+            uint64_t nb = std::min(tail - head, ringCapacity - first);
+            const uint8_t* records = &ring->records[first * _recordSize];
+
+            _buffer.insert(_buffer.end(), records, records + nb * _recordSize);
+            head += nb;
+        }
+
+        ring->head.store(tail, std::memory_order_release);
+    }
+
+    if(_buffer.empty())
+        return;
+
+    off_t offset = (off_t)(sizeof(FileHeader) + getRecordNb() * _recordSize);
+    if(!writeAll(_fd, _buffer.data(), _buffer.size(), offset))
+        error_log("Failed to write records : " << strerror(errno));
+
+    _recordNb.fetch_add(_buffer.size() / _recordSize, std::memory_order_relaxed);
+    _buffer.clear();
+}
+
+void CallRecorder::flushLoop() {
+    while(_isRunning.load(std::memory_order_relaxed)) {
+        flush();
+        std::this_thread::sleep_for(flushPeriod);
+    }
+}
@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CallReplayer.h"
+#include "Logger.h"
+
+CallReplayer::CallReplayer(const std::string &path, uint32_t argsSize, uint32_t returnSize) :
+_argsSize(argsSize), _returnSize(returnSize), _map(MAP_FAILED), _mapSize(0), _next(0)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1) {
+        error_log("Failed to open " << path << " : " << strerror(errno));
+        throw std::invalid_argument("Cannot open record file " + path);
+    }
+
+    struct stat st{};
+    if(fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(CallRecorder::FileHeader)) {
+        _mapSize = (size_t)st.st_size;
+        _map = mmap(nullptr, _mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if(_map == MAP_FAILED)
+        throw std::invalid_argument("Cannot map record file " + path);
+
+    auto header = (const CallRecorder::FileHeader*)_map;
+    uint32_t recordSize = CallRecorder::getRecordSize(argsSize, returnSize);
+
+    if(memcmp(header->magic, CallRecorder::magic, sizeof(header->magic)) != 0 || header->version != CallRecorder::version
+       || header->argsSize != argsSize || header->returnSize != returnSize || header->recordSize != recordSize
+       || sizeof(*header) + header->recordNb * recordSize > _mapSize) {
+        munmap(_map, _mapSize);
+        error_log(path << " was not recorded for this function");
+        throw std::invalid_argument("Invalid record file " + path);
+    }
+
+    auto records = (const uint8_t*)_map + sizeof(*header);
+    _records.reserve(header->recordNb);
+    for(uint64_t idx = 0; idx < header->recordNb; idx++)
+        _records.push_back(records + idx * recordSize);
+
+    // Each thread ring is flushed in order, only the merge of the threads needs sorting
+    std::stable_sort(_records.begin(), _records.end(), [](const uint8_t* r1, const uint8_t* r2) {
+        return ((const CallRecorder::RecordHeader*)r1)->timestamp < ((const CallRecorder::RecordHeader*)r2)->timestamp;
+    });
+}
+
+CallReplayer::~CallReplayer() {
+    munmap(_map, _mapSize);
+}
+
+bool CallReplayer::next(void *returnValue) {
+    uint64_t idx = _next.fetch_add(1, std::memory_order_relaxed);
+    if(idx >= _records.size())
+        return false;
+
+    if(_returnSize != 0)
+        memcpy(returnValue, _records[idx] + sizeof(CallRecorder::RecordHeader) + _argsSize, _returnSize);
+    return true;
+}
+
+uint64_t CallReplayer::getRecordNb() const {
+    return _records.size();
+}
@@ -3,7 +3,7 @@
 
 #include "CallbackHandler.h"
 
-CallbackHandler::CallbackHandler(): _running(true) {
+CallbackHandler::CallbackHandler(): _running(true), _isInline(false) {
     if(sem_init(&this->_callbackSem, 0, 0) == -1){
         error_log("Semaphore initialization failed (" << strerror(errno) << ")");
         throw std::invalid_argument("Invalid sem init");
@@ -24,6 +24,11 @@ CallbackHandler::~CallbackHandler() {
 }
 
 void CallbackHandler::executeCallback(const Callback& callback) {
+    if(this->_isInline.load(std::memory_order_relaxed)) {
+        callback();
+        return;
+    }
+
     this->_callbackMutex.lock();
     this->_callbacks.push(callback);
     this->_callbackMutex.unlock();
@@ -32,6 +37,10 @@ void CallbackHandler::executeCallback(const Callback& callback) {
         error_log("Semaphore post failed (" << strerror(errno) << ")");
 }
 
+void CallbackHandler::setInline(bool isInline) {
+    this->_isInline.store(isInline, std::memory_order_relaxed);
+}
+
 void CallbackHandler::handleCallback() {
     while(sem_wait(&this->_callbackSem) == 0){
 
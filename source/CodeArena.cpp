@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+
+#include "CodeArena.h"
+#include "MemoryPatcher.h"
+#include "Logger.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+CodeArena::~CodeArena() {
+    for(auto& region : _regions)
+        munmap((void*)region.begin, region.end - region.begin);
+}
+
+void *CodeArena::allocate(size_t size, const void *near) {
+    std::lock_guard lk(_mutex);
+
+    size = (size + alignment - 1) & ~(alignment - 1);
+
+    auto it = _freeBlocks.lower_bound(size);
+    for(; it != _freeBlocks.end() && it->first == size; it++) {
+        if(isInReach(it->second, (uint64_t)near)) {
+            auto addr = it->second;
+            _freeBlocks.erase(it);
+            return (void*)addr;
+        }
+    }
+
+    for(auto& region : _regions) {
+        if(region.next + size <= region.end && isInReach(region.begin, (uint64_t)near)
+           && isInReach(region.end, (uint64_t)near)) {
+            auto addr = region.next;
+            region.next += size;
+            return (void*)addr;
+        }
+    }
+
+    uint64_t begin = mapRegion((uint64_t)near);
+    if(begin == 0)
+        return nullptr;
+
+    _regions.push_back({begin, begin + regionSize, begin + size});
+    return (void*)begin;
+}
+
+void CodeArena::release(void *addr, size_t size) {
+    std::lock_guard lk(_mutex);
+
+    size = (size + alignment - 1) & ~(alignment - 1);
+    _freeBlocks.emplace(size, (uint64_t)addr);
+}
+
+bool CodeArena::write(void *addr, const void *code, size_t size) {
+    return MemoryPatcher::write(addr, code, size);
+}
+
+bool CodeArena::isInReach(uint64_t addr, uint64_t near) {
+    return (addr > near ? addr - near : near - addr) <= reach;
+}
+
+uint64_t CodeArena::mapRegion(uint64_t near) {
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if(maps == nullptr) {
+        error_log("Failed to open /proc/self/maps : " << strerror(errno));
+        return 0;
+    }
+
+    // Look for the free range closest to near
+    uint64_t best = 0;
+    uint64_t bestDistance = UINT64_MAX;
+    uint64_t prevEnd = 0x10000;
+    char line[PATH_MAX + 128];
+
+    auto distanceTo = [near](uint64_t addr) { return addr > near ? addr - near : near - addr; };
+
+    auto consider = [&](uint64_t gapBegin, uint64_t gapEnd) {
+        if(gapEnd <= gapBegin || gapEnd - gapBegin < regionSize)
+            return;
+
+        // Closest region of the gap to near
+        uint64_t candidate;
+        if(near < gapBegin)
+            candidate = gapBegin;
+        else if(near + regionSize > gapEnd)
+            candidate = gapEnd - regionSize;
+        else
+            candidate = near & ~(uint64_t)(regionSize - 1);
+
+        if(candidate < gapBegin)
+            candidate = gapBegin;
+
+        uint64_t distance = std::max(distanceTo(candidate), distanceTo(candidate + regionSize));
+        if(distance < bestDistance) {
+            best = candidate;
+            bestDistance = distance;
+        }
+    };
+
+    while(fgets(line, sizeof(line), maps) != nullptr) {
+        uint64_t begin, end;
+        if(sscanf(line, "%lx-%lx", &begin, &end) != 2)
+            continue;
+
+        consider(prevEnd, begin);
+        prevEnd = end;
+    }
+    fclose(maps);
+
+    if(best == 0 || bestDistance >= reach) {
+        error_log("No free memory in reach of " << (void*)near);
+        return 0;
+    }
+
+    void* addr = mmap((void*)best, regionSize, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if(addr == MAP_FAILED) {
+        error_log("Failed to map code region at " << (void*)best << " : " << strerror(errno));
+        return 0;
+    }
+
+    // Kernels without MAP_FIXED_NOREPLACE treat the address as a hint
+    if((uint64_t)addr != best && (!isInReach((uint64_t)addr, near) || !isInReach((uint64_t)addr + regionSize, near))) {
+        munmap(addr, regionSize);
+        error_log("Code region mapped out of reach of " << (void*)near);
+        return 0;
+    }
+
+    return (uint64_t)addr;
+}
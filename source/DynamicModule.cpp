@@ -2,6 +2,7 @@
 #include <stdexcept>
 
 #include "DynamicModule.h"
+#include "ModuleIndex.h"
 
 // constructor helpers
 static void* openHandle(const std::string & name, Lmid_t id){
@@ -23,24 +24,34 @@ static struct link_map* getLinkMap(void* handle){
 }
 
 DynamicModule::DynamicModule(const std::string &name, Lmid_t id)
-: _name(name), _handle(openHandle(name, id)), _lm(getLinkMap(_handle)), _elf(ElfFile::getElfFile(_lm->l_name))
+: _name(name), _handle(openHandle(name, id)), _lm(getLinkMap(_handle)), _elf(ElfFile::getElfImage(_lm))
 {}
 
+void *DynamicModule::getDynamicSymbol(const Elf64_Sym *symb) const {
+    if(symb == nullptr || ELF64_ST_TYPE(symb->st_info) == STT_GNU_IFUNC)
+        return nullptr;
+
+    return (void *) (_lm->l_addr + symb->st_value);
+}
+
 void *DynamicModule::getDynamicSymbol(const std::string &symbName) const {
-    void* symbAddr = nullptr;
-    auto& dynstr = _elf.getDynStrTab();
+    return getDynamicSymbol(_elf->getDefinedDynSym(symbName));
+}
+
+void *DynamicModule::getDynamicSymbol(uint32_t symbolId) const {
+    return getDynamicSymbol(_elf->getDefinedDynSym(symbolId));
+}
 
-    for(auto& symb : _elf.getDynSymTab()){
-        uint8_t type = ELF64_ST_TYPE(symb.st_info);
+void *DynamicModule::getDynamicFunction(const std::string &symbName) const {
+    const Elf64_Sym* symb = _elf->getDefinedDynSym(symbName);
+    if(symb == nullptr || ELF64_ST_TYPE(symb->st_info) == STT_OBJECT)
+        return nullptr;
 
-        if ((type == STT_FUNC || type == STT_OBJECT) &&     // symbol is a function or an object
-            (symb.st_shndx != 0) &&                         // symbol is defined in the binary
-            symbName == &dynstr[symb.st_name])              // symbol name match symbName
-        {
-            symbAddr = (void *) (_lm->l_addr + symb.st_value);
-            break;
-        }
-    }
+    void* symbAddr = (void *) (_lm->l_addr + symb->st_value);
+
+    // The address is the one of the resolver selecting the implementation
+    if(ELF64_ST_TYPE(symb->st_info) == STT_GNU_IFUNC)
+        symbAddr = ((void*(*)())symbAddr)();
 
     return symbAddr;
 }
@@ -50,19 +61,10 @@ void *DynamicModule::getSymbol(const std::string &symbName) const {
 
     // if failed to find the symbol in dynamic symbol
     if(symbolAddr == nullptr) {
-        auto& strtab = _elf.getStrTab();
-
-        for (auto& symb : _elf.getSymTab()) {
-            uint8_t type = ELF64_ST_TYPE(symb.st_info);
-
-            if ((type == STT_FUNC || type == STT_OBJECT) &&     // symbol is a function or an object
-                (symb.st_shndx != 0) &&                         // symbol is defined in the binary
-                symbName == &strtab[symb.st_name])              // symbol name match symbName
-            {
-                symbolAddr = (void *) (_lm->l_addr + symb.st_value);
-                break;
-            }
-        }
+        const Elf64_Sym* symb = _elf->getDefinedSym(symbName);
+
+        if(symb != nullptr && ELF64_ST_TYPE(symb->st_info) != STT_GNU_IFUNC)
+            symbolAddr = (void *) (_lm->l_addr + symb->st_value);
     }
 
     return symbolAddr;
@@ -70,11 +72,10 @@ void *DynamicModule::getSymbol(const std::string &symbName) const {
 
 std::string DynamicModule::getMangledName(void *symbolPtr) {
     std::string mangledName;
-    Dl_info info;
+    ModuleIndex::Location location;
 
-    dladdr(symbolPtr, &info);
-    if(info.dli_sname != nullptr){
-        mangledName = info.dli_sname;
+    if(ModuleIndex::getModuleIndex().find(symbolPtr, location) && location.symbolName != nullptr){
+        mangledName = location.symbolName;
     }
 
     return mangledName;
@@ -96,14 +97,22 @@ DynamicModule::~DynamicModule() {
         relinkage->invalidate();
     }
 
+    // No lookup must use the module once it is unmapped, its address range may then be reused by another module.
+    // It is indexed again if the spied program still holds it.
+    ModuleIndex::getModuleIndex().update(_lm);
     dlclose(_handle);
+    ModuleIndex::getModuleIndex().update();
+
+    // The file of its image may now be unused and go over the memory budget of the registry
+    _elf.reset();
+    ElfFile::trimRegistry();
 }
 
 void DynamicModule::relink(DynamicModule &module) {
 
-    auto& dynstr = _elf.getDynStrTab();
+    auto dynstr = _elf->getDynStrTab();
 
-    for(auto& dyn: _elf.getDynamic()){
+    for(auto& dyn: _elf->getDynamic()){
         if(dyn.d_tag == DT_NEEDED && &dynstr[dyn.d_un.d_val] == module.getName()){
             // #FIXME add try catch if relink failed
             _outRelinkages.erase(module.getName());
@@ -132,7 +141,7 @@ const std::string &DynamicModule::getName() const {
 }
 
 void *DynamicModule::getEntryPoint() const {
-    Elf64_Addr off = _elf.getEntryPoint();
+    Elf64_Addr off = _elf->getEntryPoint();
 
     // If the entry point offset is clearly not significant return nullptr instead of module base address
     if(off == 0){
@@ -142,20 +151,37 @@ void *DynamicModule::getEntryPoint() const {
     return (void*)(_lm->l_addr + off);
 }
 
-void DynamicModule::iterateOverRelocations(const std::function<bool(uint32_t, const std::string &, uint64_t *)>& f) {
-    const auto& dynstr = _elf.getDynStrTab();
-    const auto& dynsym = _elf.getDynSymTab();
+void *DynamicModule::getLineAddress(const std::string &fileName, uint32_t line) const {
+    Elf64_Addr address;
+    if(!_elf->findLineAddress(fileName, line, address))
+        return nullptr;
 
-    for(const auto& rela: _elf.getRela()){
-        auto relaAddr =  (uint64_t*) (_lm->l_addr + rela.r_offset);
-        uint32_t relaType = ELF64_R_TYPE(rela.r_info);
-        const char* name = &dynstr[dynsym[ELF64_R_SYM(rela.r_info)].st_name];
+    return (void*)(_lm->l_addr + address);
+}
 
-        if(!f(relaType, name, relaAddr)) break;
-    }
+Span<const ElfFile::Relocation> DynamicModule::getRelocations() const {
+    return _elf->getSymbolRelocations();
 }
 
+uint32_t DynamicModule::getSymbolId(const ElfFile::Relocation &rela) const {
+    return _elf->getSymbolId(rela);
+}
+
+uint64_t *DynamicModule::getRelocationAddress(const ElfFile::Relocation &rela) const {
+    return (uint64_t*) (_lm->l_addr + rela.offset);
+}
 
+std::vector<uint64_t*> DynamicModule::getFunctionRelocations(const std::string &symbName) const {
+    return getFunctionRelocations(ElfFile::getSymbolNames().intern(symbName));
+}
 
+std::vector<uint64_t*> DynamicModule::getFunctionRelocations(uint32_t symbolId) const {
+    std::vector<uint64_t*> slots;
 
+    for(auto& rela : _elf->getSymbolRelocations(symbolId)) {
+        if(rela.type == R_X86_64_GLOB_DAT || rela.type == R_X86_64_JUMP_SLOT)
+            slots.push_back(getRelocationAddress(rela));
+    }
 
+    return slots;
+}
@@ -1,8 +1,10 @@
 #include <csignal>
+#include <cstring>
 #include <iostream>
 #include <thread>
 
 #include "DynamicNamespace.h"
+#include "ModuleIndex.h"
 #include "SpyLoader.h"
 #include "Logger.h"
 
@@ -32,12 +34,16 @@ DynamicNamespace::DynamicNamespace():
     _envp(nullptr),
     _executable(),
     _loader("libSpyLoader.so", _id),
-    _createMainThread(nullptr) {}
+    _createMainThread(nullptr) {
+    ModuleIndex::getModuleIndex().addNamespace(_lm);
+}
 
 
 DynamicNamespace::DynamicNamespace(int argc, const char* argv[], char **envp):
     _id(getSpyLoader().reserveNamespaceId(*this)),
     _lm(getLinkMap(_id)),
+    // The namespaces pre-created without program never create their modules, their images would be thrown away
+    _prewarmer(argv != nullptr && ModulePrewarmer::getThreadNb() > 0 ? new ModulePrewarmer(_lm) : nullptr),
     _argc(argc),
     _argv(argv),
     _envp(envp),
@@ -50,19 +56,26 @@ DynamicNamespace::DynamicNamespace(int argc, const char* argv[], char **envp):
                                      " : failed to find createMainThread in the spied dynamic namespace " +
                                      std::to_string(_id)));
     }
+
+    ModuleIndex::getModuleIndex().addNamespace(_lm);
 }
 
 DynamicNamespace::~DynamicNamespace() {
+    ModuleIndex::getModuleIndex().removeNamespace(_lm);
+
     if(_id != LM_ID_BASE)
         getSpyLoader().releaseNamespaceId(_id);
 }
 
 DynamicModule *DynamicNamespace::load(const std::string &binName) {
     try{
-        DynamicModule& bin =  _dynamicLib.emplace(std::piecewise_construct,
-                                                  std::make_tuple(binName),
-                                                  std::make_tuple(binName, _id)).first->second;
-        return &bin;
+        auto res = _dynamicLib.emplace(std::piecewise_construct,
+                                       std::make_tuple(binName),
+                                       std::make_tuple(binName, _id));
+        if(res.second)
+            notifyModule(res.first->second);
+
+        return &res.first->second;
     } catch(std::invalid_argument& e){
         error_log("Failed to create DynamicModule (" << e.what() << ")");
         return nullptr;
@@ -70,7 +83,47 @@ DynamicModule *DynamicNamespace::load(const std::string &binName) {
 }
 
 void DynamicNamespace::unload(const std::string& binName){
-    this->_dynamicLib.erase(binName);
+    auto it = _dynamicLib.find(binName);
+    if(it == _dynamicLib.end())
+        return;
+
+    notifyModule(it->second, MODULE_REMOVED);
+    _dynamicLib.erase(it);
+    _functions.clear();
+}
+
+void *DynamicNamespace::findFunction(const std::string &symbName) {
+    auto cached = _functions.find(symbName);
+    if(cached != _functions.end())
+        return cached->second;
+
+    syncModules();
+
+    void* symbAddr = nullptr;
+    for(auto lmIt = _lm; lmIt != nullptr && symbAddr == nullptr; lmIt = lmIt->l_next) {
+        DynamicModule* module = nullptr;
+
+        if(lmIt->l_name[0] == '\0' || (_executable.has_value() && _executable->getName() == lmIt->l_name)) {
+            if(_executable.has_value())
+                module = &_executable.value();
+        } else {
+            std::string path(lmIt->l_name);
+            auto it = _dynamicLib.find(path.substr(path.find_last_of('/') + 1));
+            if(it != _dynamicLib.end())
+                module = &it->second;
+        }
+
+        if(module != nullptr)
+            symbAddr = module->getDynamicFunction(symbName);
+    }
+
+    if(symbAddr == nullptr) {
+        error_log("Failed to find " << symbName << " in the namespace " << _id);
+        return nullptr;
+    }
+
+    _functions.emplace(symbName, symbAddr);
+    return symbAddr;
 }
 
 void DynamicNamespace::createMainThread(DynamicNamespace *ns) {
@@ -103,30 +156,41 @@ void DynamicNamespace::loadExecutable() {
 }
 
 void *DynamicNamespace::convertDynSymbolAddr(void *addr) const {
-    Dl_info info;
+    ModuleIndex::Location location;
 
-    if (dladdr(addr, &info) == 0){
-        error_log("Dladdr failed on " << addr << " (" << dlerror() << ")");
+    if(!ModuleIndex::getModuleIndex().find(addr, location)){
+        error_log("Cannot find the module of " << addr);
         return nullptr;
     }
 
-    if(info.dli_saddr != addr){
+    if(location.symbolAddr != addr){
         error_log(addr << "is not a valid function pointer");
         return nullptr;
     }
 
-    void* handle = dlmopen(_id, info.dli_fname, RTLD_NOLOAD | RTLD_LAZY);
-
-    if(handle == nullptr){
-        error_log("Dlmopen failed (" << dlerror() << ")");
-        return nullptr;
+    // The same file is mapped in the namespace, the symbol is at the same offset from the load address
+    for(auto lmIt = _lm; lmIt != nullptr; lmIt = lmIt->l_next) {
+        if(strcmp(lmIt->l_name, location.fileName) == 0)
+            return (void*)(lmIt->l_addr + ((uint64_t)addr - location.module->l_addr));
     }
 
-    void* retAddr = dlsym(handle, info.dli_sname);
-    if(!retAddr)
-        error_log("Dlsym failed (" << dlerror() << ")");
+    error_log("Cannot find " << location.fileName << " in the namespace " << _id);
+    return nullptr;
+}
 
-    return retAddr;
+uint32_t DynamicNamespace::addModuleObserver(ModuleObserver &&observer) {
+    uint32_t id = _nextObserverId++;
+    _moduleObservers.emplace(id, std::move(observer));
+    return id;
+}
+
+void DynamicNamespace::removeModuleObserver(uint32_t id) {
+    _moduleObservers.erase(id);
+}
+
+void DynamicNamespace::notifyModule(DynamicModule &module, E_ModuleEvent event) {
+    for(auto& observer : _moduleObservers)
+        observer.second(module, event);
 }
 
 bool DynamicNamespace::isContaining(struct link_map *lm) const {
@@ -164,19 +228,28 @@ void DynamicNamespace::syncModules() {
 
         if(it == _dynamicLib.cend()){
             if(lmIt->l_name[0] == '\0' && !_executable.has_value()){
-                _executable.emplace("", _id);
+                notifyModule(_executable.emplace("", _id));
             } else if(lmIt->l_name[0] == '/') {
                 std::string path(lmIt->l_name);
                 size_t lastSlash = path.find_last_of('/');
 
-                _dynamicLib.emplace(std::piecewise_construct,
-                                    std::make_tuple(path.substr(lastSlash+1)),
-                                    std::make_tuple(path.substr(lastSlash+1), _id));
+                auto res = _dynamicLib.emplace(std::piecewise_construct,
+                                               std::make_tuple(path.substr(lastSlash+1)),
+                                               std::make_tuple(path.substr(lastSlash+1), _id));
+                if(res.second)
+                    notifyModule(res.first->second);
             }
         }
 
         lmIt = lmIt->l_next;
     }
+
+    // The modules now hold their files
+    waitPrewarm();
+}
+
+void DynamicNamespace::waitPrewarm() {
+    _prewarmer.reset();
 }
 
 // #FIXME not safe and clean : maybe start should be rewritten in assembly
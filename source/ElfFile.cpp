@@ -1,172 +1,1170 @@
+#include <algorithm>
 #include <climits>
+#include <condition_variable>
 #include <cstring>
 #include <fcntl.h>
+#include <iomanip>
+#include <map>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <unordered_map>
 
 #include "ElfFile.h"
+#include "LineTable.h"
 #include "Logger.h"
 
-ElfFile::ElfFile(const std::string &filePath) : _filePath(filePath) {
-    _fd = open(_filePath.c_str(), O_RDONLY);
-    if(_fd == -1) {
-        error_log("BOUGN : " << filePath);
+// Index cache file : header, then the indexes at the offsets of the header (8 bytes aligned)
+namespace {
+    const char cacheMagic[8] = {'S', 'P', 'Y', 'E', 'L', 'F', 'I', 'X'};
+    const uint32_t cacheVersion = 3;
+
+    typedef enum {
+        SYMTAB_INDEX,
+        SYMBOL_RANGES,
+        RELOCATIONS,
+        RELOCATED_SYMBOLS,
+        CACHED_INDEX_NB
+    } E_CachedIndex;
+
+    struct CacheHeader {
+        char magic[8];
+        uint32_t version;
+        // Bit E_CachedIndex is set for the indexes built when the cache was written
+        uint32_t presentMask;
+        // Checked against the file, a stripped copy has the same build id
+        uint64_t fileSize;
+        int64_t mtime;
+        uint64_t symtabNb;
+        uint64_t dynsymNb;
+        uint64_t offsets[CACHED_INDEX_NB];
+        uint64_t counts[CACHED_INDEX_NB];
+    };
+
+    Span<const uint8_t> findBuildId(Span<const uint8_t> notes) {
+        size_t offset = 0;
+
+        while(offset + sizeof(Elf64_Nhdr) <= notes.size()) {
+            auto note = (const Elf64_Nhdr*)(notes.data() + offset);
+            size_t nameOffset = offset + sizeof(Elf64_Nhdr);
+            size_t descOffset = nameOffset + ((note->n_namesz + 3) & ~3U);
+            offset = descOffset + ((note->n_descsz + 3) & ~3U);
+
+            if(offset > notes.size())
+                break;
+
+            if(note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+               memcmp(notes.data() + nameOffset, "GNU", 4) == 0)
+                return {notes.data() + descOffset, note->n_descsz};
+        }
+
+        return {};
+    }
+
+    bool hasDynamic(const struct link_map* lm, const Elf64_Phdr* phdr, size_t nb) {
+        for(size_t idx = 0; idx < nb; idx++) {
+            if(phdr[idx].p_type == PT_DYNAMIC && lm->l_addr + phdr[idx].p_vaddr == (Elf64_Addr)lm->l_ld)
+                return true;
+        }
+
+        return false;
+    }
+
+    // Copy size bytes at addr, fail instead of faulting if they are not mapped
+    bool readMemory(const void* addr, void* buffer, size_t size) {
+        struct iovec local = {buffer, size};
+        struct iovec remote = {const_cast<void*>(addr), size};
+        return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == (ssize_t)size;
+    }
+
+    // Shared libraries and PIE are usually linked at 0, their ELF header is then at the load address : it is checked
+    // through copies, and the headers are only used if the first segment maps them. The main program ones are
+    // in the auxiliary vector, dl_iterate_phdr (which takes the loader lock) is the last resort.
+    Span<const Elf64_Phdr> findProgramHeaders(const struct link_map* lm) {
+        Elf64_Ehdr ehdr;
+        if(lm->l_addr != 0 && readMemory((const void*)lm->l_addr, &ehdr, sizeof(ehdr)) &&
+           memcmp(ehdr.e_ident, ELFMAG, SELFMAG) == 0 && ehdr.e_phentsize == sizeof(Elf64_Phdr) && ehdr.e_phnum != 0) {
+            auto phdr = (const Elf64_Phdr*)(lm->l_addr + ehdr.e_phoff);
+            std::vector<Elf64_Phdr> copy(ehdr.e_phnum);
+
+            if(readMemory(phdr, copy.data(), copy.size() * sizeof(Elf64_Phdr))) {
+                auto firstLoad = std::find_if(copy.begin(), copy.end(), [](const Elf64_Phdr& segment){
+                    return segment.p_type == PT_LOAD;
+                });
+
+                if(firstLoad != copy.end() && firstLoad->p_vaddr == 0 && firstLoad->p_offset == 0 &&
+                   ehdr.e_phoff + copy.size() * sizeof(Elf64_Phdr) <= firstLoad->p_filesz &&
+                   hasDynamic(lm, copy.data(), copy.size()))
+                    return {phdr, copy.size()};
+            }
+        } else if(lm->l_addr == 0) {
+            auto phdr = (const Elf64_Phdr*)getauxval(AT_PHDR);
+            size_t nb = getauxval(AT_PHNUM);
+
+            if(phdr != nullptr && hasDynamic(lm, phdr, nb))
+                return {phdr, nb};
+        }
+
+        std::pair<const struct link_map*, Span<const Elf64_Phdr>> search(lm, {});
+        dl_iterate_phdr([](struct dl_phdr_info* info, size_t, void* data){
+            auto search = (std::pair<const struct link_map*, Span<const Elf64_Phdr>>*)data;
+            if(info->dlpi_addr != search->first->l_addr || !hasDynamic(search->first, info->dlpi_phdr, info->dlpi_phnum))
+                return 0;
+
+            search->second = {info->dlpi_phdr, info->dlpi_phnum};
+            return 1;
+        }, &search);
+
+        return search.second;
+    }
+
+    // .dynsym has no size in memory, the hash tables give it (the last chain ends with the last symbol)
+    size_t getDynSymNb(const uint32_t* hash, const uint32_t* gnuHash) {
+        if(hash != nullptr)
+            return hash[1];
+        if(gnuHash == nullptr)
+            return 0;
+
+        uint32_t bucketNb = gnuHash[0];
+        uint32_t symOffset = gnuHash[1];
+        const uint32_t* buckets = &gnuHash[4 + gnuHash[2] * 2];
+        const uint32_t* chains = buckets + bucketNb;
+
+        uint32_t last = 0;
+        for(uint32_t idx = 0; idx < bucketNb; idx++)
+            last = std::max(last, buckets[idx]);
+
+        if(last < symOffset)
+            return symOffset;
+
+        while((chains[last - symOffset] & 1) == 0)
+            last++;
+
+        return last + 1;
+    }
+
+    template<typename T>
+    Span<const T> getCachedIndex(const uint8_t* cacheMap, const CacheHeader* header, E_CachedIndex idx) {
+        return {(const T*)(cacheMap + header->offsets[idx]), header->counts[idx]};
+    }
+
+    void makeDirectories(const std::string& path) {
+        for(size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1))
+            mkdir(path.substr(0, pos).c_str(), 0755);
+        mkdir(path.c_str(), 0755);
+    }
+}
+
+ElfFile::ElfFile(const std::string &filePath) : _filePath(filePath), _map(nullptr), _mapSize(0), _mtime(0),
+_isImage(false), _imageBase(0), _isSymbolFileOpen(true), _cacheMap(nullptr), _cacheMapSize(0), _cachedIndexes(0),
+_areSymbolIdsReady(false), _isLineTableReady(false) {
+    int fd = open(_filePath.c_str(), O_RDONLY);
+    if(fd == -1) {
         throw std::invalid_argument(
                 std::string(__FUNCTION__) + " : Failed to load " + _filePath + " : " + strerror(errno));
     }
 
-    // Read elf header
-    size_t bytesRead = read(_fd, &_elfHeader, sizeof(_elfHeader));
-    if(bytesRead != sizeof(_elfHeader)){
-        close(_fd);
+    // The mapping stays valid once the file is closed
+    struct stat fileStat;
+    if(fstat(fd, &fileStat) == -1) {
+        close(fd);
         throw std::invalid_argument(
-                std::string(__FUNCTION__) + " : Failed to read elf header of " + _filePath + " : " + strerror(errno));
+                std::string(__FUNCTION__) + " : Failed to get size of " + _filePath + " : " + strerror(errno));
     }
 
-    // IMPROVE : check elf magic number
+    _mapSize = (size_t)fileStat.st_size;
+    _mtime = fileStat.st_mtim.tv_sec * 1000000000 + fileStat.st_mtim.tv_nsec;
+    void* map = _mapSize >= sizeof(Elf64_Ehdr) ? mmap(nullptr, _mapSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
 
-    if(lseek(_fd, _elfHeader.e_shoff, SEEK_SET) != _elfHeader.e_shoff) {
-        close(_fd);
+    if(map == MAP_FAILED) {
         throw std::invalid_argument(
-                std::string(__FUNCTION__) + " : Failed to go to section header offset in " + _filePath + " : " +
-                strerror(errno));
+                std::string(__FUNCTION__) + " : Failed to map " + _filePath + " : " + strerror(errno));
     }
+    _map = (const uint8_t*)map;
+    _elfHeader = (const Elf64_Ehdr*)_map;
 
-    // read section header
-    _sectHeader.resize(_elfHeader.e_shnum);
-    bytesRead = read(_fd, _sectHeader.data(), _elfHeader.e_shnum * _elfHeader.e_shentsize);
+    if(memcmp(_elfHeader->e_ident, ELFMAG, SELFMAG) != 0 || _elfHeader->e_ident[EI_CLASS] != ELFCLASS64 ||
+       _elfHeader->e_shentsize != sizeof(Elf64_Shdr) ||
+       _elfHeader->e_shoff + (uint64_t)_elfHeader->e_shnum * sizeof(Elf64_Shdr) > _mapSize) {
+        munmap((void*)_map, _mapSize);
+        throw std::invalid_argument(std::string(__FUNCTION__) + " : " + _filePath + " is not a valid 64 bits elf file");
+    }
 
-    if(bytesRead != _elfHeader.e_shnum * _elfHeader.e_shentsize){
-        close(_fd);
+    _sectHeader = Span<const Elf64_Shdr>((const Elf64_Shdr*)(_map + _elfHeader->e_shoff), _elfHeader->e_shnum);
+    Span<const char> sectionNames;
+    if(_elfHeader->e_shstrndx < _sectHeader.size())
+        sectionNames = getSection<char>(_sectHeader[_elfHeader->e_shstrndx]);
+
+    // String tables are the ones linked to the symbol tables
+    for(auto& section : _sectHeader) {
+        switch(section.sh_type) {
+            case SHT_DYNAMIC:
+                _dynamic = getSection<Elf64_Dyn>(section);
+                break;
+            case SHT_SYMTAB:
+                _symtab = getSection<Elf64_Sym>(section);
+                if(section.sh_link < _sectHeader.size())
+                    _strtab = getSection<char>(_sectHeader[section.sh_link]);
+                break;
+            case SHT_DYNSYM:
+                _dynsym = getSection<Elf64_Sym>(section);
+                if(section.sh_link < _sectHeader.size())
+                    _dynstr = getSection<char>(_sectHeader[section.sh_link]);
+                break;
+            case SHT_GNU_HASH:
+                _gnuHash = getSection<uint32_t>(section);
+                break;
+            case SHT_NOTE:
+                if(_buildId.empty())
+                    _buildId = findBuildId(getSection<uint8_t>(section));
+                break;
+            case SHT_PROGBITS: {
+                if(section.sh_name >= sectionNames.size() || strncmp(&sectionNames[section.sh_name], ".debug_", 7) != 0)
+                    break;
+
+                std::string_view name(&sectionNames[section.sh_name],
+                                      strnlen(&sectionNames[section.sh_name], sectionNames.size() - section.sh_name));
+                auto debugSection = name == ".debug_line" ? &_debugLine : name == ".debug_line_str" ? &_debugLineStr :
+                                    name == ".debug_str" ? &_debugStr : nullptr;
+
+                if(debugSection != nullptr && (section.sh_flags & SHF_COMPRESSED) != 0) {
+                    info_log("Ignoring the compressed section " << name << " of " << _filePath);
+                } else if(debugSection != nullptr) {
+                    *debugSection = getSection<uint8_t>(section);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    findRelocations();
+
+    // The indexes missing from the cache are built on first use, then saved
+    _cachePath = getCachePath();
+    if(!_cachePath.empty())
+        loadIndexCache();
+}
+
+ElfFile::ElfFile(const struct link_map *lm) : _filePath(lm->l_name), _map(nullptr), _mapSize(0), _mtime(0),
+_elfHeader(nullptr), _isImage(true), _imageBase(lm->l_addr), _isSymbolFileOpen(false), _cacheMap(nullptr),
+_cacheMapSize(0), _cachedIndexes(0), _areSymbolIdsReady(false), _isLineTableReady(false) {
+    _progHeader = findProgramHeaders(lm);
+    if(_progHeader.empty()) {
         throw std::invalid_argument(
-                std::string(__FUNCTION__) + " : Failed to read section header of " + _filePath + " : " + strerror(errno));
+                std::string(__FUNCTION__) + " : Failed to find the program headers of " + _filePath);
+    }
+
+    for(auto& segment : _progHeader) {
+        auto data = (const uint8_t*)(_imageBase + segment.p_vaddr);
+
+        if(segment.p_type == PT_LOAD && segment.p_offset == 0 && segment.p_filesz >= sizeof(Elf64_Ehdr) &&
+           memcmp(data, ELFMAG, SELFMAG) == 0)
+            _elfHeader = (const Elf64_Ehdr*)data;
+        else if(segment.p_type == PT_NOTE && _buildId.empty())
+            _buildId = findBuildId({data, segment.p_filesz});
     }
+
+    size_t dynNb = 0;
+    while(lm->l_ld[dynNb].d_tag != DT_NULL)
+        dynNb++;
+    _dynamic = {lm->l_ld, dynNb};
+
+    const uint32_t* hash = nullptr;
+    const uint32_t* gnuHash = nullptr;
+    Elf64_Addr symtab = 0;
+    Elf64_Addr strtab = 0;
+    Elf64_Xword strSize = 0;
+
+    for(auto& dyn : _dynamic) {
+        switch(dyn.d_tag) {
+            case DT_HASH:
+                hash = (const uint32_t*)getDynamicTable(dyn.d_un.d_ptr, 0);
+                break;
+            case DT_GNU_HASH:
+                gnuHash = (const uint32_t*)getDynamicTable(dyn.d_un.d_ptr, 0);
+                break;
+            case DT_SYMTAB:
+                symtab = dyn.d_un.d_ptr;
+                break;
+            case DT_STRTAB:
+                strtab = dyn.d_un.d_ptr;
+                break;
+            case DT_STRSZ:
+                strSize = dyn.d_un.d_val;
+                break;
+            default:
+                break;
+        }
+    }
+
+    size_t symNb = getDynSymNb(hash, gnuHash);
+    if(symtab == 0 || strtab == 0 || symNb == 0) {
+        throw std::invalid_argument(
+                std::string(__FUNCTION__) + " : Failed to find the dynamic symbols of " + _filePath);
+    }
+
+    _dynsym = {(const Elf64_Sym*)getDynamicTable(symtab, 0), symNb};
+    _dynstr = {(const char*)getDynamicTable(strtab, 0), strSize};
+    if(gnuHash != nullptr)
+        _gnuHash = {gnuHash, 4 + gnuHash[2] * 2 + gnuHash[0] + (symNb - std::min<size_t>(gnuHash[1], symNb))};
+
+    findRelocations();
+
+    // The cache is only read, the indexes of .symtab belong to the file
+    _cachePath = getCachePath();
+    if(!_cachePath.empty())
+        loadIndexCache();
 }
 
 ElfFile::~ElfFile() {
-    close(_fd);
+    if(_cacheMap != nullptr)
+        munmap((void*)_cacheMap, _cacheMapSize);
+
+    if(_map != nullptr)
+        munmap((void*)_map, _mapSize);
 }
 
-void ElfFile::readSection(Elf64_Shdr &sect, void *buf) {
-    if(lseek(_fd, sect.sh_offset, SEEK_SET) != sect.sh_offset) {
-        throw std::invalid_argument(
-                std::string(__FUNCTION__) + "Failed to go to section offset in " + _filePath + " : " +
-                strerror(errno));
+template<typename T>
+Span<const T> ElfFile::getSection(const Elf64_Shdr &section) const {
+    if(section.sh_type == SHT_NOBITS || section.sh_offset + section.sh_size > _mapSize ||
+       section.sh_offset % alignof(T) != 0) {
+        error_log("Invalid section at offset " << section.sh_offset << " in " << _filePath);
+        return {};
     }
 
-    size_t bytesRead = read(_fd, buf, sect.sh_size);
+    return Span<const T>((const T*)(_map + section.sh_offset), section.sh_size / sizeof(T));
+}
 
-    if(bytesRead != sect.sh_size) {
-        throw std::invalid_argument(
-                std::string(__FUNCTION__) + "Failed to read section of " + _filePath + " : " +
-                strerror(errno));
+Span<const Elf64_Dyn> ElfFile::getDynamic() const {
+    return _dynamic;
+}
+
+Span<const Elf64_Sym> ElfFile::getSymTab() const {
+    return _symtab;
+}
+
+Span<const Elf64_Sym> ElfFile::getDynSymTab() const {
+    return _dynsym;
+}
+
+Span<const char> ElfFile::getStrTab() const {
+    return _strtab;
+}
+
+Span<const char> ElfFile::getDynStrTab() const {
+    return _dynstr;
+}
+
+const uint8_t *ElfFile::getDynamicTable(Elf64_Addr addr, size_t size) const {
+    // The loader relocates the pointers of the dynamic section unless it is read-only
+    if(_isImage)
+        return (const uint8_t*)(addr < _imageBase ? _imageBase + addr : addr);
+
+    for(auto& section : _sectHeader) {
+        if((section.sh_flags & SHF_ALLOC) != 0 && section.sh_type != SHT_NOBITS && addr >= section.sh_addr &&
+           addr + size <= section.sh_addr + section.sh_size && section.sh_offset + section.sh_size <= _mapSize)
+            return _map + section.sh_offset + (addr - section.sh_addr);
     }
+
+    return nullptr;
 }
 
-const std::vector<Elf64_Dyn> &ElfFile::getDynamic() {
-    if(!_dynamic.has_value()){
-        auto& v = _dynamic.emplace();
+void ElfFile::findRelocations() {
+    Elf64_Addr rela = 0;
+    Elf64_Addr jmpRel = 0;
+    Elf64_Xword relaSize = 0;
+    Elf64_Xword pltRelSize = 0;
+    Elf64_Xword pltRel = DT_RELA;
 
-        for(auto& section : _sectHeader) {
-            if(section.sh_type == SHT_DYNAMIC) {
-                v.resize(section.sh_size / section.sh_entsize);
-                readSection(section, v.data());
+    for(auto& dyn : _dynamic) {
+        switch(dyn.d_tag) {
+            case DT_RELA:
+                rela = dyn.d_un.d_ptr;
+                break;
+            case DT_RELASZ:
+                relaSize = dyn.d_un.d_val;
+                break;
+            case DT_JMPREL:
+                jmpRel = dyn.d_un.d_ptr;
+                break;
+            case DT_PLTRELSZ:
+                pltRelSize = dyn.d_un.d_val;
+                break;
+            case DT_PLTREL:
+                pltRel = dyn.d_un.d_val;
+                break;
+            default:
                 break;
-            }
         }
     }
 
-    return _dynamic.value();
+    if(jmpRel == 0 || pltRel != DT_RELA)
+        pltRelSize = 0;
+
+    // DT_RELASZ may include the PLT relocations when they follow the other ones (as the loader does)
+    if(pltRelSize != 0 && rela + relaSize == jmpRel + pltRelSize && relaSize >= pltRelSize)
+        relaSize -= pltRelSize;
+
+    for(auto table : {std::make_pair(rela, relaSize), std::make_pair(jmpRel, pltRelSize)}) {
+        auto data = table.second != 0 ? getDynamicTable(table.first, table.second) : nullptr;
+        if(data != nullptr)
+            _rela.emplace_back((const Elf64_Rela*)data, table.second / sizeof(Elf64_Rela));
+    }
 }
 
-const std::vector<Elf64_Sym> &ElfFile::getSymTab() {
-    if(!_symtab.has_value()){
-        auto& v = _symtab.emplace();
+const std::vector<Span<const Elf64_Rela>> &ElfFile::getRela() const {
+    return _rela;
+}
 
-        for(auto& section : _sectHeader) {
-            if(section.sh_type == SHT_SYMTAB) {
-                v.resize(section.sh_size / section.sh_entsize);
-                readSection(section, v.data());
-                break;
-            }
+template<typename F>
+void ElfFile::ensure(const std::atomic<bool> &ready, F &&build) {
+    if(ready.load(std::memory_order_acquire))
+        return;
+
+    std::lock_guard lk(_indexMutex);
+    if(ready.load(std::memory_order_relaxed))
+        return;
+
+    build();
+
+    // Each index is saved once it is first built
+    if(!_isImage && !_cachePath.empty() && (getReadyIndexes() & ~_cachedIndexes) != 0)
+        saveIndexCache();
+}
+
+Span<const ElfFile::Relocation> ElfFile::getSymbolRelocations() {
+    ensure(_relocatedSymbols.isReady, [this]{ buildSymbolIndex(); });
+    return _symbolRelocations.view;
+}
+
+Span<const ElfFile::Relocation> ElfFile::getSymbolRelocations(uint32_t symbolId) {
+    ensure(_areSymbolIdsReady, [this]{ buildSymbolIds(); });
+
+    auto symbol = _relocatedSymbolsById.find(symbolId);
+    if(symbol == nullptr)
+        return {};
+
+    auto& range = _relocatedSymbols.view[*symbol];
+    return {_symbolRelocations.view.data() + range.first, range.last - range.first};
+}
+
+uint32_t ElfFile::getSymbolId(const Relocation &rela) {
+    ensure(_areSymbolIdsReady, [this]{ buildSymbolIds(); });
+    return _symbolIds[rela.symbol];
+}
+
+const Elf64_Sym *ElfFile::getDefinedDynSym(std::string_view name) {
+    auto& gnuHash = _gnuHash;
+    auto& dynsym = _dynsym;
+    auto& dynstr = _dynstr;
+
+    if(!hasGnuHash()) {
+        ensure(_dynsymIndex.isReady, [&]{ _dynsymIndex.set(buildHashIndex(dynsym, dynstr)); });
+
+        return findInHashIndex(_dynsymIndex.view, dynsym, dynstr, name);
+    }
+
+    // Header : nbuckets, symoffset, bloom size (in 64 bits words), bloom shift
+    uint32_t bucketNb = gnuHash[0];
+    uint32_t symOffset = gnuHash[1];
+    uint32_t bloomSize = gnuHash[2];
+    uint32_t bloomShift = gnuHash[3];
+    auto bloom = (const uint64_t*) &gnuHash[4];
+    const uint32_t* buckets = &gnuHash[4 + bloomSize * 2];
+    const uint32_t* chains = buckets + bucketNb;
+
+    uint32_t hash = 5381;
+    for(char c : name)
+        hash = hash * 33 + (uint8_t)c;
+
+    // Most of the missing symbols are rejected by the bloom filter without touching the table
+    uint64_t word = bloom[(hash / 64) % bloomSize];
+    uint64_t mask = (1ULL << (hash % 64)) | (1ULL << ((hash >> bloomShift) % 64));
+    if((word & mask) != mask)
+        return nullptr;
+
+    uint32_t idx = buckets[hash % bucketNb];
+    if(idx < symOffset)
+        return nullptr;
+
+    // The chain ends with a hash whose lowest bit is set, duplicates are in table order
+    for(;; idx++) {
+        uint32_t chainHash = chains[idx - symOffset];
+        auto& symb = dynsym[idx];
+
+        if((chainHash | 1) == (hash | 1) && isDefined(symb) && name == &dynstr[symb.st_name])
+            return &symb;
+
+        if(chainHash & 1)
+            return nullptr;
+    }
+}
+
+bool ElfFile::hasGnuHash() const {
+    return _gnuHash.size() >= 4 && _gnuHash[0] != 0 && _gnuHash[2] != 0;
+}
+
+const Elf64_Sym *ElfFile::getDefinedDynSym(uint32_t symbolId) {
+    return getDefinedDynSym(getSymbolNames().get(symbolId));
+}
+
+const Elf64_Sym *ElfFile::getDefinedSym(std::string_view name) {
+    ElfFile* file = getSymbolFile();
+    if(file != this)
+        return file != nullptr ? file->getDefinedSym(name) : nullptr;
+
+    ensure(_symtabIndex.isReady, [this]{ _symtabIndex.set(buildHashIndex(_symtab, _strtab)); });
+
+    return findInHashIndex(_symtabIndex.view, _symtab, _strtab, name);
+}
+
+const ElfFile::SymbolRange *ElfFile::findSymbolRange(Elf64_Addr offset) {
+    ElfFile* file = getSymbolFile();
+    if(file != this && file != nullptr)
+        return file->findSymbolRange(offset);
+
+    ensure(_symbolRanges.isReady, [this]{ buildSymbolRanges(); });
+
+    auto ranges = _symbolRanges.view;
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), offset,
+                               [](Elf64_Addr offset, const SymbolRange& range){ return offset < range.start; });
+    if(it == ranges.begin())
+        return nullptr;
+
+    // A symbol without size only contains its first byte
+    --it;
+    return offset < it->start + std::max<Elf64_Xword>(it->size, 1) ? it : nullptr;
+}
+
+const char *ElfFile::getName(const SymbolRange &range) const {
+    // The range was found by findSymbolRange, the file of an image is already open
+    if(_isImage && _isSymbolFileOpen.load(std::memory_order_acquire) && _symbolFile != nullptr)
+        return _symbolFile->getName(range);
+
+    return (const char*)(getNameBase() + range.nameOffset);
+}
+
+const uint8_t *ElfFile::getNameBase() const {
+    // Ranges of an image only have dynamic symbols
+    return _isImage ? (const uint8_t*)_dynstr.data() : _map;
+}
+
+ElfFile *ElfFile::getSymbolFile() {
+    if(!_isImage)
+        return this;
+
+    ensure(_isSymbolFileOpen, [this]{
+        try {
+            Handle file = getElfFile(_filePath);
+
+            // The file may have been replaced since the module was loaded
+            if(file->_buildId.size() == _buildId.size() &&
+               std::equal(_buildId.begin(), _buildId.end(), file->_buildId.begin()) &&
+               file->_dynsym.size() == _dynsym.size())
+                _symbolFile = file;
+            else
+                info_log(_filePath << " does not match its loaded image, its symbols are ignored");
+        } catch(const std::invalid_argument& e) {
+            info_log("Only the dynamic symbols of " << _filePath << " are known (" << e.what() << ")");
+        }
+
+        _isSymbolFileOpen.store(true, std::memory_order_release);
+    });
+
+    return _symbolFile.get();
+}
+
+bool ElfFile::findLineAddress(std::string_view fileName, uint32_t line, Elf64_Addr &address) {
+    ElfFile* file = getSymbolFile();
+    if(file != this)
+        return file != nullptr && file->findLineAddress(fileName, line, address);
+
+    ensure(_isLineTableReady, [this]{
+        _lineTable = std::make_unique<LineTable>(_debugLine, _debugLineStr, _debugStr);
+        _isLineTableReady.store(true, std::memory_order_release);
+    });
+
+    return _lineTable->find(fileName, line, address);
+}
+
+std::pair<Elf64_Addr, Elf64_Addr> ElfFile::getLoadedRange() const {
+    Elf64_Addr first = UINT64_MAX;
+    Elf64_Addr last = 0;
+
+    for(auto& segment : _progHeader) {
+        if(segment.p_type == PT_LOAD && segment.p_memsz != 0) {
+            first = std::min(first, segment.p_vaddr);
+            last = std::max(last, segment.p_vaddr + segment.p_memsz);
+        }
+    }
+
+    for(auto& section : _sectHeader) {
+        if((section.sh_flags & SHF_ALLOC) != 0 && section.sh_size != 0) {
+            first = std::min(first, section.sh_addr);
+            last = std::max(last, section.sh_addr + section.sh_size);
         }
     }
 
-    return _symtab.value();
+    return first < last ? std::make_pair(first, last) : std::make_pair<Elf64_Addr, Elf64_Addr>(0, 0);
 }
 
-const std::vector<Elf64_Sym> &ElfFile::getDynSymTab() {
-    if(!_dynsym.has_value()){
-        auto& v = _dynsym.emplace();
+void ElfFile::buildSymbolRanges() {
+    std::vector<SymbolRange> ranges;
 
-        for(auto& section : _sectHeader) {
-            if(section.sh_type == SHT_DYNSYM) {
-                v.resize(section.sh_size / section.sh_entsize);
-                readSection(section, v.data());
-                break;
-            }
+    const uint8_t* nameBase = getNameBase();
+    auto addSymbols = [nameBase, &ranges](Span<const Elf64_Sym> symbols, Span<const char> strings){
+        for(auto& symb : symbols) {
+            if(isDefined(symb) && symb.st_shndx != SHN_ABS && symb.st_name != 0)
+                ranges.push_back({symb.st_value, symb.st_size, (uint64_t)((const uint8_t*)&strings[symb.st_name] - nameBase)});
         }
+    };
+
+    // Dynamic symbols first, their name is kept when .symtab has the same address (as dladdr would)
+    addSymbols(_dynsym, _dynstr);
+    addSymbols(_symtab, _strtab);
+
+    std::stable_sort(ranges.begin(), ranges.end(), [](const SymbolRange& a, const SymbolRange& b){
+        return a.start < b.start;
+    });
+
+    size_t last = 0;
+    for(size_t idx = 1; idx < ranges.size(); idx++) {
+        if(ranges[idx].start == ranges[last].start)
+            ranges[last].size = std::max(ranges[last].size, ranges[idx].size);
+        else
+            ranges[++last] = ranges[idx];
     }
 
-    return _dynsym.value();
+    if(!ranges.empty())
+        ranges.resize(last + 1);
+
+    _symbolRanges.set(std::move(ranges));
 }
 
-const std::vector<char> &ElfFile::getStrTab() {
-    if(!_strtab.has_value()){
-        auto& v = _strtab.emplace();
+StringInterner &ElfFile::getSymbolNames() {
+    static StringInterner symbolNames;
+    return symbolNames;
+}
 
-        for(uint32_t idx = 0; idx < _sectHeader.size(); idx++) {
-            auto& section = _sectHeader[idx];
+void ElfFile::buildSymbolIndex() {
+    const auto& dynstr = _dynstr;
+    const auto& dynsym = _dynsym;
 
-            if(section.sh_type == SHT_STRTAB && (section.sh_flags & SHF_ALLOC) == 0 && idx != _elfHeader.e_shstrndx) {
-                v.resize(section.sh_size);
-                readSection(section, v.data());
-                break;
+    // Relocated symbol of each dynsym entry, entries with the same name share it
+    std::vector<uint32_t> symbolOfEntry(dynsym.size(), UINT32_MAX);
+    std::unordered_map<std::string_view, uint32_t> symbolByName;
+    std::vector<RelocatedSymbol> symbols;
+    std::vector<Relocation> unsorted;
+
+    for(auto section : _rela) {
+        for(const auto& rela : section) {
+            auto symbIdx = (uint32_t)ELF64_R_SYM(rela.r_info);
+            if(symbIdx == 0 || symbIdx >= dynsym.size() || dynsym[symbIdx].st_name == 0)
+                continue;
+
+            uint32_t& symbol = symbolOfEntry[symbIdx];
+            if(symbol == UINT32_MAX) {
+                auto res = symbolByName.emplace(&dynstr[dynsym[symbIdx].st_name], symbols.size());
+                if(res.second)
+                    symbols.push_back({dynsym[symbIdx].st_name, 0, 0});
+                symbol = res.first->second;
             }
+
+            symbols[symbol].last++;
+            unsorted.push_back({rela.r_offset, symbol, (uint32_t)ELF64_R_TYPE(rela.r_info)});
         }
     }
 
-    return _strtab.value();
+    // Counting sort, the relocations of a symbol stay in position order
+    uint32_t first = 0;
+    for(auto& symbol : symbols) {
+        uint32_t nb = symbol.last;
+        symbol.first = symbol.last = first;
+        first += nb;
+    }
+
+    std::vector<Relocation> relocations(unsorted.size());
+    for(auto& rela : unsorted)
+        relocations[symbols[rela.symbol].last++] = rela;
+
+    _symbolRelocations.set(std::move(relocations));
+    _relocatedSymbols.set(std::move(symbols));
 }
 
-const std::vector<char> &ElfFile::getDynStrTab() {
-    if(!_dynstr.has_value()){
-        auto& v = _dynstr.emplace();
+void ElfFile::buildSymbolIds() {
+    if(!_relocatedSymbols.isReady.load(std::memory_order_relaxed))
+        buildSymbolIndex();
 
-        for(uint32_t idx = 0; idx < _sectHeader.size(); idx++) {
-            auto& section = _sectHeader[idx];
+    auto& symbolNames = getSymbolNames();
 
-            if(section.sh_type == SHT_STRTAB && (section.sh_flags & SHF_ALLOC) != 0 && idx != _elfHeader.e_shstrndx) {
-                v.resize(section.sh_size);
-                readSection(section, v.data());
-                break;
-            }
-        }
+    for(uint32_t idx = 0; idx < _relocatedSymbols.view.size(); idx++) {
+        uint32_t symbolId = symbolNames.intern(&_dynstr[_relocatedSymbols.view[idx].nameOffset]);
+        _symbolIds.push_back(symbolId);
+        _relocatedSymbolsById.emplace(symbolId, uint32_t(idx));
+    }
+
+    _areSymbolIdsReady.store(true, std::memory_order_release);
+}
+
+void ElfFile::buildIndexes() {
+    if(!hasGnuHash())
+        ensure(_dynsymIndex.isReady, [this]{ _dynsymIndex.set(buildHashIndex(_dynsym, _dynstr)); });
+
+    if(!_isImage) {
+        ensure(_symtabIndex.isReady, [this]{ _symtabIndex.set(buildHashIndex(_symtab, _strtab)); });
+        ensure(_symbolRanges.isReady, [this]{ buildSymbolRanges(); });
+    }
+
+    ensure(_areSymbolIdsReady, [this]{ buildSymbolIds(); });
+}
+
+void ElfFile::dropIndexes() {
+    std::lock_guard lk(_indexMutex);
+
+    _dynsymIndex.drop();
+    _symtabIndex.drop();
+    _symbolRanges.drop();
+
+    // The ids refer to the relocated symbols
+    if(_relocatedSymbols.isBuilt()) {
+        _symbolRelocations.drop();
+        _relocatedSymbols.drop();
     }
 
-    return _dynstr.value();
+    _areSymbolIdsReady.store(false, std::memory_order_relaxed);
+    _symbolIds = {};
+    _relocatedSymbolsById.clear();
+
+    _isLineTableReady.store(false, std::memory_order_relaxed);
+    _lineTable.reset();
 }
 
-const std::vector<Elf64_Rela> &ElfFile::getRela() {
-    if(!_rela.has_value()){
-        auto& v = _rela.emplace();
+size_t ElfFile::getMemoryUsage() const {
+    std::lock_guard lk(_indexMutex);
+
+    return _mapSize + _cacheMapSize + _dynsymIndex.getMemoryUsage() + _symtabIndex.getMemoryUsage() +
+           _symbolRanges.getMemoryUsage() + _symbolRelocations.getMemoryUsage() +
+           _relocatedSymbols.getMemoryUsage() + _symbolIds.capacity() * sizeof(uint32_t) +
+           _relocatedSymbolsById.size() * 2 * sizeof(uint32_t) + (_lineTable != nullptr ? _lineTable->getMemoryUsage() : 0);
+}
+
+uint32_t ElfFile::hashName(std::string_view name) {
+    uint64_t hash = name.size() * 0x9E3779B97F4A7C15ULL;
+    size_t idx = 0;
+
+    // 8 bytes at a time, the loop is branch free and vectorizable
+    for(; idx + sizeof(uint64_t) <= name.size(); idx += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, name.data() + idx, sizeof(word));
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDULL;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, name.data() + idx, name.size() - idx);
+    hash = (hash ^ tail) * 0xC4CEB9FE1A85EC53ULL;
+
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+bool ElfFile::isDefined(const Elf64_Sym &symb) {
+    uint8_t type = ELF64_ST_TYPE(symb.st_info);
+    return (type == STT_FUNC || type == STT_OBJECT || type == STT_GNU_IFUNC) && symb.st_shndx != 0;
+}
+
+std::vector<ElfFile::HashSlot> ElfFile::buildHashIndex(Span<const Elf64_Sym> symbols, Span<const char> strings) {
+    size_t definedNb = 0;
+    for(auto& symb : symbols)
+        definedNb += isDefined(symb);
+
+    size_t capacity = 16;
+    while(capacity < definedNb * 2)
+        capacity *= 2;
+
+    std::vector<HashSlot> index(capacity, {0, 0});
+
+    // Linear probing without deletion keeps the duplicates in table order
+    for(uint32_t idx = 0; idx < symbols.size(); idx++) {
+        if(!isDefined(symbols[idx]))
+            continue;
+
+        uint32_t hash = hashName(&strings[symbols[idx].st_name]);
+        size_t slot = hash & (capacity - 1);
+        while(index[slot].idx != 0)
+            slot = (slot + 1) & (capacity - 1);
+
+        index[slot] = {hash, idx + 1};
+    }
+
+    return index;
+}
+
+const Elf64_Sym *ElfFile::findInHashIndex(Span<const HashSlot> index, Span<const Elf64_Sym> symbols,
+                                          Span<const char> strings, std::string_view name) {
+    uint32_t hash = hashName(name);
+    size_t mask = index.size() - 1;
+
+    for(size_t slot = hash & mask; index[slot].idx != 0; slot = (slot + 1) & mask) {
+        if(index[slot].hash != hash)
+            continue;
+
+        auto& symb = symbols[index[slot].idx - 1];
+        if(name == &strings[symb.st_name])
+            return &symb;
+    }
+
+    return nullptr;
+}
+
+std::string ElfFile::getCachePath() const {
+    // The cache is opt-in, SPYTESTER_INDEX_CACHE sets its directory
+    const char* env = getenv("SPYTESTER_INDEX_CACHE");
+    if(env == nullptr || env[0] == '\0')
+        return {};
+
+    std::string cacheDir(env);
+
+    std::ostringstream name;
+    name << std::hex << std::setfill('0');
+
+    if(!_buildId.empty()) {
+        for(auto byte : _buildId)
+            name << std::setw(2) << (uint32_t)byte;
+    } else if(_isImage) {
+        // Its path, mtime and size are not known without the file
+        return {};
+    } else {
+        name << std::setw(8) << hashName(_filePath) << '-' << _mtime << '-' << _mapSize;
+    }
+
+    return cacheDir + "/" + name.str() + ".idx";
+}
+
+bool ElfFile::loadIndexCache() {
+    int fd = open(_cachePath.c_str(), O_RDONLY);
+    if(fd == -1)
+        return false;
+
+    struct stat cacheStat;
+    void* map = MAP_FAILED;
+    if(fstat(fd, &cacheStat) == 0 && (size_t)cacheStat.st_size >= sizeof(CacheHeader))
+        map = mmap(nullptr, (size_t)cacheStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED)
+        return false;
+
+    auto cacheMap = (const uint8_t*)map;
+    auto cacheSize = (size_t)cacheStat.st_size;
+    auto header = (const CacheHeader*)cacheMap;
+
+    // An image has the same build id as its file, it only uses the relocation indexes
+    bool isValid = memcmp(header->magic, cacheMagic, sizeof(cacheMagic)) == 0 && header->version == cacheVersion &&
+                   (_isImage || (header->fileSize == _mapSize && (!_buildId.empty() || header->mtime == _mtime) &&
+                                 header->symtabNb == _symtab.size())) &&
+                   header->dynsymNb == _dynsym.size();
+
+    const size_t entrySizes[CACHED_INDEX_NB] = {sizeof(HashSlot), sizeof(SymbolRange), sizeof(Relocation),
+                                                 sizeof(RelocatedSymbol)};
+    for(uint32_t idx = 0; isValid && idx < CACHED_INDEX_NB; idx++) {
+        isValid = header->offsets[idx] % 8 == 0 && header->offsets[idx] <= cacheSize &&
+                  header->counts[idx] <= (cacheSize - header->offsets[idx]) / entrySizes[idx] &&
+                  ((header->presentMask >> idx) & 1 || header->counts[idx] == 0);
+    }
+
+    // The relocations are built with their symbols
+    uint32_t present = header->presentMask;
+    bool hasSymtabIndex = !_isImage && (present >> SYMTAB_INDEX) & 1;
+    bool hasRanges = !_isImage && (present >> SYMBOL_RANGES) & 1;
+    bool hasRelocations = (present >> RELOCATIONS) & 1 && (present >> RELOCATED_SYMBOLS) & 1;
+
+    // Indexes in the other tables are checked once, the lookups do not check them
+    if(isValid) {
+        auto symtabIndex = getCachedIndex<HashSlot>(cacheMap, header, SYMTAB_INDEX);
+        auto ranges = getCachedIndex<SymbolRange>(cacheMap, header, SYMBOL_RANGES);
+        auto relocations = getCachedIndex<Relocation>(cacheMap, header, RELOCATIONS);
+        auto symbols = getCachedIndex<RelocatedSymbol>(cacheMap, header, RELOCATED_SYMBOLS);
+
+        isValid = !hasSymtabIndex ||
+                  (symtabIndex.size() >= 16 && (symtabIndex.size() & (symtabIndex.size() - 1)) == 0);
 
-        for(auto& section : _sectHeader) {
-            if(section.sh_type == SHT_RELA) {
-                size_t prevSize = v.size();
-                v.resize(section.sh_size / section.sh_entsize + prevSize);
-                readSection(section, v.data()+prevSize);
+        for(size_t idx = 0; isValid && hasSymtabIndex && idx < symtabIndex.size(); idx++)
+            isValid = symtabIndex[idx].idx <= _symtab.size();
+        for(size_t idx = 0; isValid && hasRanges && idx < ranges.size(); idx++)
+            isValid = ranges[idx].nameOffset < _mapSize;
+        for(size_t idx = 0; isValid && hasRelocations && idx < relocations.size(); idx++)
+            isValid = relocations[idx].symbol < symbols.size();
+        for(size_t idx = 0; isValid && hasRelocations && idx < symbols.size(); idx++) {
+            isValid = symbols[idx].nameOffset < _dynstr.size() && symbols[idx].first <= symbols[idx].last &&
+                      symbols[idx].last <= relocations.size();
+        }
+
+        if(isValid) {
+            if(hasSymtabIndex)
+                _symtabIndex.map(symtabIndex);
+            if(hasRanges)
+                _symbolRanges.map(ranges);
+            if(hasRelocations) {
+                _symbolRelocations.map(relocations);
+                _relocatedSymbols.map(symbols);
             }
         }
     }
 
-    return _rela.value();
+    if(!isValid) {
+        info_log("Ignoring invalid index cache " << _cachePath << " of " << _filePath);
+        munmap(map, cacheSize);
+        return false;
+    }
+
+    _cacheMap = cacheMap;
+    _cacheMapSize = cacheSize;
+    _cachedIndexes = present;
+
+    return true;
 }
 
-ElfFile &ElfFile::getElfFile(const std::string &filePath) {
-    decltype(elfFiles.begin()) it;
+uint32_t ElfFile::getReadyIndexes() const {
+    uint32_t ready = 0;
+
+    if(_symtabIndex.isReady.load(std::memory_order_relaxed))
+        ready |= 1U << SYMTAB_INDEX;
+    if(_symbolRanges.isReady.load(std::memory_order_relaxed))
+        ready |= 1U << SYMBOL_RANGES;
+    if(_relocatedSymbols.isReady.load(std::memory_order_relaxed))
+        ready |= 1U << RELOCATIONS | 1U << RELOCATED_SYMBOLS;
+
+    return ready;
+}
+
+void ElfFile::saveIndexCache() {
+    const std::string& cachePath = _cachePath;
+    uint32_t ready = getReadyIndexes();
+
+    // An index of the file dropped from memory since would be lost, the new ones wait for the next run
+    if((ready & _cachedIndexes) != _cachedIndexes)
+        return;
+
+    CacheHeader header{};
+    memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+    header.version = cacheVersion;
+    header.presentMask = ready;
+    header.fileSize = _mapSize;
+    header.mtime = _mtime;
+    header.symtabNb = _symtab.size();
+    header.dynsymNb = _dynsym.size();
+
+    const std::pair<const void*, size_t> indexes[CACHED_INDEX_NB] = {
+            {_symtabIndex.view.data(), _symtabIndex.view.size() * sizeof(HashSlot)},
+            {_symbolRanges.view.data(), _symbolRanges.view.size() * sizeof(SymbolRange)},
+            {_symbolRelocations.view.data(), _symbolRelocations.view.size() * sizeof(Relocation)},
+            {_relocatedSymbols.view.data(), _relocatedSymbols.view.size() * sizeof(RelocatedSymbol)},
+    };
+    const size_t counts[CACHED_INDEX_NB] = {_symtabIndex.view.size(), _symbolRanges.view.size(),
+                                            _symbolRelocations.view.size(), _relocatedSymbols.view.size()};
+
+    uint64_t offset = sizeof(CacheHeader);
+    for(uint32_t idx = 0; idx < CACHED_INDEX_NB; idx++) {
+        offset = (offset + 7) & ~7ULL;
+        header.offsets[idx] = offset;
+        header.counts[idx] = counts[idx];
+        offset += indexes[idx].second;
+    }
+
+    // Written aside then renamed, concurrent runs never map a partial file
+    makeDirectories(cachePath.substr(0, cachePath.find_last_of('/')));
+    std::string tmpPath = cachePath + "." + std::to_string(getpid()) + ".tmp";
+
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd == -1) {
+        info_log("Cannot create the index cache " << tmpPath << " : " << strerror(errno));
+        return;
+    }
+
+    bool isWritten = pwrite(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+    for(uint32_t idx = 0; isWritten && idx < CACHED_INDEX_NB; idx++) {
+        isWritten = indexes[idx].second == 0 ||
+                    pwrite(fd, indexes[idx].first, indexes[idx].second, (off_t)header.offsets[idx]) ==
+                    (ssize_t)indexes[idx].second;
+    }
+    close(fd);
+
+    if(!isWritten || rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+        info_log("Cannot write the index cache " << cachePath << " : " << strerror(errno));
+        unlink(tmpPath.c_str());
+        return;
+    }
+
+    _cachedIndexes = ready;
+}
+
+// Files by (dev, inode), a file reached through several paths or links is mapped once.
+// Images by link map, only while they are used.
+class ElfFile::Registry {
+public:
+    static Registry& get() {
+        // Never destroyed, handles may be released during the static destruction
+        static auto registry = new Registry();
+        return *registry;
+    }
+
+    Handle getFile(const std::string& filePath) {
+        struct stat fileStat;
+        if(stat(filePath.c_str(), &fileStat) == -1) {
+            throw std::invalid_argument(
+                    std::string(__FUNCTION__) + " : Failed to load " + filePath + " : " + strerror(errno));
+        }
+
+        Key key{fileStat.st_dev, fileStat.st_ino};
+        std::unique_lock lk(_mutex);
+
+        // Files are mapped and indexed out of the lock, concurrent requests of the same file wait for it
+        for(;;) {
+            auto it = _files.find(key);
+            if(it == _files.end())
+                break;
+
+            it->second.lastUse = ++_clock;
+            if(it->second.file != nullptr)
+                return it->second.file;
+
+            _loaded.wait(lk);
+        }
+
+        _files[key].lastUse = ++_clock;
+        lk.unlock();
+
+        Handle file;
+        try {
+            file = std::make_shared<ElfFile>(filePath);
+        } catch(...) {
+            lk.lock();
+            _files.erase(key);
+            _loaded.notify_all();
+            throw;
+        }
+
+        // The handle keeps the new file out of the eviction
+        lk.lock();
+        _files[key].file = file;
+        _loaded.notify_all();
+        trim();
+
+        return file;
+    }
+
+    Handle getImage(const struct link_map* lm) {
+        std::unique_lock lk(_imagesMutex);
+
+        // Images are built out of the lock, concurrent requests of the same module wait for it
+        auto it = _images.find(lm);
+        while(it != _images.end() && it->second.isBuilding) {
+            _imageBuilt.wait(lk);
+            it = _images.find(lm);
+        }
+
+        // The link map of an unloaded module may be reused by another one
+        Handle image = it != _images.end() ? it->second.image.lock() : nullptr;
+        if(image != nullptr && image->_imageBase == lm->l_addr && image->_dynamic.data() == lm->l_ld)
+            return image;
+
+        for(it = _images.begin(); it != _images.end();)
+            it = !it->second.isBuilding && it->second.image.expired() ? _images.erase(it) : std::next(it);
+
+        _images[lm] = {{}, true};
+        lk.unlock();
+
+        try {
+            image = std::make_shared<ElfFile>(lm);
+        } catch(...) {
+            lk.lock();
+            _images.erase(lm);
+            _imageBuilt.notify_all();
+            throw;
+        }
+
+        lk.lock();
+        _images[lm] = {image, false};
+        _imageBuilt.notify_all();
+
+        return image;
+    }
+
+    void setBudget(size_t budget) {
+        std::lock_guard lk(_mutex);
+        _budget = budget;
+        trim();
+    }
+
+    void trimFiles() {
+        std::lock_guard lk(_mutex);
+        trim();
+    }
 
+private:
+    struct Entry {
+        Handle file;
+        uint64_t lastUse = 0;
+    };
+
+    void trim() {
+        size_t usage = 0;
+        for(auto& entry : _files) {
+            if(entry.second.file != nullptr)
+                usage += entry.second.file->getMemoryUsage();
+        }
+
+        if(usage <= _budget)
+            return;
+
+        // Only the registry holds the unused files, nobody can get a new handle while the mutex is held
+        std::vector<std::pair<uint64_t, Key>> unused;
+        for(auto& entry : _files) {
+            if(entry.second.file != nullptr && entry.second.file.use_count() == 1)
+                unused.emplace_back(entry.second.lastUse, entry.first);
+        }
+        std::sort(unused.begin(), unused.end());
+
+        for(auto it = unused.begin(); it != unused.end() && usage > _budget; it++) {
+            ElfFile& file = *_files[it->second].file;
+            size_t before = file.getMemoryUsage();
+            file.dropIndexes();
+            usage -= before - file.getMemoryUsage();
+        }
+
+        for(auto it = unused.begin(); it != unused.end() && usage > _budget; it++) {
+            usage -= _files[it->second].file->getMemoryUsage();
+            _files.erase(it->second);
+        }
+    }
+
+    using Key = std::pair<dev_t, ino_t>;
+
+    std::mutex _mutex;
+    std::condition_variable _loaded;
+    // The file of an entry is null while it is loaded
+    std::map<Key, Entry> _files;
+    uint64_t _clock = 0;
+    size_t _budget = 256 << 20;
+
+    struct ImageEntry {
+        std::weak_ptr<ElfFile> image;
+        bool isBuilding;
+    };
+
+    std::mutex _imagesMutex;
+    std::condition_variable _imageBuilt;
+    std::map<const struct link_map*, ImageEntry> _images;
+};
+
+ElfFile::Handle ElfFile::getElfFile(const std::string &filePath) {
     if(filePath.empty()){
         char buffer[PATH_MAX];
         ssize_t len = readlink("/proc/self/exe", buffer, sizeof(buffer));
@@ -177,22 +1175,29 @@ ElfFile &ElfFile::getElfFile(const std::string &filePath) {
         }
         buffer[len] = '\0';
 
-        it = elfFiles.emplace(buffer, buffer).first;
-
-    } else {
-        it = elfFiles.emplace(filePath ,filePath).first;
+        return Registry::get().getFile(buffer);
     }
-    return it->second;
+
+    return Registry::get().getFile(filePath);
+}
+
+ElfFile::Handle ElfFile::getElfImage(const struct link_map *lm) {
+    return Registry::get().getImage(lm);
+}
+
+void ElfFile::setMemoryBudget(size_t budget) {
+    Registry::get().setBudget(budget);
+}
+
+void ElfFile::trimRegistry() {
+    Registry::get().trimFiles();
 }
 
 Elf64_Addr ElfFile::getEntryPoint() const {
-    return this->_elfHeader.e_entry;
+    return _elfHeader != nullptr ? _elfHeader->e_entry : 0;
 }
 
-const std::vector<Elf64_Shdr> &ElfFile::getShdr() {
+Span<const Elf64_Shdr> ElfFile::getShdr() const {
     return this->_sectHeader;
 }
 
-// elfFiles are used by SpyLoader constructor, so it must be initialized before other static variables with
-// default init priority (65535)
-std::map<std::string, ElfFile> ElfFile::elfFiles __attribute__((init_priority(65534)));
@@ -0,0 +1,305 @@
+#include <cpuid.h>
+#include <cstring>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+
+#include "FastTracePoint.h"
+#include "MemoryPatcher.h"
+#include "Logger.h"
+#include "helpers/CodeEmitter.h"
+
+namespace {
+    typedef enum {
+        FXSAVE,
+        XSAVE,
+        XSAVEC
+    } E_SaveMode;
+
+    struct SaveArea {
+        E_SaveMode mode;
+        size_t size;
+    };
+
+    // x87, SSE, AVX and AVX-512 states, the ones a callback may clobber (large AMX tiles are left aside)
+    const uint32_t savedFeatures = 0xE7;
+
+    const SaveArea& getSaveArea() {
+        static const SaveArea area = []{
+            uint32_t eax, ebx, ecx, edx;
+
+            if(!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_XSAVE) || !(ecx & bit_OSXSAVE))
+                return SaveArea{FXSAVE, 512};
+
+            // Compacted format only stores the requested components, skipping the ones in initial state
+            if(__get_cpuid_count(0xD, 1, &eax, &ebx, &ecx, &edx) && (eax & bit_XSAVEC) && ebx != 0)
+                return SaveArea{XSAVEC, (size_t)ebx};
+
+            __get_cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx);
+            return SaveArea{XSAVE, (size_t)ebx};
+        }();
+
+        return area;
+    }
+
+    // Push order, the Context structure is its reverse
+    const uint8_t savedRegs[] = {0, 1, 2, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+    void push(CodeEmitter& emitter, uint8_t reg) {
+        if(reg >= 8)
+            emitter.bytes({0x41});
+        emitter.bytes({(uint8_t)(0x50 + (reg & 0x7))});
+    }
+
+    void pop(CodeEmitter& emitter, uint8_t reg) {
+        if(reg >= 8)
+            emitter.bytes({0x41});
+        emitter.bytes({(uint8_t)(0x58 + (reg & 0x7))});
+    }
+}
+
+FastTracePoint::FastTracePoint(CodeArena &arena, std::string &&name, void *addr, Callback callback, void *data) :
+_arena(arena), _name(std::move(name)), _addr((uint8_t*)addr), _isSet(false), _trampoline(nullptr),
+_dispatch(new Dispatch{{this}, {0}, {callback}, {data}, {0}})
+{
+    // Threads running the patched bytes have to see either the original code or the whole jump
+    if((uint64_t)_addr % sizeof(uint64_t) + jumpSize > sizeof(uint64_t)) {
+        delete _dispatch;
+        error_log("FastTracePoint (" << _name << ") : the jump at " << addr << " would straddle two words");
+        throw std::invalid_argument("invalid fast tracepoint address");
+    }
+
+    if(!buildTrampoline()) {
+        delete _dispatch;
+        error_log("FastTracePoint (" << _name << ") cannot be created at " << addr);
+        throw std::invalid_argument("invalid fast tracepoint address");
+    }
+}
+
+FastTracePoint::~FastTracePoint() {
+    unset();
+
+    // A thread may still be running the trampoline, it is not released and neither is its dispatch block.
+    // Wait for the callbacks being run (they must not block) before the tracepoint goes away.
+    _dispatch->tracePoint.store(nullptr);
+    while(_dispatch->activeNb.load() != 0)
+        std::this_thread::yield();
+
+    info_log("FastTracePoint (" << _name << ") trampoline at " << _trampoline << " is kept");
+}
+
+void *FastTracePoint::getAddr() const {
+    return _addr;
+}
+
+const std::string &FastTracePoint::getName() const {
+    return _name;
+}
+
+uint64_t FastTracePoint::getHitNb() const {
+    return _dispatch->hitNb.load(std::memory_order_relaxed);
+}
+
+bool FastTracePoint::isSet() const {
+    return _isSet;
+}
+
+void FastTracePoint::setCallback(Callback callback, void *data) {
+    _dispatch->data.store(data, std::memory_order_relaxed);
+    _dispatch->callback.store(callback, std::memory_order_release);
+}
+
+bool FastTracePoint::set() {
+    std::lock_guard lk(_mutex);
+    if(_isSet)
+        return true;
+
+    uint8_t jump[jumpSize];
+    auto rel = (int64_t)((uint64_t)_trampoline - ((uint64_t)_addr + jumpSize));
+    auto rel32 = (int32_t)rel;
+
+    jump[0] = 0xE9;
+    memcpy(&jump[1], &rel32, sizeof(rel32));
+
+    if(!patch(jump))
+        return false;
+
+    info_log("FastTracePoint (" << _name << ") set at " << (void*)_addr);
+    _isSet = true;
+
+    return true;
+}
+
+bool FastTracePoint::unset() {
+    std::lock_guard lk(_mutex);
+    if(!_isSet)
+        return true;
+
+    if(!patch(_originalCode.data()))
+        return false;
+
+    info_log("FastTracePoint (" << _name << ") unset");
+    _isSet = false;
+
+    return true;
+}
+
+bool FastTracePoint::patch(const uint8_t *bytes) {
+    // Within an aligned word (checked at construction) : a single store, merged with the neighbour bytes
+    return MemoryPatcher::write(_addr, bytes, jumpSize);
+}
+
+void FastTracePoint::dispatch(Dispatch *dispatch, Context *context) {
+    dispatch->hitNb.fetch_add(1, std::memory_order_relaxed);
+
+    // Sequentially consistent with the destructor : either it sees this thread active or this thread sees
+    // the tracepoint detached
+    dispatch->activeNb.fetch_add(1);
+    FastTracePoint* tracePoint = dispatch->tracePoint.load();
+
+    auto callback = dispatch->callback.load(std::memory_order_acquire);
+    if(tracePoint != nullptr && callback != nullptr)
+        callback(*tracePoint, *context, dispatch->data.load(std::memory_order_relaxed));
+
+    dispatch->activeNb.fetch_sub(1, std::memory_order_release);
+}
+
+bool FastTracePoint::buildTrampoline() {
+    // Decode the instructions overwritten by the jump
+    uint8_t code[jumpSize + X86Instruction::maxLength];
+    struct iovec local = {code, sizeof(code)};
+    struct iovec remote = {_addr, sizeof(code)};
+
+    // Stops at the end of the mapping instead of faulting
+    ssize_t codeLen = process_vm_readv(getpid(), &local, 1, &remote, 1, 0);
+    if(codeLen < (ssize_t)jumpSize)
+        return false;
+
+    std::vector<X86Instruction> instructions;
+    size_t coveredLen = 0;
+
+    while(coveredLen < jumpSize) {
+        X86Instruction instruction;
+        if(!X86Instruction::decode(&code[coveredLen], (size_t)codeLen - coveredLen, instruction)) {
+            error_log("Unsupported instruction at " << (void*)(_addr + coveredLen));
+            return false;
+        }
+
+        auto branch = instruction.getBranch();
+        coveredLen += instruction.getLength();
+
+        // The bytes following an unconditional branch may belong to another function
+        if(coveredLen < jumpSize && (branch == X86Instruction::JMP_REL || branch == X86Instruction::JMP_INDIRECT
+                                     || branch == X86Instruction::RET)) {
+            error_log("Not enough room for a jump at " << (void*)_addr);
+            return false;
+        }
+
+        instructions.push_back(instruction);
+    }
+
+    // A covered instruction branching into the covered bytes would land in the middle of the jump
+    size_t offset = 0;
+    for(auto& instruction : instructions) {
+        auto branch = instruction.getBranch();
+        if(branch == X86Instruction::JMP_REL || branch == X86Instruction::JCC_REL || branch == X86Instruction::CALL_REL
+           || branch == X86Instruction::LOOP_REL) {
+            auto target = instruction.getBranchTarget((uint64_t)_addr + offset);
+            if(target > (uint64_t)_addr && target < (uint64_t)_addr + coveredLen) {
+                error_log("Covered instruction at " << (void*)(_addr + offset) << " branches into the jump");
+                return false;
+            }
+        }
+        offset += instruction.getLength();
+    }
+
+    _originalCode.assign(code, code + jumpSize);
+
+    auto& arena = _arena;
+    _trampoline = arena.allocate(trampolineSize, _addr);
+    if(_trampoline == nullptr)
+        return false;
+
+    CodeEmitter emitter((uint64_t)_trampoline);
+    const SaveArea& saveArea = getSaveArea();
+
+    // lea -128(%rsp), %rsp (skip the red zone) ; pushfq
+    emitter.bytes({0x48, 0x8D, 0x64, 0x24, 0x80, 0x9C});
+    for(auto reg : savedRegs)
+        push(emitter, reg);
+
+    // mov %rsp, %rbx ; sub $size, %rsp ; and $-64, %rsp
+    emitter.bytes({0x48, 0x89, 0xE3});
+    emitter.bytes({0x48, 0x81, 0xEC}).imm32((uint32_t)saveArea.size);
+    emitter.bytes({0x48, 0x83, 0xE4, 0xC0});
+
+    if(saveArea.mode == FXSAVE) {
+        // fxsave64 (%rsp)
+        emitter.bytes({0x48, 0x0F, 0xAE, 0x04, 0x24});
+    } else {
+        // mov $features, %eax ; xor %edx, %edx
+        emitter.bytes({0xB8}).imm32(savedFeatures).bytes({0x31, 0xD2});
+
+        if(saveArea.mode == XSAVEC) {
+            // xsavec64 (%rsp)
+            emitter.bytes({0x48, 0x0F, 0xC7, 0x24, 0x24});
+        } else {
+            // The XSAVE header must be zeroed before xsave (xrstor checks its reserved bytes)
+            for(uint32_t off = 512; off < 512 + 64; off += 8)
+                emitter.bytes({0x48, 0xC7, 0x84, 0x24}).imm32(off).imm32(0);
+
+            // xsave64 (%rsp)
+            emitter.bytes({0x48, 0x0F, 0xAE, 0x24, 0x24});
+        }
+    }
+
+    // mov %rbx, %rsi ; movabs $dispatch block, %rdi ; movabs $dispatch, %rax ; call *%rax
+    emitter.bytes({0x48, 0x89, 0xDE});
+    emitter.bytes({0x48, 0xBF}).imm64((uint64_t)_dispatch);
+    emitter.bytes({0x48, 0xB8}).imm64((uint64_t)&FastTracePoint::dispatch);
+    emitter.bytes({0xFF, 0xD0});
+
+    if(saveArea.mode == FXSAVE) {
+        // fxrstor64 (%rsp)
+        emitter.bytes({0x48, 0x0F, 0xAE, 0x0C, 0x24});
+    } else {
+        // mov $features, %eax ; xor %edx, %edx ; xrstor64 (%rsp)
+        emitter.bytes({0xB8}).imm32(savedFeatures).bytes({0x31, 0xD2});
+        emitter.bytes({0x48, 0x0F, 0xAE, 0x2C, 0x24});
+    }
+
+    // mov %rbx, %rsp
+    emitter.bytes({0x48, 0x89, 0xDC});
+    for(auto it = std::rbegin(savedRegs); it != std::rend(savedRegs); it++)
+        pop(emitter, *it);
+
+    // popfq ; lea 128(%rsp), %rsp
+    emitter.bytes({0x9D, 0x48, 0x8D, 0xA4, 0x24}).imm32(redZoneSize);
+
+    // Original instructions, then back to the code following them
+    offset = 0;
+    for(auto& instruction : instructions) {
+        uint8_t relocated[X86Instruction::maxRelocatedLength];
+        size_t len = instruction.relocate(&code[offset], (uint64_t)_addr + offset, emitter.here(), relocated);
+        if(len == 0) {
+            error_log("Instruction at " << (void*)(_addr + offset) << " cannot be relocated");
+            arena.release(_trampoline, trampolineSize);
+            _trampoline = nullptr;
+            return false;
+        }
+
+        emitter.code().insert(emitter.code().end(), relocated, relocated + len);
+        offset += instruction.getLength();
+    }
+
+    auto back = (int64_t)(((uint64_t)_addr + coveredLen) - (emitter.here() + jumpSize));
+    emitter.bytes({0xE9}).imm32((uint32_t)(int32_t)back);
+
+    if(emitter.code().size() > trampolineSize || !CodeArena::write(_trampoline, emitter.code().data(), emitter.code().size())) {
+        arena.release(_trampoline, trampolineSize);
+        _trampoline = nullptr;
+        return false;
+    }
+
+    return true;
+}
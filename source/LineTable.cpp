@@ -0,0 +1,442 @@
+#include <algorithm>
+#include <cstring>
+
+#include "LineTable.h"
+#include "Logger.h"
+
+namespace {
+    // DWARF constants, elf.h does not have them
+    const uint8_t DW_LNS_copy = 1;
+    const uint8_t DW_LNS_advance_pc = 2;
+    const uint8_t DW_LNS_advance_line = 3;
+    const uint8_t DW_LNS_set_file = 4;
+    const uint8_t DW_LNS_negate_stmt = 6;
+    const uint8_t DW_LNS_const_add_pc = 8;
+    const uint8_t DW_LNS_fixed_advance_pc = 9;
+
+    const uint8_t DW_LNE_end_sequence = 1;
+    const uint8_t DW_LNE_set_address = 2;
+
+    const uint64_t DW_LNCT_path = 1;
+    const uint64_t DW_LNCT_directory_index = 2;
+
+    const uint64_t DW_FORM_data2 = 0x05;
+    const uint64_t DW_FORM_data4 = 0x06;
+    const uint64_t DW_FORM_data8 = 0x07;
+    const uint64_t DW_FORM_string = 0x08;
+    const uint64_t DW_FORM_block = 0x09;
+    const uint64_t DW_FORM_block1 = 0x0a;
+    const uint64_t DW_FORM_data1 = 0x0b;
+    const uint64_t DW_FORM_strp = 0x0e;
+    const uint64_t DW_FORM_udata = 0x0f;
+    const uint64_t DW_FORM_data16 = 0x1e;
+    const uint64_t DW_FORM_line_strp = 0x1f;
+
+    // Reads are bounded by end, reading past it invalidates the reader and returns 0
+    class Reader {
+    public:
+        Reader(Span<const uint8_t> data, size_t pos, size_t end)
+        : _data(data), _pos(pos), _end(std::min(end, data.size())), _isValid(pos <= _end) {}
+
+        bool isValid() const { return _isValid; }
+        size_t getPos() const { return _pos; }
+        bool isAtEnd() const { return !_isValid || _pos >= _end; }
+
+        void seek(size_t pos) {
+            _isValid = _isValid && pos <= _end;
+            _pos = pos;
+        }
+
+        void skip(uint64_t size) {
+            _isValid = _isValid && size <= _end - _pos;
+            _pos = _isValid ? _pos + size : _end;
+        }
+
+        uint64_t u(uint32_t size) {
+            uint64_t val = 0;
+            if(size > 8 || size > _end - _pos)
+                _isValid = false;
+
+            for(uint32_t idx = 0; _isValid && idx < size; idx++)
+                val |= (uint64_t)_data[_pos++] << (idx * 8);
+
+            return val;
+        }
+
+        uint64_t uleb() {
+            uint64_t val = 0;
+            for(uint32_t shift = 0; _isValid; shift += 7) {
+                uint8_t byte = (uint8_t)u(1);
+                if(shift < 64)
+                    val |= (uint64_t)(byte & 0x7F) << shift;
+                if((byte & 0x80) == 0)
+                    break;
+            }
+
+            return val;
+        }
+
+        int64_t sleb() {
+            int64_t val = 0;
+            uint32_t shift = 0;
+            uint8_t byte = 0x80;
+
+            while(_isValid && (byte & 0x80) != 0) {
+                byte = (uint8_t)u(1);
+                if(shift < 64)
+                    val |= (int64_t)(byte & 0x7F) << shift;
+                shift += 7;
+            }
+
+            if(shift < 64 && (byte & 0x40) != 0)
+                val |= -((int64_t)1 << shift);
+
+            return val;
+        }
+
+        const char* str() {
+            auto str = (const char*)&_data[_pos];
+            auto nul = _isValid ? memchr(str, 0, _end - _pos) : nullptr;
+            if(nul == nullptr) {
+                _isValid = false;
+                return "";
+            }
+
+            _pos += (size_t)((const char*)nul - str) + 1;
+            return str;
+        }
+
+    private:
+        Span<const uint8_t> _data;
+        size_t _pos;
+        size_t _end;
+        bool _isValid;
+    };
+
+    const char* getString(Span<const uint8_t> strings, uint64_t offset) {
+        if(offset >= strings.size() || memchr(&strings[offset], 0, strings.size() - offset) == nullptr)
+            return nullptr;
+
+        return (const char*)&strings[offset];
+    }
+
+    std::string joinPath(std::string_view dir, std::string_view name) {
+        if(dir.empty() || name.empty() || name[0] == '/')
+            return std::string(name);
+
+        std::string path(dir);
+        if(path.back() != '/')
+            path += '/';
+        return path.append(name);
+    }
+}
+
+LineTable::LineTable(Span<const uint8_t> debugLine, Span<const uint8_t> debugLineStr, Span<const uint8_t> debugStr)
+: _debugLine(debugLine), _debugLineStr(debugLineStr), _debugStr(debugStr) {
+    for(size_t offset = 0; offset < _debugLine.size();) {
+        auto& unit = _units.emplace_back();
+        bool isValid = readUnit(offset, unit);
+
+        // Without a valid length the next units cannot be found
+        if(unit.end <= offset) {
+            error_log("Invalid line table at offset " << offset << " of .debug_line");
+            _units.pop_back();
+            break;
+        }
+        offset = unit.end;
+
+        if(!isValid) {
+            info_log("Ignoring the line table at offset " << unit.offset << " of .debug_line");
+            _units.pop_back();
+            continue;
+        }
+
+        auto unitIdx = (uint32_t)(_units.size() - 1);
+        for(uint32_t fileId : unit.files) {
+            if(fileId != UINT32_MAX && (_unitsOfFile[fileId].empty() || _unitsOfFile[fileId].back() != unitIdx))
+                _unitsOfFile[fileId].push_back(unitIdx);
+        }
+    }
+}
+
+bool LineTable::readUnit(size_t offset, Unit &unit) {
+    Reader reader(_debugLine, offset, _debugLine.size());
+    unit.offset = offset;
+    unit.end = 0;
+
+    uint32_t offsetSize = 4;
+    uint64_t length = reader.u(4);
+    if(length == 0xFFFFFFFF) {
+        offsetSize = 8;
+        length = reader.u(8);
+    } else if(length >= 0xFFFFFFF0) {
+        return false;
+    }
+
+    if(!reader.isValid() || length > _debugLine.size() - reader.getPos())
+        return false;
+
+    unit.end = reader.getPos() + length;
+    reader = Reader(_debugLine, reader.getPos(), unit.end);
+
+    unit.version = (uint16_t)reader.u(2);
+    if(unit.version < 2 || unit.version > 5)
+        return false;
+
+    if(unit.version >= 5)
+        reader.skip(2);     // Address and segment selector sizes
+
+    uint64_t headerLength = reader.u(offsetSize);
+    unit.program = reader.getPos() + headerLength;
+
+    unit.minInstLength = (uint8_t)reader.u(1);
+    if(unit.version >= 4)
+        reader.skip(1);     // Maximum operations per instruction (VLIW only)
+    unit.defaultIsStmt = reader.u(1) != 0;
+    unit.lineBase = (int8_t)reader.u(1);
+    unit.lineRange = (uint8_t)reader.u(1);
+    unit.opcodeBase = (uint8_t)reader.u(1);
+    unit.opcodeLengths = &_debugLine[reader.getPos()];
+    reader.skip(unit.opcodeBase > 0 ? unit.opcodeBase - 1 : 0);
+
+    if(unit.lineRange == 0 || unit.opcodeBase == 0)
+        return false;
+
+    // The compilation directory (directory 0 before DWARF 5) is only known from .debug_info, paths are then
+    // relative to it and matched by their end
+    std::vector<std::string> dirs;
+
+    if(unit.version < 5) {
+        dirs.emplace_back();
+        for(const char* dir = reader.str(); dir[0] != '\0'; dir = reader.str())
+            dirs.emplace_back(dir);
+
+        unit.files.push_back(UINT32_MAX);
+        for(const char* name = reader.str(); name[0] != '\0'; name = reader.str()) {
+            uint64_t dirIdx = reader.uleb();
+            reader.uleb();  // Modification time
+            reader.uleb();  // Size
+            unit.files.push_back(addFile(joinPath(dirIdx < dirs.size() ? dirs[dirIdx] : "", name)));
+        }
+
+        return reader.isValid() && reader.getPos() <= unit.program && unit.program <= unit.end;
+    }
+
+    // DWARF 5 : the directory and file entries are described by (content type, form) pairs
+    auto readEntries = [this, &reader, offsetSize](std::vector<std::pair<std::string, uint64_t>>& entries) {
+        std::vector<std::pair<uint64_t, uint64_t>> formats((size_t)reader.u(1));
+        for(auto& format : formats) {
+            format.first = reader.uleb();
+            format.second = reader.uleb();
+        }
+
+        uint64_t entryNb = reader.uleb();
+        for(uint64_t idx = 0; idx < entryNb && reader.isValid(); idx++) {
+            auto& entry = entries.emplace_back(std::string(), 0);
+
+            for(auto& format : formats) {
+                const char* string = nullptr;
+                uint64_t val = 0;
+
+                switch(format.second) {
+                    case DW_FORM_string:    string = reader.str(); break;
+                    case DW_FORM_line_strp: string = getString(_debugLineStr, reader.u(offsetSize)); break;
+                    case DW_FORM_strp:      string = getString(_debugStr, reader.u(offsetSize)); break;
+                    case DW_FORM_udata:     val = reader.uleb(); break;
+                    case DW_FORM_data1:     val = reader.u(1); break;
+                    case DW_FORM_data2:     val = reader.u(2); break;
+                    case DW_FORM_data4:     val = reader.u(4); break;
+                    case DW_FORM_data8:     val = reader.u(8); break;
+                    case DW_FORM_data16:    reader.skip(16); break;
+                    case DW_FORM_block:     reader.skip(reader.uleb()); break;
+                    case DW_FORM_block1:    reader.skip(reader.u(1)); break;
+                    default:
+                        return false;
+                }
+
+                if(format.first == DW_LNCT_path && string != nullptr)
+                    entry.first = string;
+                else if(format.first == DW_LNCT_directory_index)
+                    entry.second = val;
+            }
+        }
+
+        return reader.isValid();
+    };
+
+    std::vector<std::pair<std::string, uint64_t>> dirEntries;
+    std::vector<std::pair<std::string, uint64_t>> fileEntries;
+    if(!readEntries(dirEntries) || !readEntries(fileEntries))
+        return false;
+
+    for(auto& dir : dirEntries)
+        dirs.push_back(dirs.empty() ? dir.first : joinPath(dirs[0], dir.first));
+
+    for(auto& file : fileEntries) {
+        if(file.first.empty())
+            unit.files.push_back(UINT32_MAX);
+        else
+            unit.files.push_back(addFile(joinPath(file.second < dirs.size() ? dirs[file.second] : "", file.first)));
+    }
+
+    return reader.getPos() <= unit.program && unit.program <= unit.end;
+}
+
+uint32_t LineTable::addFile(std::string &&path) {
+    auto it = _fileIds.find(path);
+    if(it != _fileIds.end())
+        return it->second;
+
+    auto fileId = (uint32_t)_files.size();
+    std::string_view stored = _files.emplace_back(std::move(path));
+
+    _fileIds.emplace(stored, fileId);
+    _filesByName[stored.substr(stored.find_last_of('/') + 1)].push_back(fileId);
+    _unitsOfFile.emplace_back();
+
+    return fileId;
+}
+
+void LineTable::decode(Unit &unit) {
+    Reader reader(_debugLine, unit.program, unit.end);
+    std::vector<Row> rows;
+
+    Elf64_Addr address = 0;
+    uint64_t file = 1;
+    int64_t line = 1;
+    bool isStmt = unit.defaultIsStmt;
+    // Code removed by the linker keeps its line rows, at address 0 (or -1 for lld)
+    bool isDiscarded = false;
+
+    auto addRow = [&]() {
+        if(isStmt && !isDiscarded && line > 0 && line <= UINT32_MAX && file < unit.files.size() &&
+           unit.files[file] != UINT32_MAX)
+            rows.push_back({unit.files[file], (uint32_t)line, address});
+    };
+
+    while(!reader.isAtEnd()) {
+        auto opcode = (uint8_t)reader.u(1);
+
+        // Special opcode : advance the address and the line, then add a row
+        if(opcode >= unit.opcodeBase) {
+            uint8_t adjusted = opcode - unit.opcodeBase;
+            address += (adjusted / unit.lineRange) * unit.minInstLength;
+            line += unit.lineBase + adjusted % unit.lineRange;
+            addRow();
+            continue;
+        }
+
+        switch(opcode) {
+            case 0: {
+                uint64_t size = reader.uleb();
+                size_t next = reader.getPos() + size;
+                if(size == 0)
+                    break;
+
+                auto extended = (uint8_t)reader.u(1);
+                if(extended == DW_LNE_end_sequence) {
+                    address = 0;
+                    file = 1;
+                    line = 1;
+                    isStmt = unit.defaultIsStmt;
+                    isDiscarded = false;
+                } else if(extended == DW_LNE_set_address) {
+                    address = reader.u((uint32_t)size - 1);
+                    isDiscarded = address == 0 || address == UINT64_MAX;
+                }
+
+                reader.seek(next);
+                break;
+            }
+            case DW_LNS_copy:
+                addRow();
+                break;
+            case DW_LNS_advance_pc:
+                address += reader.uleb() * unit.minInstLength;
+                break;
+            case DW_LNS_advance_line:
+                line += reader.sleb();
+                break;
+            case DW_LNS_set_file:
+                file = reader.uleb();
+                break;
+            case DW_LNS_negate_stmt:
+                isStmt = !isStmt;
+                break;
+            case DW_LNS_const_add_pc:
+                address += (Elf64_Addr)((255 - unit.opcodeBase) / unit.lineRange) * unit.minInstLength;
+                break;
+            case DW_LNS_fixed_advance_pc:
+                address += reader.u(2);
+                break;
+            default:
+                // Other standard opcodes only have operands to skip
+                for(uint8_t idx = 0; idx < unit.opcodeLengths[opcode - 1]; idx++)
+                    reader.uleb();
+                break;
+        }
+    }
+
+    if(!reader.isValid())
+        info_log("Truncated line program at offset " << unit.offset << " of .debug_line");
+
+    std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b){
+        return a.file != b.file ? a.file < b.file : a.line != b.line ? a.line < b.line : a.address < b.address;
+    });
+
+    unit.rows = std::move(rows);
+    unit.isDecoded.store(true, std::memory_order_release);
+}
+
+bool LineTable::find(std::string_view fileName, uint32_t line, Elf64_Addr &address) {
+    auto files = _filesByName.find(fileName.substr(fileName.find_last_of('/') + 1));
+    if(files == _filesByName.end())
+        return false;
+
+    bool isFound = false;
+    uint32_t foundLine = UINT32_MAX;
+
+    for(uint32_t fileId : files->second) {
+        // The whole path or its end after a '/'
+        std::string_view path = _files[fileId];
+        if(path != fileName && (path.size() <= fileName.size() || path[path.size() - fileName.size() - 1] != '/' ||
+                                path.substr(path.size() - fileName.size()) != fileName))
+            continue;
+
+        for(uint32_t unitIdx : _unitsOfFile[fileId]) {
+            Unit& unit = _units[unitIdx];
+
+            if(!unit.isDecoded.load(std::memory_order_acquire)) {
+                std::lock_guard lk(_mutex);
+                if(!unit.isDecoded.load(std::memory_order_relaxed))
+                    decode(unit);
+            }
+
+            auto row = std::lower_bound(unit.rows.begin(), unit.rows.end(), std::make_pair(fileId, line),
+                                        [](const Row& row, const std::pair<uint32_t, uint32_t>& key){
+                                            return row.file != key.first ? row.file < key.first : row.line < key.second;
+                                        });
+
+            if(row != unit.rows.end() && row->file == fileId &&
+               (row->line < foundLine || (row->line == foundLine && row->address < address))) {
+                foundLine = row->line;
+                address = row->address;
+                isFound = true;
+            }
+        }
+    }
+
+    return isFound;
+}
+
+size_t LineTable::getMemoryUsage() const {
+    std::lock_guard lk(_mutex);
+
+    size_t usage = _units.size() * sizeof(Unit) + _files.size() * (sizeof(std::string) + 3 * sizeof(uint32_t));
+    for(auto& file : _files)
+        usage += file.capacity();
+    for(auto& unit : _units)
+        usage += unit.files.capacity() * sizeof(uint32_t) + unit.rows.capacity() * sizeof(Row);
+
+    return usage;
+}
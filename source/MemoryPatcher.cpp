@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "MemoryPatcher.h"
+#include "Logger.h"
+
+std::mutex MemoryPatcher::patchMutex;
+
+MemoryPatcher::Batch &MemoryPatcher::Batch::write(void *addr, const void *data, size_t len) {
+    _patches.push_back({(uint8_t*)addr, _data.size(), len});
+    _data.insert(_data.end(), (const uint8_t*)data, (const uint8_t*)data + len);
+
+    return *this;
+}
+
+MemoryPatcher::Batch &MemoryPatcher::Batch::writeByte(void *addr, uint8_t val) {
+    return write(addr, &val, sizeof(val));
+}
+
+MemoryPatcher::Batch &MemoryPatcher::Batch::writeWord(void *addr, uint64_t val) {
+    return write(addr, &val, sizeof(val));
+}
+
+bool MemoryPatcher::Batch::empty() const {
+    return _patches.empty();
+}
+
+void MemoryPatcher::Batch::clear() {
+    _patches.clear();
+    _data.clear();
+}
+
+bool MemoryPatcher::Batch::commit() {
+    if(_patches.empty())
+        return true;
+
+    const auto pageSize = (uint64_t)sysconf(_SC_PAGE_SIZE);
+
+    std::vector<uint64_t> pages;
+    for(auto& patch : _patches) {
+        auto first = (uint64_t)patch.addr & ~(pageSize - 1);
+        auto last = ((uint64_t)patch.addr + patch.len - 1) & ~(pageSize - 1);
+
+        for(auto page = first; page <= last; page += pageSize)
+            pages.push_back(page);
+    }
+
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+    std::lock_guard lk(patchMutex);
+
+    auto ranges = getPageRanges(pages);
+    if(ranges.empty())
+        return false;
+
+    bool success = true;
+    size_t writable = 0;
+
+    // Keep execution permission, the spied threads may be running code in these pages
+    for(; writable < ranges.size(); writable++) {
+        auto& range = ranges[writable];
+        if(mprotect((void*)range.begin, range.end - range.begin, range.prot | PROT_READ | PROT_WRITE) == -1) {
+            error_log("Failed to change memory protection RW : " << (void*)range.begin << " - " << (void*)range.end << ": " << strerror(errno));
+            success = false;
+            break;
+        }
+    }
+
+    if(success) {
+        for(auto& patch : _patches) {
+            auto word = (uint64_t*)((uint64_t)patch.addr & ~(uint64_t)(sizeof(uint64_t) - 1));
+            auto offset = (uint64_t)patch.addr - (uint64_t)word;
+
+            if(offset + patch.len > sizeof(uint64_t)) {
+                memcpy(patch.addr, &_data[patch.offset], patch.len);
+                continue;
+            }
+
+            // Patches within an aligned word are stored at once so that a concurrent reader never sees half of a
+            // GOT entry or of a jump, merged with the current neighbour bytes
+            uint64_t expected = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+            uint64_t desired;
+            do {
+                desired = expected;
+                memcpy((uint8_t*)&desired + offset, &_data[patch.offset], patch.len);
+            } while(!__atomic_compare_exchange_n(word, &expected, desired, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+        }
+    }
+
+    // Restore memory protection
+    for(size_t idx = 0; idx < writable; idx++) {
+        auto& range = ranges[idx];
+        if(mprotect((void*)range.begin, range.end - range.begin, range.prot) == -1) {
+            error_log("Failed to restore memory protection : " << (void*)range.begin << " - " << (void*)range.end << ": " << strerror(errno));
+            success = false;
+        }
+    }
+
+    return success;
+}
+
+bool MemoryPatcher::write(void *addr, const void *data, size_t len) {
+    return Batch().write(addr, data, len).commit();
+}
+
+std::vector<MemoryPatcher::PageRange> MemoryPatcher::getPageRanges(const std::vector<uint64_t> &pages) {
+    std::vector<PageRange> ranges;
+    const auto pageSize = (uint64_t)sysconf(_SC_PAGE_SIZE);
+
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if(maps == nullptr) {
+        error_log("Failed to open /proc/self/maps : " << strerror(errno));
+        return ranges;
+    }
+
+    // Mappings are sorted by address, stop reading once the last page is found
+    size_t pageIdx = 0;
+    char line[PATH_MAX + 128];
+    while(pageIdx < pages.size() && fgets(line, sizeof(line), maps) != nullptr) {
+        uint64_t begin, end;
+        char perms[5];
+
+        // Lines longer than the buffer are read in several parts, only their first one has the range
+        if(strchr(line, '\n') == nullptr) {
+            int c;
+            while((c = fgetc(maps)) != EOF && c != '\n');
+        }
+
+        if(sscanf(line, "%lx-%lx %4s", &begin, &end, perms) != 3)
+            continue;
+
+        int prot = PROT_NONE;
+        if(perms[0] == 'r') prot |= PROT_READ;
+        if(perms[1] == 'w') prot |= PROT_WRITE;
+        if(perms[2] == 'x') prot |= PROT_EXEC;
+
+        for(; pageIdx < pages.size() && pages[pageIdx] < end; pageIdx++) {
+            auto page = pages[pageIdx];
+            if(page < begin)
+                break;
+
+            if(!ranges.empty() && ranges.back().end == page && ranges.back().prot == prot) {
+                ranges.back().end += pageSize;
+            } else {
+                ranges.push_back({page, page + pageSize, prot});
+            }
+        }
+
+        if(pageIdx < pages.size() && pages[pageIdx] < begin)
+            break;
+    }
+
+    fclose(maps);
+
+    if(pageIdx < pages.size()) {
+        error_log("Page " << (void*)pages[pageIdx] << " is not mapped");
+        return {};
+    }
+
+    return ranges;
+}
@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "ModuleIndex.h"
+#include "Logger.h"
+
+ModuleIndex &ModuleIndex::getModuleIndex() {
+    // Never destroyed, modules may be unloaded during the static destruction
+    static auto moduleIndex = new ModuleIndex();
+    return *moduleIndex;
+}
+
+ModuleIndex::ModuleIndex() : _snapshot(new Snapshot()), _loadNb(0), _unloadNb(0) {}
+
+ModuleIndex::~ModuleIndex() {
+    delete _snapshot.load(std::memory_order_relaxed);
+}
+
+void ModuleIndex::addNamespace(struct link_map *head) {
+    {
+        std::lock_guard lk(_mutex);
+        _namespaces.push_back(head);
+    }
+
+    update();
+}
+
+void ModuleIndex::removeNamespace(struct link_map *head) {
+    {
+        std::lock_guard lk(_mutex);
+        _namespaces.erase(std::remove(_namespaces.begin(), _namespaces.end(), head), _namespaces.end());
+    }
+
+    update();
+}
+
+void ModuleIndex::update(const struct link_map* unloading) {
+    std::lock_guard lk(_mutex);
+
+    // Read first, a module loaded while walking the link maps makes the next miss update again
+    auto counters = getLoadCounters();
+    _loadNb.store(counters.first, std::memory_order_relaxed);
+    _unloadNb.store(counters.second, std::memory_order_relaxed);
+
+    Snapshot* current = _snapshot.load(std::memory_order_relaxed);
+    auto snapshot = new Snapshot();
+
+    std::unordered_map<const struct link_map*, const Module*> known;
+    known.reserve(current->size());
+    for(auto& module : *current)
+        known.emplace(module.lm, &module);
+
+    for(auto head : _namespaces) {
+        for(auto lm = head; lm != nullptr; lm = lm->l_next) {
+            // The executable has an empty name, the vdso has no file
+            if((lm->l_name[0] != '\0' && strchr(lm->l_name, '/') == nullptr) || lm == unloading)
+                continue;
+
+            // Modules already indexed are kept, matched as the images of the ElfFile registry
+            auto it = known.find(lm);
+            if(it != known.end() && it->second->base == lm->l_addr && it->second->dynamic == lm->l_ld) {
+                snapshot->push_back(*it->second);
+                continue;
+            }
+
+            try {
+                ElfFile::Handle elf = ElfFile::getElfImage(lm);
+                auto range = elf->getLoadedRange();
+                if(range.first != range.second)
+                    snapshot->push_back({lm->l_addr + range.first, lm->l_addr + range.second, lm, lm->l_addr,
+                                         lm->l_ld, elf});
+            } catch(const std::invalid_argument& e) {
+                error_log("Cannot index " << lm->l_name << " : " << e.what());
+            }
+        }
+    }
+
+    std::sort(snapshot->begin(), snapshot->end(), [](const Module& a, const Module& b){
+        return a.start < b.start;
+    });
+
+    // Nothing was loaded or unloaded, the readers keep the current snapshot
+    if(snapshot->size() == current->size() &&
+       std::equal(snapshot->begin(), snapshot->end(), current->begin(), [](const Module& a, const Module& b){
+           return a.lm == b.lm && a.start == b.start && a.dynamic == b.dynamic;
+       })) {
+        delete snapshot;
+        return;
+    }
+
+    _snapshot.store(snapshot, std::memory_order_seq_cst);
+    _rcu.synchronize();
+    delete current;
+}
+
+bool ModuleIndex::find(const void *addr, Location &location) {
+    if(findInSnapshot((uint64_t)addr, location))
+        return true;
+
+    // The module may have been loaded by the spied program since the last update
+    auto counters = getLoadCounters();
+    if(counters.first == _loadNb.load(std::memory_order_relaxed)
+       && counters.second == _unloadNb.load(std::memory_order_relaxed))
+        return false;
+
+    update();
+    return findInSnapshot((uint64_t)addr, location);
+}
+
+std::pair<uint64_t, uint64_t> ModuleIndex::getLoadCounters() {
+    std::pair<uint64_t, uint64_t> counters(0, 0);
+
+    // The counters are the same for every object, stop at the first one
+    dl_iterate_phdr([](struct dl_phdr_info* info, size_t size, void* data){
+        if(size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+            auto counters = static_cast<std::pair<uint64_t, uint64_t>*>(data);
+            counters->first = info->dlpi_adds;
+            counters->second = info->dlpi_subs;
+        }
+        return 1;
+    }, &counters);
+
+    return counters;
+}
+
+bool ModuleIndex::findInSnapshot(uint64_t addr, Location &location) {
+    Rcu::ReadGuard guard(_rcu);
+    Snapshot* snapshot = _snapshot.load(std::memory_order_seq_cst);
+
+    auto it = std::upper_bound(snapshot->begin(), snapshot->end(), addr, [](uint64_t addr, const Module& module){
+        return addr < module.start;
+    });
+    if(it == snapshot->begin() || addr >= (--it)->end)
+        return false;
+
+    location.module = it->lm;
+    location.fileName = it->lm->l_name;
+
+    const ElfFile::SymbolRange* symbol = it->elf->findSymbolRange(addr - it->lm->l_addr);
+    if(symbol != nullptr) {
+        location.symbolName = it->elf->getName(*symbol);
+        location.symbolAddr = (void*)(it->lm->l_addr + symbol->start);
+        location.offset = addr - (uint64_t)location.symbolAddr;
+    } else {
+        location.symbolName = nullptr;
+        location.symbolAddr = nullptr;
+        location.offset = addr - it->lm->l_addr;
+    }
+
+    return true;
+}
@@ -0,0 +1,49 @@
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "ModulePrewarmer.h"
+#include "Logger.h"
+
+ModulePrewarmer::ModulePrewarmer(struct link_map *head) : _next(0) {
+    // Same modules as DynamicNamespace::syncModules, an empty name is the executable
+    for(auto lm = head; lm != nullptr; lm = lm->l_next) {
+        if(lm->l_name[0] == '/' || (lm->l_name[0] == '\0' && lm == head))
+            _modules.push_back(lm);
+    }
+
+    _images.resize(_modules.size());
+
+    auto threadNb = (uint32_t)std::min<size_t>(getThreadNb(), _modules.size());
+    for(uint32_t idx = 0; idx < threadNb; idx++)
+        _threads.emplace_back(&ModulePrewarmer::run, this);
+}
+
+ModulePrewarmer::~ModulePrewarmer() {
+    for(auto& thread : _threads)
+        thread.join();
+}
+
+uint32_t ModulePrewarmer::getThreadNb() {
+    uint32_t threadNb = std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+    const char* env = getenv("SPYTESTER_PREWARM_THREADS");
+
+    if(env != nullptr){
+        int n = atoi(env);
+        if(n >= 0 && n < 65) threadNb = (uint32_t)n;
+    }
+
+    return threadNb;
+}
+
+void ModulePrewarmer::run() {
+    for(size_t idx = _next++; idx < _modules.size(); idx = _next++) {
+        try {
+            _images[idx] = ElfFile::getElfImage(_modules[idx]);
+            _images[idx]->buildIndexes();
+        } catch(std::invalid_argument& e) {
+            // The module constructor reports it if it is used
+            info_log("Failed to prewarm " << _modules[idx]->l_name << " (" << e.what() << ")");
+        }
+    }
+}
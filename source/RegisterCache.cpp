@@ -0,0 +1,271 @@
+#include <cpuid.h>
+#include <cstddef>
+#include <cstring>
+#include <elf.h>
+
+#include "RegisterCache.h"
+#include "Logger.h"
+
+RegisterCache::RegisterCache(Tracer &tracer, pid_t tid) :
+_tracer(tracer), _tid(tid), _isValid{}, _isDirty{}, _gprs{}, _debugRegs{},
+_validDebugRegs(0), _dirtyDebugRegs(0), _xstateIov{nullptr, 0}
+{}
+
+void RegisterCache::invalidate() {
+    std::lock_guard lk(_mutex);
+
+    for(uint32_t idx = 0; idx < REGSET_NB; idx++) {
+        if(_isDirty[idx])
+            error_log("Thread (" << _tid << ") registers modified but not written back");
+
+        _isValid[idx] = false;
+        _isDirty[idx] = false;
+    }
+
+    _validDebugRegs = 0;
+    _dirtyDebugRegs = 0;
+}
+
+bool RegisterCache::getGpr(Gpr reg, uint64_t& val) {
+    std::lock_guard lk(_mutex);
+    if(!fetch(GPR))
+        return false;
+
+    val = _gprs.*reg;
+    return true;
+}
+
+bool RegisterCache::setGpr(Gpr reg, uint64_t val) {
+    std::lock_guard lk(_mutex);
+
+    // The other registers would be written back with whatever the cache holds
+    if(!fetch(GPR))
+        return false;
+
+    _gprs.*reg = val;
+    _isDirty[GPR] = true;
+    return true;
+}
+
+bool RegisterCache::getGprs(user_regs_struct& regs) {
+    std::lock_guard lk(_mutex);
+    if(!fetch(GPR))
+        return false;
+
+    regs = _gprs;
+    return true;
+}
+
+void RegisterCache::setGprs(const user_regs_struct &regs) {
+    std::lock_guard lk(_mutex);
+
+    _gprs = regs;
+    _isValid[GPR] = true;
+    _isDirty[GPR] = true;
+}
+
+bool RegisterCache::getDebugReg(uint32_t idx, uint64_t& val) {
+    std::lock_guard lk(_mutex);
+    if(idx >= debugRegNb)
+        throw std::invalid_argument("invalid debug register");
+
+    if(!fetchDebugReg(idx))
+        return false;
+
+    val = _debugRegs[idx];
+    return true;
+}
+
+void RegisterCache::setDebugReg(uint32_t idx, uint64_t val) {
+    std::lock_guard lk(_mutex);
+    if(idx >= debugRegNb)
+        throw std::invalid_argument("invalid debug register");
+
+    _debugRegs[idx] = val;
+    _validDebugRegs |= 1U << idx;
+    _dirtyDebugRegs |= 1U << idx;
+    _isDirty[DEBUG] = true;
+}
+
+bool RegisterCache::getMxcsr(uint32_t& mxcsr) {
+    std::lock_guard lk(_mutex);
+    if(!fetch(XSTATE))
+        return false;
+
+    memcpy(&mxcsr, &_xstate[mxcsrOffset], sizeof(mxcsr));
+    return true;
+}
+
+bool RegisterCache::getXmm(uint32_t idx, RegisterCache::Vec128& val) {
+    std::lock_guard lk(_mutex);
+    if(idx >= vecRegNb)
+        throw std::invalid_argument("invalid vector register");
+
+    if(!fetch(XSTATE))
+        return false;
+
+    memcpy(&val, &_xstate[xmmOffset + idx * sizeof(Vec128)], sizeof(val));
+    return true;
+}
+
+bool RegisterCache::setXmm(uint32_t idx, const RegisterCache::Vec128 &val) {
+    std::lock_guard lk(_mutex);
+    if(idx >= vecRegNb)
+        throw std::invalid_argument("invalid vector register");
+
+    if(!fetch(XSTATE))
+        return false;
+
+    memcpy(&_xstate[xmmOffset + idx * sizeof(Vec128)], &val, sizeof(val));
+    _isDirty[XSTATE] = true;
+    return true;
+}
+
+bool RegisterCache::getYmm(uint32_t idx, RegisterCache::Vec256 &val) {
+    std::lock_guard lk(_mutex);
+    if(idx >= vecRegNb)
+        throw std::invalid_argument("invalid vector register");
+
+    if(!fetch(XSTATE) || _xstate.size() < ymmHighOffset + vecRegNb * sizeof(Vec128))
+        return false;
+
+    memcpy(&val.low, &_xstate[xmmOffset + idx * sizeof(Vec128)], sizeof(Vec128));
+
+    // Upper halves are not saved while in their initial (zeroed) state
+    uint64_t xstateBv;
+    memcpy(&xstateBv, &_xstate[xstateHeaderOffset], sizeof(xstateBv));
+    if(xstateBv & avxFeature)
+        memcpy(&val.high, &_xstate[ymmHighOffset + idx * sizeof(Vec128)], sizeof(Vec128));
+    else
+        val.high = {};
+
+    return true;
+}
+
+bool RegisterCache::setYmm(uint32_t idx, const RegisterCache::Vec256 &val) {
+    std::lock_guard lk(_mutex);
+    if(idx >= vecRegNb)
+        throw std::invalid_argument("invalid vector register");
+
+    if(!fetch(XSTATE) || _xstate.size() < ymmHighOffset + vecRegNb * sizeof(Vec128))
+        return false;
+
+    uint64_t xstateBv;
+    memcpy(&xstateBv, &_xstate[xstateHeaderOffset], sizeof(xstateBv));
+
+    // Other upper halves were in their initial state, they have to be zeroed explicitly
+    if(!(xstateBv & avxFeature)) {
+        memset(&_xstate[ymmHighOffset], 0, vecRegNb * sizeof(Vec128));
+        xstateBv |= avxFeature;
+        memcpy(&_xstate[xstateHeaderOffset], &xstateBv, sizeof(xstateBv));
+    }
+
+    memcpy(&_xstate[xmmOffset + idx * sizeof(Vec128)], &val.low, sizeof(Vec128));
+    memcpy(&_xstate[ymmHighOffset + idx * sizeof(Vec128)], &val.high, sizeof(Vec128));
+    _isDirty[XSTATE] = true;
+
+    return true;
+}
+
+bool RegisterCache::isDirty() const {
+    return _isDirty[GPR] || _isDirty[DEBUG] || _isDirty[XSTATE];
+}
+
+void RegisterCache::prepareFlush(Tracer::Transaction &transaction) {
+    std::lock_guard lk(_mutex);
+
+    if(_isDirty[GPR] && _isValid[GPR])
+        transaction.setRegs(_tid, &_gprs);
+
+    if(_isDirty[DEBUG]) {
+        for(uint32_t idx = 0; idx < debugRegNb; idx++) {
+            if(_dirtyDebugRegs & (1U << idx))
+                transaction.pokeUser(_tid, debugRegOffset(idx), _debugRegs[idx]);
+        }
+        _dirtyDebugRegs = 0;
+    }
+
+    if(_isDirty[XSTATE] && _isValid[XSTATE]) {
+        _xstateIov = {_xstate.data(), _xstate.size()};
+        transaction.setRegSet(_tid, NT_X86_XSTATE, &_xstateIov);
+    }
+
+    for(auto& isDirty : _isDirty)
+        isDirty = false;
+}
+
+uint64_t RegisterCache::debugRegOffset(uint32_t idx) {
+    return offsetof(struct user, u_debugreg) + idx * sizeof(user::u_debugreg[0]);
+}
+
+size_t RegisterCache::xstateSize() {
+    static const size_t size = []{
+        uint32_t eax, ebx, ecx, edx;
+
+        // Size required by the features currently enabled in XCR0
+        if(__get_cpuid_count(0xD, 0, &eax, &ebx, &ecx, &edx) && ebx != 0)
+            return (size_t)ebx;
+
+        return sizeof(user_fpregs_struct);
+    }();
+
+    return size;
+}
+
+bool RegisterCache::fetch(E_RegSet regSet) {
+    if(_isValid[regSet])
+        return true;
+
+    Tracer::Result res;
+
+    switch(regSet) {
+        case GPR: {
+            auto completion = _tracer.submitPTrace(PTRACE_GETREGS, _tid, nullptr, &_gprs);
+            res = _tracer.wait(completion);
+            break;
+        }
+
+        case XSTATE: {
+            _xstate.resize(xstateSize());
+            _xstateIov = {_xstate.data(), _xstate.size()};
+
+            auto completion = _tracer.submitPTrace(PTRACE_GETREGSET, _tid, NT_X86_XSTATE, &_xstateIov);
+            res = _tracer.wait(completion);
+
+            // Without XSAVE support, only the legacy FXSAVE area is available
+            if(res.second == 0)
+                _xstate.resize(_xstateIov.iov_len);
+            break;
+        }
+
+        default:
+            return false;
+    }
+
+    if(res.second != 0) {
+        error_log("Failed to read registers of thread " << _tid << " : " << strerror(res.second));
+        return false;
+    }
+
+    _isValid[regSet] = true;
+    return true;
+}
+
+bool RegisterCache::fetchDebugReg(uint32_t idx) {
+    if(_validDebugRegs & (1U << idx))
+        return true;
+
+    auto completion = _tracer.submitPTrace(PTRACE_PEEKUSER, _tid, debugRegOffset(idx), nullptr);
+    auto res = _tracer.wait(completion);
+
+    if(res.second != 0) {
+        error_log("Failed to read debug register " << idx << " of thread " << _tid << " : " << strerror(res.second));
+        return false;
+    }
+
+    _debugRegs[idx] = (uint64_t)res.first;
+    _validDebugRegs |= 1U << idx;
+    _isValid[DEBUG] = true;
+
+    return true;
+}
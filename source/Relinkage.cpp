@@ -1,10 +1,8 @@
 #include <cstring>
 #include <iostream>
-#include <sys/mman.h>
-#include <sys/uio.h>
-#include <unistd.h>
 
 #include "DynamicModule.h"
+#include "MemoryPatcher.h"
 #include "Relinkage.h"
 #include "Logger.h"
 
@@ -15,17 +13,23 @@ Relinkage::Relinkage(DynamicModule &source, DynamicModule &destination):
 
     info_log(source.getName() << " -> " << destination.getName());
 
-    auto findRela = [this](uint32_t type, const std::string& name, uint64_t* relaAddr){
-        if(type == R_X86_64_GLOB_DAT || type == R_X86_64_JUMP_SLOT){
+    // Relocations are grouped by symbol, the destination symbol is looked up once per symbol
+    uint32_t symbol = UINT32_MAX;
+    void* symbAddr = nullptr;
 
-            void* symbAddr = _destination.getDynamicSymbol(name);
-            if(symbAddr)
-                _relocations.emplace_back(relaAddr, (uint64_t)symbAddr);
+    for(auto& rela : _source.getRelocations()) {
+        if(rela.type != R_X86_64_GLOB_DAT && rela.type != R_X86_64_JUMP_SLOT)
+            continue;
+
+        if(rela.symbol != symbol) {
+            symbol = rela.symbol;
+            symbAddr = _destination.getDynamicSymbol(_source.getSymbolId(rela));
         }
-        return true;
-    };
 
-    _source.iterateOverRelocations(findRela);
+        if(symbAddr)
+            _relocations.emplace_back(_source.getRelocationAddress(rela), (uint64_t)symbAddr);
+    }
+
     writeRelocations();
     _destination.addInRelinkage(*this);
 }
@@ -46,39 +50,20 @@ void Relinkage::invalidate() {
 }
 
 void Relinkage::writeRelocations() {
-    uint64_t lowestRelaAddr = -1;
-    uint64_t highestRelaAddr = 0;
+    MemoryPatcher::Batch batch;
 
     for(auto& rela : _relocations){
-        if((uint64_t) rela.first < lowestRelaAddr)
-            lowestRelaAddr = (uint64_t) rela.first;
+        uint64_t newAddr = rela.second;
 
-        if((uint64_t) rela.first > lowestRelaAddr)
-            highestRelaAddr = (uint64_t) rela.first;
-    }
-
-    if(lowestRelaAddr < highestRelaAddr) {
-        lowestRelaAddr -= lowestRelaAddr % sysconf(_SC_PAGE_SIZE); // align lowestRelaAddr to page size
-
-        // Change memory protection to write relocation in .got.plt and .got
-        if(-1 == mprotect((void*)lowestRelaAddr, highestRelaAddr - lowestRelaAddr, PROT_WRITE | PROT_READ)) {
-            error_log("Failed to change memory protection RW : " << lowestRelaAddr << " - " << highestRelaAddr << ": " << strerror(errno));
-            return;
-        }
+        //save old addr
+        rela.second = *rela.first;
 
-        for(auto& rela : _relocations){
-            uint64_t newAddr = rela.second;
-
-            //save old addr
-            rela.second = *rela.first;
-
-            // write new addr
-            *rela.first = newAddr;
-        }
+        // write new addr
+        batch.writeWord(rela.first, newAddr);
+    }
 
-        // Restore memory protection
-        if(-1 == mprotect((void*)lowestRelaAddr, highestRelaAddr - lowestRelaAddr, PROT_READ)){
-            error_log("Failed to change memory protection RO : " << lowestRelaAddr << " - " << highestRelaAddr << ": " << strerror(errno));
-        }
+    // Pages of .got.plt and .got are made writable only for the time of the batch
+    if(!batch.commit()) {
+        error_log("Failed to write relocations of " << _source.getName());
     }
-}
\ No newline at end of file
+}
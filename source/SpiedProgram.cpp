@@ -1,44 +1,250 @@
+#include <csignal>
 #include <iostream>
 #include <sys/wait.h>
 
 #include "SpiedProgram.h"
 
 SpiedProgram::~SpiedProgram(){
-    _breakPoints.clear();
-    _spiedThreads.clear();
+    {
+        std::lock_guard lk(_fastTracePointsMutex);
+        _fastTracePoints.clear();
+    }
+    {
+        std::unique_lock lk(_breakPointsMutex);
+        _breakPoints.clear();
+    }
+    {
+        std::unique_lock lk(_spiedThreadsMutex);
+        _spiedThreads.clear();
+        _mainThread = nullptr;
+    }
 
-   _eventListener.join();
+    if(_eventListener.joinable())
+        _eventListener.join();
 }
 
-void SpiedProgram::start() {
-    _eventListener = std::thread(&SpiedProgram::listenEvent, this);
+void SpiedProgram::start(E_EventEngine engine) {
+    if(engine == THREADED) {
+        // waitpid does not need SIGCHLD, give the creating thread its mask back
+        if(!sigismember(&_initialSigMask, SIGCHLD)) {
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigaddset(&mask, SIGCHLD);
+            pthread_sigmask(SIG_UNBLOCK, &mask, nullptr);
+        }
+
+        _eventListener = std::thread(&SpiedProgram::listenEvent, this);
+        return;
+    }
+
+    // Everything (events, breakpoint and thread creation callbacks) is then handled by the tracer thread
+    _callbackHandler.setInline(true);
+    _tracer.startEventLoop([this](pid_t tid, int wstatus){ dispatchEvent(tid, wstatus); });
 }
 
-void SpiedProgram::resume() {
-    for(auto & spiedThread : _spiedThreads)
+sigset_t SpiedProgram::blockChildSignal() {
+    sigset_t mask, oldMask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+
+    if(pthread_sigmask(SIG_BLOCK, &mask, &oldMask) != 0) {
+        error_log("Failed to block SIGCHLD");
+        sigemptyset(&oldMask);
+    }
+
+    return oldMask;
+}
+
+bool SpiedProgram::resume() {
+    Tracer::Transaction transaction;
+    transaction.independent();
+
     {
-        spiedThread->resume();
+        std::shared_lock lk(_spiedThreadsMutex);
+        _spiedThreads.forEach([&transaction](pid_t, auto& spiedThread){
+            if(spiedThread->getState() == SpiedThread::STOPPED)
+                spiedThread->prepareResume(transaction);
+        });
     }
+
+    if(transaction.empty())
+        return true;
+
+    // All the threads are resumed by the tracer thread in a row
+    auto completion = _tracer.commit(std::move(transaction));
+    return Tracer::succeeded(_tracer.wait(completion));
 }
 
-void SpiedProgram::stop(){
-    for(auto & spiedThread : _spiedThreads)
+bool SpiedProgram::stop(){
+    ThreadBarrier barrier;
+    Tracer::Transaction transaction;
+    transaction.independent();
+
+    // The event handler needs the lock to register new threads, do not hold it while waiting
     {
-        spiedThread->stop();
+        std::shared_lock lk(_spiedThreadsMutex);
+        _spiedThreads.forEach([&transaction, &barrier](pid_t, auto& spiedThread){
+            spiedThread->prepareStop(transaction, barrier);
+        });
+    }
+
+    // Threads already interrupted by another stop request only add themselves to the barrier
+    if(!transaction.empty())
+        _tracer.commit(std::move(transaction));
+
+    if(!barrier.waitFor(stopTimeout)) {
+        error_log(barrier.remaining() << " threads did not stop in time");
+
+        std::shared_lock lk(_spiedThreadsMutex);
+        _spiedThreads.forEach([&barrier](pid_t, auto& spiedThread){ spiedThread->leaveBarrier(barrier); });
+        return false;
     }
+
+    return true;
 }
 
 void SpiedProgram::terminate() {
-    if(!_spiedThreads.empty()){
-        _spiedThreads.front()->terminate();
+    SpiedThread* mainThread;
+    {
+        std::shared_lock lk(_spiedThreadsMutex);
+        mainThread = _mainThread;
+    }
+
+    if(mainThread != nullptr){
+        mainThread->terminate();
     }
 }
 
 
 // Exec Breakpoint Management
 BreakPoint *SpiedProgram::createBreakPoint(void *addr, std::string &&name) {
-    _breakPoints.emplace_back(std::make_unique<BreakPoint>(_tracer, _callbackHandler, std::move(name), addr));
-    return _breakPoints.back().get();
+    std::unique_lock lk(_breakPointsMutex);
+
+    auto breakPoint = _breakPoints.find(addr);
+    if(breakPoint != nullptr) {
+        info_log("A breakpoint already exists at " << addr);
+        return breakPoint->get();
+    }
+
+    // Built before being inserted, the table never holds an empty breakpoint if the construction throws
+    auto newBreakPoint = std::make_shared<BreakPoint>(_tracer, _callbackHandler, std::move(name), addr);
+    return _breakPoints.emplace(addr, std::move(newBreakPoint)).first->get();
+}
+
+BreakPoint *SpiedProgram::createBreakPoint(const std::string &fileName, uint32_t line) {
+    void* addr = nullptr;
+
+    _spiedNamespace.iterateOverModule([&addr, &fileName, line](DynamicModule& module){
+        addr = module.getLineAddress(fileName, line);
+        return addr == nullptr;
+    });
+
+    if(addr == nullptr) {
+        error_log("Cannot find the line " << line << " of " << fileName << " in the spied namespace");
+        return nullptr;
+    }
+
+    return createBreakPoint(addr, fileName + ":" + std::to_string(line));
+}
+
+bool SpiedProgram::deleteBreakPoint(BreakPoint *breakPoint) {
+    std::shared_ptr<BreakPoint> deleted;
+    auto addr = breakPoint->getAddr();
+
+    {
+        std::unique_lock lk(_breakPointsMutex);
+
+        auto bp = _breakPoints.find(addr);
+        if(bp == nullptr || bp->get() != breakPoint) {
+            error_log("Unknown breakpoint at " << addr);
+            return false;
+        }
+
+        deleted = std::move(*bp);
+        _breakPoints.erase(addr);
+    }
+
+    if(!deleted->unset())
+        error_log("Failed to unset breakpoint at " << addr);
+
+    // Destroyed once the hits being handled are done, out of the lock as it waits for the steps they committed
+    return true;
+}
+
+
+// Fast Tracepoint Management
+FastTracePoint *SpiedProgram::createFastTracePoint(void *addr, std::string &&name, FastTracePoint::Callback callback,
+                                                   void *data) {
+    std::lock_guard lk(_fastTracePointsMutex);
+
+    auto res = _fastTracePoints.emplace(addr, std::unique_ptr<FastTracePoint>());
+    if(!res.second) {
+        info_log("A fast tracepoint already exists at " << addr);
+        return res.first->get();
+    }
+
+    try {
+        *res.first = std::make_unique<FastTracePoint>(_tracer.getCodeArena(), std::move(name), addr, callback, data);
+    } catch(std::invalid_argument&) {
+        _fastTracePoints.erase(addr);
+        return nullptr;
+    }
+
+    return res.first->get();
+}
+
+bool SpiedProgram::deleteFastTracePoint(FastTracePoint *tracePoint) {
+    std::lock_guard lk(_fastTracePointsMutex);
+
+    auto addr = tracePoint->getAddr();
+    auto tp = _fastTracePoints.find(addr);
+    if(tp == nullptr || tp->get() != tracePoint) {
+        error_log("Unknown fast tracepoint at " << addr);
+        return false;
+    }
+
+    return _fastTracePoints.erase(addr);
+}
+
+
+// Wrapping by symbol name
+SymbolWrapper *SpiedProgram::wrapFunction(const std::string &binName, const std::string &symbolName,
+                                          SymbolWrapper::Handler &&handler) {
+    auto key = std::make_pair(binName, symbolName);
+    auto it = _symbolWrappers.find(key);
+
+    if(it == _symbolWrappers.end()) {
+        try {
+            auto symbolWrapper = std::make_unique<SymbolWrapper>(_tracer, _spiedNamespace, binName, symbolName);
+            it = _symbolWrappers.emplace(std::move(key), std::move(symbolWrapper)).first;
+        } catch(std::invalid_argument& e) {
+            error_log("Cannot wrap " << symbolName << " in " << binName << " (" << e.what() << ")");
+            return nullptr;
+        }
+    }
+
+    it->second->setHandler(std::move(handler));
+    return it->second.get();
+}
+
+void SpiedProgram::unwrapFunction(const std::string &binName, const std::string &symbolName) {
+    _symbolWrappers.erase(std::make_pair(binName, symbolName));
+}
+
+std::vector<CallProfiler::Report> SpiedProgram::getProfile() const {
+    std::vector<CallProfiler::Report> reports;
+
+    for(auto& wrappedFunction : _wrappedFunctions) {
+        auto& profiler = wrappedFunction.second->getProfiler();
+        if(profiler.isActive())
+            reports.push_back(profiler.getReport());
+    }
+
+    return reports;
+}
+
+Tracer &SpiedProgram::getTracer() {
+    return _tracer;
 }
 
 bool SpiedProgram::relink(const std::string &libName) {
@@ -80,66 +286,99 @@ void SpiedProgram::listenEvent() {
     pid_t tid;
 
     // Wait until all child threads exit
-    while((tid = waitpid(-1, &wstatus, WCONTINUED)) > 0) {
-        // Ignore starterThread
-        SpiedThread::E_State state = SpiedThread::UNDETERMINED;
-        int signal = 0;
-        int status = 0;
-        uint16_t ptraceEvent = 0;
-
-        if (tid == _pid) continue;
-
-        if (WIFSTOPPED(wstatus)) {
-            state = SpiedThread::STOPPED;
-            signal = WSTOPSIG(wstatus);
-
-            if(signal == SIGTRAP) {
-                ptraceEvent = (wstatus >> 16);
-                /*
-                if(_ptraceEvent != PTRACE_EVENT_STOP) {
-                    if(tracer.commandPTrace(true, PTRACE_GETEVENTMSG, _tid, nullptr, &_ptraceEventMsg) == -1) {
-                        error_log("PTRACE_GETEVENTMSG failed : " << strerror(errno));
-                    }
-                }*/
-            }
-        } else if (WIFCONTINUED(wstatus)) {
-            state = SpiedThread::CONTINUED;
-        } else if (WIFEXITED(wstatus)) {
-            state = SpiedThread::EXITED;
-            int status = WEXITSTATUS(wstatus);
-        } else if (WIFSIGNALED(wstatus)) {
-            state = SpiedThread::TERMINATED;
-            signal = WTERMSIG(wstatus);
-        } else {
-            error_log("Unknown wstatus " << std::hex << wstatus);
+    while((tid = waitpid(-1, &wstatus, WCONTINUED)) > 0)
+        dispatchEvent(tid, wstatus);
+}
+
+void SpiedProgram::dispatchEvent(pid_t tid, int wstatus) {
+    // Ignore starterThread
+    SpiedThread::E_State state = SpiedThread::UNDETERMINED;
+    int signal = 0;
+    int status = 0;
+    uint16_t ptraceEvent = 0;
+
+    if (tid == _pid) return;
+
+    if (WIFSTOPPED(wstatus)) {
+        state = SpiedThread::STOPPED;
+        signal = WSTOPSIG(wstatus);
+
+        // Seized threads report interrupts and group stops as PTRACE_EVENT_STOP, whatever the signal
+        ptraceEvent = (wstatus >> 16);
+
+        if(signal == SIGTRAP) {
+            /*
+            if(_ptraceEvent != PTRACE_EVENT_STOP) {
+                if(tracer.commandPTrace(true, PTRACE_GETEVENTMSG, _tid, nullptr, &_ptraceEventMsg) == -1) {
+                    error_log("PTRACE_GETEVENTMSG failed : " << strerror(errno));
+                }
+            }*/
         }
+    } else if (WIFCONTINUED(wstatus)) {
+        state = SpiedThread::CONTINUED;
+    } else if (WIFEXITED(wstatus)) {
+        state = SpiedThread::EXITED;
+        int status = WEXITSTATUS(wstatus);
+    } else if (WIFSIGNALED(wstatus)) {
+        state = SpiedThread::TERMINATED;
+        signal = WTERMSIG(wstatus);
+    } else {
+        error_log("Unknown wstatus " << std::hex << wstatus);
+    }
+
+    SpiedThread* thread = nullptr;
+    {
+        std::shared_lock lk(_spiedThreadsMutex);
+        auto threadPtr = _spiedThreads.find(tid);
+        if(threadPtr != nullptr)
+            thread = threadPtr->get();
+    }
 
-        auto threadIt = std::find_if(_spiedThreads.begin(), _spiedThreads.end(),
-                                   [tid](auto& st) { return *st == tid; });
-
-        if(threadIt == _spiedThreads.end()){
-            info_log("New thread (" << tid << ") detected");
-
-            auto& spiedThread = *_spiedThreads.emplace_back(
-                    std::make_unique<SpiedThread>(_tracer, _callbackHandler, tid));
-
-            if(_onThreadCreation){
-                _callbackHandler.executeCallback([&spiedThread, this]{
-                    _threadCreationMutex.lock();
-                    _onThreadCreation(spiedThread);
-                    _threadCreationMutex.unlock();
-                });
-            }
-        } else if(!(*threadIt)->handleEvent(state, signal, status, ptraceEvent)) {
-            uint64_t pc = (*threadIt)->getRip();
-            auto breakPointIt = std::find_if(_breakPoints.begin(), _breakPoints.end(),
-                                             [pc](auto& bp) { return *bp == (void*)(pc-1); });
-
-            if(breakPointIt != _breakPoints.end())
-                (*breakPointIt)->hit(**threadIt);
+    if(thread == nullptr){
+        info_log("New thread (" << tid << ") detected");
+
+        std::unique_lock lk(_spiedThreadsMutex);
+        auto& spiedThread = **_spiedThreads.emplace(
+                tid, std::make_unique<SpiedThread>(_tracer, _callbackHandler, tid)).first;
+        if(_mainThread == nullptr)
+            _mainThread = &spiedThread;
+        lk.unlock();
+
+        if(_onThreadCreation){
+            _callbackHandler.executeCallback([&spiedThread, this]{
+                _threadCreationMutex.lock();
+                _onThreadCreation(spiedThread);
+                _threadCreationMutex.unlock();
+            });
+        }
+    } else if(!thread->handleEvent(state, signal, status, ptraceEvent)) {
+        uint64_t pc = thread->getRip();
+        std::shared_ptr<BreakPoint> breakPoint;
+
+        // Not held during the hit, an inline callback may create or delete breakpoints
+        {
+            std::shared_lock lk(_breakPointsMutex);
+            auto breakPointPtr = _breakPoints.find((void*)(pc-1));
+            if(breakPointPtr != nullptr)
+                breakPoint = *breakPointPtr;
+        }
+
+        if(breakPoint != nullptr) {
+            breakPoint->hit(*thread);
+        } else if(signal == SIGTRAP && pc != 0 && *(volatile uint8_t*)(pc-1) != 0xCC && isInt3Trap(tid)) {
+            // Hit a breakpoint deleted before the stop was reported, the instruction it replaced is executed
+            if(thread->jump((void*)(pc-1)))
+                thread->resume();
         }
     }
+}
+
+bool SpiedProgram::isInt3Trap(pid_t tid) {
+    siginfo_t info;
+    auto res = _tracer.commandPTrace(PTRACE_GETSIGINFO, tid, nullptr, &info);
 
+    // Raised by the kernel, unlike traps sent by a process or reported after a single step
+    return Tracer::succeeded(res) && info.si_code == SI_KERNEL;
 }
 
 void SpiedProgram::setThreadCreationCallback(const std::function<void(SpiedThread&)>& callback) {
@@ -1,9 +1,10 @@
+#include <algorithm>
 #include <chrono>
-#include <dlfcn.h>
 #include <iostream>
 #include <sys/ptrace.h>
 #include <sys/user.h>
 
+#include "ModuleIndex.h"
 #include "SpiedThread.h"
 #include "Tracer.h"
 #include "Logger.h"
@@ -11,8 +12,8 @@
 #define STATE_TIMEOUT std::chrono::seconds(5)
 
 SpiedThread::SpiedThread(Tracer &tracer, CallbackHandler &callbackHandler, pid_t tid) :
-_tracer(tracer), _callbackHandler(callbackHandler), _tid(tid), _state(STOPPED),
-_isSigTrapExpected(false), _regs{}, _regSync(OLD), _dr6{}
+_tid(tid), _registers(tracer, tid), _displacedStep{}, _state(STOPPED),
+_isSigTrapExpected(false), _isInterruptPending(false), _tracer(tracer), _callbackHandler(callbackHandler)
 {
     for(uint32_t idx = 0; idx<WatchPoint::maxNb; idx++) {
         _watchPoints.emplace_back(std::make_unique<WatchPoint>(_tracer, _callbackHandler, *this, idx),
@@ -28,60 +29,178 @@ pid_t SpiedThread::getTid() const {
     return _tid;
 }
 
+SpiedThread::E_State SpiedThread::getState() {
+    std::lock_guard lk(_stateMutex);
+    return _state;
+}
+
 void SpiedThread::setState(E_State state) {
     _stateMutex.lock();
 
-    _regSync = OLD;
+    _registers.invalidate();
     _state = state;
 
+    if(state != CONTINUED) {
+        for(auto barrier : _barriers)
+            barrier->arrive();
+        _barriers.clear();
+    }
+
     _stateMutex.unlock();
 
     _stateCV.notify_all();
 }
 
 bool SpiedThread::resume(int signum) {
-    bool success = true;
-    writeRegisters();
+    Tracer::Transaction transaction;
+    prepareResume(transaction, signum);
 
-    auto res = _tracer.commandPTrace(PTRACE_CONT, _tid, nullptr, signum);
-    setState(CONTINUED);
+    _tracer.commit(std::move(transaction));
     info_log("Thread (" << _tid << ") resumed");
 
-    return success;
+    return true;
 }
 
 bool SpiedThread::singleStep() {
-    std::unique_lock stateLk(_stateMutex);
-    bool success = true;
+    Tracer::Transaction transaction;
+    prepareSingleStep(transaction);
+
+    // The transaction completes once the thread stopped after the step
+    Tracer::Result res;
+    auto completion = _tracer.commit(std::move(transaction));
+    if (!_tracer.waitFor(completion, STATE_TIMEOUT, res)) {
+        // The parked steps would otherwise run on the next, unrelated, stop of the thread
+        if (_tracer.cancel(completion)) {
+            _isSigTrapExpected = false;
+            error_log("Timeout for thread " << _tid);
+            return false;
+        }
+
+        // Reported meanwhile
+        res = _tracer.wait(completion);
+    }
+
+    return Tracer::succeeded(res);
+}
+
+void SpiedThread::prepareResume(Tracer::Transaction &transaction, int signum) {
+    prepareRegisters(transaction);
+
+    // An interrupt overtaken by another stop is still pending, it will be ignored when reported
+    _isInterruptPending = false;
+
+    // If the thread is stopped by a previous step of the transaction, the state can only be updated by the tracer
+    if (transaction.isAwaiting(_tid)) {
+        transaction.sync(&SpiedThread::markContinued, this);
+    } else {
+        setState(CONTINUED);
+    }
+
+    transaction.cont(_tid, signum);
+}
+
+void SpiedThread::prepareSingleStep(Tracer::Transaction &transaction) {
+    prepareRegisters(transaction);
 
-    writeRegisters();
+    _isInterruptPending = false;
+
+    if (transaction.isAwaiting(_tid)) {
+        transaction.sync(&SpiedThread::markContinued, this);
+    } else {
+        setState(CONTINUED);
+    }
 
     _isSigTrapExpected = true;
-    _tracer.commandPTrace(PTRACE_SINGLESTEP, _tid, nullptr, nullptr).wait();
+    transaction.singleStep(_tid).awaitStop(_tid);
+}
+
+bool SpiedThread::prepareDisplacedStep(Tracer::Transaction &transaction, uint64_t from, uint64_t to,
+                                       const X86Instruction &instruction, size_t relocatedLength) {
+    _displacedStep = {from, to, instruction.getLength(), relocatedLength, instruction.isCall()};
+
+    if(!_registers.setGpr(&user_regs_struct::rip, to))
+        return false;
 
-    if (!_stateCV.wait_for(stateLk, STATE_TIMEOUT, [this] { return _state == STOPPED; })) {
-        success = false;
-        _isSigTrapExpected = false;
-        error_log("Timeout for thread " << _tid);
+    prepareSingleStep(transaction);
+    transaction.sync(&SpiedThread::fixupDisplacedStep, this);
+    return true;
+}
+
+long SpiedThread::fixupDisplacedStep(void *spiedThread) {
+    auto thread = static_cast<SpiedThread*>(spiedThread);
+    auto& step = thread->_displacedStep;
+
+    // Executed by the tracer thread right after the step, the register cache is not valid anymore
+    struct user_regs_struct regs;
+    if(ptrace(PTRACE_GETREGS, thread->_tid, nullptr, &regs) == -1)
+        return -1;
+
+    const uint64_t fallThrough = step.to + step.relocatedLength;
+    const uint64_t next = step.from + step.length;
+
+    // Taken branches already point to their original target
+    if(regs.rip == fallThrough)
+        regs.rip = next;
+    else if(regs.rip >= step.to && regs.rip < fallThrough)
+        regs.rip = regs.rip - step.to + step.from;
+
+    if(step.isCall) {
+        uint64_t retAddr;
+        if(thread->_tracer.readMemory((void*)regs.rsp, &retAddr, sizeof(retAddr)) == sizeof(retAddr)
+           && retAddr == fallThrough) {
+            if(thread->_tracer.writeMemory((void*)regs.rsp, &next, sizeof(next)) != sizeof(next))
+                return -1;
+        }
     }
 
-    return success;
+    return ptrace(PTRACE_SETREGS, thread->_tid, nullptr, &regs);
+}
+
+long SpiedThread::markContinued(void *spiedThread) {
+    static_cast<SpiedThread*>(spiedThread)->setState(CONTINUED);
+    return 0;
+}
+
+bool SpiedThread::prepareStop(Tracer::Transaction &transaction, ThreadBarrier &barrier) {
+    std::lock_guard lk(_stateMutex);
+
+    if(_state == STOPPED || _state == EXITED || _state == TERMINATED)
+        return false;
+
+    _barriers.push_back(&barrier);
+    barrier.expect();
+
+    if(!_isInterruptPending) {
+        _isInterruptPending = true;
+        transaction.interrupt(_tid);
+    }
+
+    return true;
+}
+
+void SpiedThread::leaveBarrier(ThreadBarrier& barrier) {
+    std::lock_guard lk(_stateMutex);
+    _barriers.erase(std::remove(_barriers.begin(), _barriers.end(), &barrier), _barriers.end());
 }
 
 bool SpiedThread::stop() {
+    ThreadBarrier barrier;
+    Tracer::Transaction transaction;
 
-    bool success = true;
-    std::unique_lock lk(_stateMutex);
+    if(!prepareStop(transaction, barrier))
+        return true;
 
-    if(_state != STOPPED) {
-        _tracer.tkill(_tid, SIGSTOP);
-        if (!_stateCV.wait_for(lk, STATE_TIMEOUT, [this] { return _state == STOPPED; })) {
-            success = false;
-            error_log("Timeout for " << _tid);
-        }
+    // Empty if another stop request already interrupted the thread
+    if(!transaction.empty())
+        _tracer.commit(std::move(transaction));
+
+    if (!barrier.waitFor(STATE_TIMEOUT)) {
+        leaveBarrier(barrier);
+        error_log("Timeout for " << _tid);
+        return false;
     }
 
-    return success;
+    return true;
 }
 
 bool SpiedThread::terminate() {
@@ -137,42 +256,49 @@ void SpiedThread::deleteWatchPoint(WatchPoint *watchPoint) {
 bool SpiedThread::backtrace() {
 
     // Get register
-    uint64_t rip = getRip();
+    user_regs_struct regs;
+    if (!_registers.getGprs(regs))
+        return false;
+    uint64_t rip = regs.rip;
+
+    // The spied thread may hold the loader lock, dladdr cannot be used
+    auto& moduleIndex = ModuleIndex::getModuleIndex();
 
     // Print thread current position
-    Dl_info info;
-    if (dladdr((void *) rip, &info) == 0) {
+    ModuleIndex::Location location;
+    if (!moduleIndex.find((void *) rip, location)) {
         info_log("Thread " << _tid << " at " << (void *)rip);
     } else {
-        if (info.dli_sname != nullptr) {
-            info_log("Thread " << _tid << " at " << info.dli_sname << " (" << info.dli_fname << ")");
+        if (location.symbolName != nullptr) {
+            info_log("Thread " << _tid << " at " << location.symbolName << "+" << (void *) location.offset
+                     << " (" << location.fileName << ")");
         } else {
-            info_log("Thread " << _tid << " at " << (void *) rip << " (" << info.dli_fname << ")");
+            info_log("Thread " << _tid << " at " << (void *) rip << " (" << location.fileName << ")");
             return true;
         }
     }
 
     // Print call stack
-    auto rbp = (uint64_t *) getRbp();
+    auto rbp = (uint64_t *) regs.rbp;
     while (rbp) {
         uint64_t retAddr = *(rbp + 1);
         rbp = (uint64_t *) (*rbp);
 
-        if (!dladdr((void *) retAddr, &info)) break;
+        if (!moduleIndex.find((void *) retAddr, location)) break;
 
-        if (info.dli_sname) {
-            info_log("\tfrom " << info.dli_sname << " (" << info.dli_fname << ")");
+        if (location.symbolName) {
+            info_log("\tfrom " << location.symbolName << "+" << (void *) location.offset
+                     << " (" << location.fileName << ")");
         }
         else {
-            info_log("\tfrom ?? (" << (void *) retAddr << ") (" << info.dli_fname << ")");
+            info_log("\tfrom ?? (" << (void *) retAddr << ") (" << location.fileName << ")");
         }
     }
     return true;
 }
 
 bool SpiedThread::detach() {
-    auto futureRes = _tracer.commandPTrace(PTRACE_DETACH, (_tid-2), 0, SIGSTOP);
-    auto res = futureRes.get();
+    auto res = _tracer.commandPTrace(PTRACE_DETACH, (_tid-2), 0, SIGSTOP);
     if(res.first != 0){
         error_log("PTRACE_DETACH failed " << strerror(res.second));
     }
@@ -181,90 +307,44 @@ bool SpiedThread::detach() {
 }
 
 uint64_t SpiedThread::getRip() {
-    readRegisters();
-
-    if(_futureRegs.valid()){
-        _futureRegs.get();
-    }
-
-    return _regs.rip;
+    uint64_t rip = 0;
+    _registers.getGpr(&user_regs_struct::rip, rip);
+    return rip;
 }
 
 uint64_t SpiedThread::getRbp() {
-    readRegisters();
-
-    if(_futureRegs.valid()){
-        _futureRegs.get();
-    }
-
-    return _regs.rbp;
+    uint64_t rbp = 0;
+    _registers.getGpr(&user_regs_struct::rbp, rbp);
+    return rbp;
 }
 
 uint64_t SpiedThread::getDr6() {
-    readRegisters();
-
-    if(_futureDr6.valid()){
-        _dr6 = _futureDr6.get().first;
-    }
-
-    return _dr6;
+    uint64_t dr6 = 0;
+    _registers.getDebugReg(6, dr6);
+    return dr6;
 }
 
-void SpiedThread::jump(void* addr) {
-    std::lock_guard lk(_stateMutex);
-    readRegisters();
-
-    if(_futureRegs.valid()){
-        _futureRegs.get();
-    }
-
-    _regs.rip = (uint64_t)addr;
-    _regSync = NEW;
+RegisterCache &SpiedThread::getRegisters() {
+    return _registers;
 }
 
-void SpiedThread::setDr6(uint64_t dr6){
+bool SpiedThread::jump(void* addr) {
     std::lock_guard lk(_stateMutex);
-    readRegisters();
-
-    if(_futureDr6.valid()){
-        _futureDr6.get();
-    }
-
-    _dr6 = (uint64_t)dr6;
-    _regSync = NEW;
+    return _registers.setGpr(&user_regs_struct::rip, (uint64_t)addr);
 }
 
-void SpiedThread::writeRegisters() {
+void SpiedThread::setDr6(uint64_t dr6){
     std::lock_guard lk(_stateMutex);
-
-    if(_regSync == NEW){
-        // If the register values have not yet been written to SpiedThread attributes,
-        // no need to write them back in registers
-        if(!_futureRegs.valid()){
-            _tracer.commandPTrace(PTRACE_SETREGS, _tid, NULL, &_regs);}
-        if(!_futureDr6.valid()) {
-            _tracer.commandPTrace(PTRACE_POKEUSER, _tid, offsetof(struct user, u_debugreg[6]), _dr6);
-        }
-        _regSync = SYNC;
-    }
+    _registers.setDebugReg(6, dr6);
 }
 
-void SpiedThread::readRegisters() {
+void SpiedThread::prepareRegisters(Tracer::Transaction &transaction) {
     std::lock_guard lk(_stateMutex);
-
-    if(_state != STOPPED) return;
-
-    if(_regSync == OLD){
-        _futureDr6 = _tracer.commandPTrace(PTRACE_PEEKUSER, _tid, offsetof(struct user, u_debugreg[6]), NULL);
-        _futureRegs = _tracer.commandPTrace(PTRACE_GETREGS, _tid, NULL, &_regs);
-
-        _regSync = SYNC;
-    }
+    _registers.prepareFlush(transaction);
 }
 
 bool SpiedThread::handleEvent(SpiedThread::E_State state, int signal, int status, uint16_t ptraceEvent) {
     bool isEventHandled = false;
-    readRegisters();
 
     switch(state){
         case CONTINUED:
@@ -286,11 +366,40 @@ bool SpiedThread::handleEvent(SpiedThread::E_State state, int signal, int status
         break;
 
         case STOPPED:
+            if(ptraceEvent == PTRACE_EVENT_STOP && signal == SIGTRAP) {
+                std::unique_lock lk(_stateMutex);
+
+                if(!_isInterruptPending) {
+                    // Stale interrupt, the thread already stopped for another reason and was resumed since then :
+                    // it keeps its state, running threads are restarted as they are
+                    if(_state == CONTINUED) {
+                        Tracer::Transaction transaction;
+                        transaction.cont(_tid);
+                        _tracer.commit(std::move(transaction));
+                    }
+                    isEventHandled = true;
+                    break;
+                }
+
+                _isInterruptPending = false;
+                setState(STOPPED);
+                info_log("Thread (" << _tid << ") interrupted");
+                isEventHandled = true;
+                break;
+            }
+
             setState(STOPPED);
-            if(signal == SIGTRAP) {
+            if(ptraceEvent == PTRACE_EVENT_STOP) {
+                info_log("Thread (" << _tid << ") in group stop (signal " << signal << ")");
+                isEventHandled = true;
+            } else if(signal == SIGTRAP) {
                 if (_isSigTrapExpected) { // #FIXME find a way not to use _isSigTrapExpected
                     _isSigTrapExpected = false;
+
+                    // Resume the transaction waiting for the end of the step, it may already resume the thread
+                    _tracer.notifyStop(_tid);
                     isEventHandled = true;
+                    break;
                 }
 
                 if(ptraceEvent == PTRACE_EVENT_CLONE){
@@ -140,7 +140,9 @@ void SpyLoader::createSpiedNamespaces(uint32_t nb) {
         }
 
         _avlNamespaceId.insert(id);
-        updateWrappedFunctions(namespaces.emplace_back(0, nullptr, nullptr));
+        // Not prewarmed : no thread is running in the namespace when the libpthread thread lists are repaired
+        auto& spiedNamespace = namespaces.emplace_back(0, nullptr, nullptr);
+        updateWrappedFunctions(spiedNamespace);
 
         // No need to try to close libSpyLoader.so which is tagged NODELETE so whatever happen it should stay in loaded
     }
@@ -0,0 +1,168 @@
+#include <cstddef>
+
+#include "SymbolWrapper.h"
+#include "Logger.h"
+#include "helpers/CodeEmitter.h"
+
+static_assert(offsetof(SymbolWrapper::CallContext, rax) == 48);
+static_assert(offsetof(SymbolWrapper::CallContext, stack) == 56);
+static_assert(offsetof(SymbolWrapper::CallContext, xmm) == 64);
+
+namespace {
+    const uint8_t rax = 0, rcx = 1, rdx = 2, rsi = 6, rdi = 7, r8 = 8, r9 = 9, r11 = 11;
+    // Saved in the CallContext order
+    const uint8_t argRegs[] = {rdi, rsi, rdx, rcx, r8, r9, rax};
+
+    // mov %reg, disp(%rsp) or mov disp(%rsp), %reg
+    void moveGpr(CodeEmitter& emitter, bool isStore, uint8_t reg, uint32_t disp) {
+        emitter.bytes({(uint8_t)(0x48 | (reg >= 8 ? 0x04 : 0)), (uint8_t)(isStore ? 0x89 : 0x8B),
+                       (uint8_t)(0x84 | ((reg & 0x7) << 3)), 0x24}).imm32(disp);
+    }
+
+    // movdqu %xmmN, disp(%rsp) or movdqu disp(%rsp), %xmmN
+    void moveXmm(CodeEmitter& emitter, bool isStore, uint8_t idx, uint32_t disp) {
+        emitter.bytes({0xF3, 0x0F, (uint8_t)(isStore ? 0x7F : 0x6F), (uint8_t)(0x84 | (idx << 3)), 0x24}).imm32(disp);
+    }
+}
+
+uint64_t SymbolWrapper::CallContext::getArg(uint32_t idx) const {
+    return idx < 6 ? (&rdi)[idx] : stack[idx - 6];
+}
+
+void SymbolWrapper::CallContext::setArg(uint32_t idx, uint64_t val) {
+    if(idx < 6)
+        (&rdi)[idx] = val;
+    else
+        stack[idx - 6] = val;
+}
+
+SymbolWrapper::SymbolWrapper(Tracer &tracer, DynamicNamespace &spiedNamespace, const std::string &binName,
+                             std::string symbolName) :
+_tracer(tracer), _binName(binName), _symbolName(std::move(symbolName)),
+_wrappedFunction(spiedNamespace.findFunction(_symbolName)),
+_scope(tracer, spiedNamespace, _binName, _symbolName, _wrappedFunction), _trampoline(nullptr), _dispatch(nullptr)
+{
+    if(_wrappedFunction == nullptr)
+        throw std::invalid_argument("Cannot find " + _symbolName + " definition in the spied namespace");
+
+    if(!_scope.isValid())
+        throw std::invalid_argument("Cannot find " + _binName + " in the spied namespace");
+
+    if(!_binName.empty() && _scope.empty()) {
+        error_log("Failed to find " << _symbolName << " in relocation table of " << _binName);
+        throw std::invalid_argument("Cannot find function in relocation table");
+    }
+
+    if(!buildTrampoline())
+        throw std::invalid_argument("Cannot create the trampoline of " + _symbolName);
+}
+
+SymbolWrapper::~SymbolWrapper() {
+    wrapping(false);
+
+    // A thread may still be running the trampoline, it is not released and neither is its dispatch block.
+    // Wait for the handler calls, the later ones go on to the wrapped function.
+    replaceHandler(nullptr);
+}
+
+const std::string &SymbolWrapper::getSymbolName() const {
+    return _symbolName;
+}
+
+void *SymbolWrapper::getWrappedFunction() const {
+    return _wrappedFunction;
+}
+
+void SymbolWrapper::setHandler(Handler &&handler) {
+    replaceHandler(handler ? new Handler(std::move(handler)) : nullptr);
+}
+
+void SymbolWrapper::replaceHandler(Handler *handler) {
+    Handler* previous = _dispatch->handler.exchange(handler, std::memory_order_seq_cst);
+    if(previous != nullptr) {
+        _dispatch->rcu.synchronize();
+        delete previous;
+    }
+}
+
+bool SymbolWrapper::wrapping(bool active) {
+    return _scope.redirect(active ? _trampoline : nullptr);
+}
+
+uint64_t SymbolWrapper::dispatch(CallContext *context, Dispatch *dispatch) {
+    if(dispatch->handler.load(std::memory_order_relaxed) == nullptr)
+        return CALL_ORIGINAL;
+
+    Rcu::ReadGuard guard(dispatch->rcu);
+    Handler* handler = dispatch->handler.load(std::memory_order_seq_cst);
+    if(handler == nullptr)
+        return CALL_ORIGINAL;
+
+    // Exceptions cannot go through the trampoline
+    try {
+        return (*handler)(*context);
+    } catch(const std::exception& e) {
+        error_log("Handler of " << dispatch->symbolName << " failed : " << e.what());
+        return CALL_ORIGINAL;
+    }
+}
+
+bool SymbolWrapper::buildTrampoline() {
+    auto& arena = _tracer.getCodeArena();
+    _trampoline = arena.allocate(trampolineSize, _wrappedFunction);
+    if(_trampoline == nullptr)
+        return false;
+
+    _dispatch = new Dispatch{{nullptr}, {}, _symbolName};
+
+    CodeEmitter emitter((uint64_t)_trampoline);
+
+    // push %rbp ; mov %rsp, %rbp ; sub $contextSize, %rsp ; and $-16, %rsp
+    emitter.bytes({0x55, 0x48, 0x89, 0xE5});
+    emitter.bytes({0x48, 0x81, 0xEC}).imm32(contextSize);
+    emitter.bytes({0x48, 0x83, 0xE4, 0xF0});
+
+    for(uint32_t idx = 0; idx < sizeof(argRegs); idx++)
+        moveGpr(emitter, true, argRegs[idx], idx * sizeof(uint64_t));
+    for(uint8_t idx = 0; idx < 8; idx++)
+        moveXmm(emitter, true, idx, (uint32_t)(offsetof(CallContext, xmm) + idx * sizeof(Vec128)));
+
+    // lea 16(%rbp), %r11 (stack arguments)
+    emitter.bytes({0x4C, 0x8D, 0x5D, 0x10});
+    moveGpr(emitter, true, r11, offsetof(CallContext, stack));
+
+    // mov %rsp, %rdi ; movabs $dispatch block, %rsi ; movabs $dispatch, %rax ; call *%rax ; mov %rax, %r11
+    emitter.bytes({0x48, 0x89, 0xE7});
+    emitter.bytes({0x48, 0xBE}).imm64((uint64_t)_dispatch);
+    emitter.bytes({0x48, 0xB8}).imm64((uint64_t)&SymbolWrapper::dispatch);
+    emitter.bytes({0xFF, 0xD0, 0x49, 0x89, 0xC3});
+
+    for(uint8_t idx = 0; idx < 8; idx++)
+        moveXmm(emitter, false, idx, (uint32_t)(offsetof(CallContext, xmm) + idx * sizeof(Vec128)));
+    for(uint32_t idx = 0; idx < sizeof(argRegs); idx++)
+        moveGpr(emitter, false, argRegs[idx], idx * sizeof(uint64_t));
+
+    // test %r11, %r11 ; jnz return
+    emitter.bytes({0x4D, 0x85, 0xDB, 0x0F, 0x85});
+    size_t returnRel = emitter.size();
+    emitter.imm32(0);
+
+    // mov %rbp, %rsp ; pop %rbp ; movabs $wrappedFunction, %r11 ; jmp *%r11
+    emitter.bytes({0x48, 0x89, 0xEC, 0x5D});
+    emitter.bytes({0x49, 0xBB}).imm64((uint64_t)_wrappedFunction);
+    emitter.bytes({0x41, 0xFF, 0xE3});
+
+    // return : mov %rbp, %rsp ; pop %rbp ; ret
+    emitter.bindRel32(returnRel);
+    emitter.bytes({0x48, 0x89, 0xEC, 0x5D, 0xC3});
+
+    if(emitter.size() > trampolineSize || !CodeArena::write(_trampoline, emitter.code().data(), emitter.size())) {
+        arena.release(_trampoline, trampolineSize);
+        _trampoline = nullptr;
+        delete _dispatch;
+        _dispatch = nullptr;
+        return false;
+    }
+
+    return true;
+}
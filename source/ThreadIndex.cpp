@@ -0,0 +1,60 @@
+#include <atomic>
+#include <mutex>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+#include "ThreadIndex.h"
+
+namespace {
+    const uint32_t noIndex = UINT32_MAX;
+
+    std::atomic<uint32_t> threadNb(0);
+    thread_local uint32_t threadIdx __attribute__((tls_model("initial-exec"))) = noIndex;
+    thread_local pid_t threadTid __attribute__((tls_model("initial-exec"))) = 0;
+
+    // Indexes of the exited threads, given again to the next new threads
+    std::mutex freeIndexesMutex;
+    std::vector<uint32_t> freeIndexes;
+
+    // Only touched when the index is taken, so the fast path keeps reading a trivial initial-exec variable
+    struct IndexOwner {
+        uint32_t idx = noIndex;
+
+        ~IndexOwner() {
+            if(idx == noIndex)
+                return;
+
+            std::lock_guard lk(freeIndexesMutex);
+            freeIndexes.push_back(idx);
+
+            // A call made later in the thread exit goes to the last (shared) slot
+            threadIdx = ThreadIndex::released;
+        }
+    };
+    thread_local IndexOwner indexOwner;
+}
+
+uint32_t ThreadIndex::get() {
+    if(threadIdx == noIndex) {
+        {
+            std::lock_guard lk(freeIndexesMutex);
+            if(!freeIndexes.empty()) {
+                threadIdx = freeIndexes.back();
+                freeIndexes.pop_back();
+            } else {
+                threadIdx = threadNb.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        // Registers the destructor releasing the index when the thread exits
+        indexOwner.idx = threadIdx;
+    }
+    return threadIdx;
+}
+
+pid_t ThreadIndex::getTid() {
+    if(threadTid == 0)
+        threadTid = (pid_t)syscall(SYS_gettid);
+    return threadTid;
+}
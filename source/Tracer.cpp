@@ -1,7 +1,13 @@
+#include <algorithm>
 #include <cstring>
 #include <dlfcn.h>
+#include <fcntl.h>
 #include <iostream>
+#include <linux/futex.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ptrace.h>
+#include <sys/signalfd.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 #include <wait.h>
@@ -14,12 +20,54 @@
 
 #define tgkill(tgid, tid, sig) syscall(SYS_tgkill, tgid, tid, sig)
 
+static void futexWait(std::atomic<uint32_t>& word, uint32_t val, const struct timespec* timeout = nullptr) {
+    syscall(SYS_futex, &word, FUTEX_WAIT_PRIVATE, val, timeout, nullptr, 0);
+}
+
+static void futexWake(std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, &word, FUTEX_WAKE_PRIVATE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+static inline void cpuRelax() {
+    __builtin_ia32_pause();
+}
+
 Tracer::Tracer()
-: _state(NOT_STARTED)
+: _traceePid(-1), _memFd(-1), _spiedNamespace(nullptr), _isTraceeSeized(false), _state(NOT_STARTED), _inProcessPatching(true), _sleeping(false),
+  _signalFd(-1), _pidFd(-1), _isEventLoop(false), _completionTicket(1), _transactionTicket(0)
 {
-    if(sem_init(&_cmdsSem, 0, 0) == -1){
-        error_log("Semaphore initialization failed : " << strerror(errno));
-        throw std::invalid_argument("invalid sem init");
+    for(auto& slot : _completions) {
+        slot.state.store(FREE, std::memory_order_relaxed);
+        slot.ticket = 0;
+    }
+
+    for(auto& pending : _transactions) {
+        pending.isUsed.store(false, std::memory_order_relaxed);
+        pending.owners.store(0, std::memory_order_relaxed);
+        pending.awaitedTid = 0;
+    }
+
+    _wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(_wakeFd == -1){
+        error_log("Eventfd creation failed : " << strerror(errno));
+        throw std::invalid_argument("invalid eventfd");
+    }
+
+    _epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(_epollFd == -1){
+        error_log("Epoll creation failed : " << strerror(errno));
+        close(_wakeFd);
+        throw std::invalid_argument("invalid epoll");
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = _wakeFd;
+    if(epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeFd, &event) == -1){
+        error_log("Epoll registration failed : " << strerror(errno));
+        close(_epollFd);
+        close(_wakeFd);
+        throw std::invalid_argument("invalid epoll registration");
     }
 
     _stack = mmap(nullptr, stackSize, PROT_READ | PROT_WRITE,
@@ -42,27 +90,29 @@ void Tracer::createTracee(DynamicNamespace &spiedNamespace){
 
     int cloneFlags = CLONE_FS | CLONE_FILES | SIGCHLD | CLONE_VM;
     void* stackTop = (void*)((uint64_t)_stack + stackSize);
-    _traceePid = clone(preStart, stackTop, cloneFlags, &spiedNamespace);
+    _spiedNamespace = &spiedNamespace;
+    _traceePid = clone(preStart, stackTop, cloneFlags, this);
 
     if(_traceePid == -1){
         error_log("Clone failed : " << strerror(errno));
         return;
     }
 
-    // Wait for spied program process to be created
-    int wstatus;
-    if(waitpid(_traceePid, &wstatus, 0) == -1){
-        error_log("Waitpid failed " << strerror(errno));
-    }
-    if (WIFSTOPPED(wstatus)) {
-        if(ptrace(PTRACE_SETOPTIONS, _traceePid, nullptr, PTRACE_O_TRACECLONE) == -1)
-            error_log("PTRACE_O_TRACECLONE failed : " << strerror(errno));
+    // Seized threads (and the ones they create) are stopped with PTRACE_INTERRUPT instead of SIGSTOP
+    if(ptrace(PTRACE_SEIZE, _traceePid, nullptr, PTRACE_O_TRACECLONE) == -1)
+        error_log("PTRACE_SEIZE failed : " << strerror(errno));
 
-        if(ptrace(PTRACE_CONT, _traceePid, nullptr, nullptr) == -1)
-            error_log("PTRACE_CONT failed for starter");
+    _isTraceeSeized.store(true, std::memory_order_release);
+
+    // Only used when process_vm_writev/readv cannot access a page (e.g. read only text)
+    std::string memPath = "/proc/" + std::to_string(_traceePid) + "/mem";
+    _memFd = open(memPath.c_str(), O_RDWR | O_CLOEXEC);
+    if(_memFd == -1){
+        error_log("Failed to open " << memPath << " : " << strerror(errno));
     }
 
     // Wait for pre start to create the main thread
+    int wstatus;
     if(waitpid(_traceePid, &wstatus, 0) == -1)
         error_log("Waitpid failed (create starter): " << strerror(errno));
 
@@ -72,6 +122,8 @@ void Tracer::createTracee(DynamicNamespace &spiedNamespace){
 
 void Tracer::trace(DynamicNamespace &spiedNamespace, std::promise<pid_t> promise){
 
+    _tracerId = std::this_thread::get_id();
+
     createTracee(spiedNamespace);
     promise.set_value(_traceePid);
 
@@ -79,50 +131,384 @@ void Tracer::trace(DynamicNamespace &spiedNamespace, std::promise<pid_t> promise
 
     while(_state != STOPPED)
     {
-        sem_wait(&_cmdsSem);
+        Command command;
+
+        if(_commands.tryPop(command)) {
+            handleCommand(command);
+            continue;
+        }
+
+        // Spin for a while before going to sleep, commands often come in bursts
+        uint32_t spin = 0;
+        while(spin < spinNb && _commands.empty()) {
+            cpuRelax();
+            spin++;
+        }
 
-        //Get next command to execute
-        _cmdsMutex.lock();
-        while(!_commands.empty()) {
-            auto& command = _commands.front();
-            _cmdsMutex.unlock();
+        if(spin == spinNb) {
+            _sleeping.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
 
-            command();
+            if(_commands.empty() && _state != STOPPED)
+                waitEvents();
 
-            _cmdsMutex.lock();
-            _commands.pop();
+            _sleeping.store(false);
+        } else if(_isEventLoop) {
+            reapChildren();
         }
-        _cmdsMutex.unlock();
     }
 
     info_log("Stop handling commands!");
 }
 
+void Tracer::waitEvents() {
+    struct epoll_event events[3];
+
+    // In event loop mode, SIGCHLD may still be consumed by a thread created before the spied program which does
+    // not block it, so children are also polled periodically
+    int nb = epoll_wait(_epollFd, events, 3, _isEventLoop ? eventLoopTimeoutMs : -1);
+    if(nb == -1 && errno != EINTR)
+        error_log("Epoll wait failed : " << strerror(errno));
+
+    for(int idx = 0; idx < nb; idx++) {
+        int fd = events[idx].data.fd;
+
+        if(fd == _wakeFd) {
+            uint64_t val;
+            (void)!read(_wakeFd, &val, sizeof(val));
+        } else if(fd == _signalFd) {
+            struct signalfd_siginfo info;
+            while(read(_signalFd, &info, sizeof(info)) == sizeof(info));
+        } else if(fd == _pidFd) {
+            info_log("Spied program (" << _traceePid << ") exited");
+            epoll_ctl(_epollFd, EPOLL_CTL_DEL, _pidFd, nullptr);
+        }
+    }
+
+    if(_isEventLoop)
+        reapChildren();
+}
 
-int Tracer::preStart(void * spiedNamespace) {
-    if(ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1)
-        fatal_log("PTRACE_TRACEME failed " << strerror(errno));
+void Tracer::reapChildren() {
+    int wstatus;
+    pid_t tid;
 
-    if(raise(SIGSTOP) != 0)
-        fatal_log("Ptrace failed " << strerror(errno));
+    while((tid = waitpid(-1, &wstatus, WCONTINUED | WNOHANG)) > 0)
+        _eventHandler(tid, wstatus);
+
+    if(tid == -1 && errno == ECHILD) {
+        info_log("No more child to wait for");
+        _isEventLoop = false;
+    }
+}
 
-    DynamicNamespace::createMainThread(reinterpret_cast<DynamicNamespace *>(spiedNamespace));
+void Tracer::enableEventLoop() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+
+    if(pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0)
+        error_log("Failed to block SIGCHLD");
+
+    _signalFd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if(_signalFd == -1) {
+        error_log("Signalfd creation failed : " << strerror(errno));
+    } else {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = _signalFd;
+        if(epoll_ctl(_epollFd, EPOLL_CTL_ADD, _signalFd, &event) == -1)
+            error_log("Epoll registration of signalfd failed : " << strerror(errno));
+    }
+
+#ifdef SYS_pidfd_open
+    _pidFd = (int)syscall(SYS_pidfd_open, _traceePid, 0);
+    if(_pidFd == -1) {
+        error_log("Pidfd creation failed : " << strerror(errno));
+    } else {
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = _pidFd;
+        if(epoll_ctl(_epollFd, EPOLL_CTL_ADD, _pidFd, &event) == -1)
+            error_log("Epoll registration of pidfd failed : " << strerror(errno));
+    }
+#endif
+
+    _isEventLoop = true;
+    info_log("Tracer thread handles spied program events");
+
+    reapChildren();
+}
+
+void Tracer::startEventLoop(EventHandler &&handler) {
+    _eventHandler = std::move(handler);
+    push({ENABLE_EVENT_LOOP, PTRACE_CONT, 0, nullptr, nullptr, nullptr, nullptr});
+}
+
+bool Tracer::isTracerThread() const {
+    return std::this_thread::get_id() == _tracerId;
+}
+
+
+int Tracer::preStart(void * param) {
+    auto tracer = reinterpret_cast<Tracer *>(param);
+
+    // The address space is shared with the tracer, no need for a stop to synchronize with it
+    while(!tracer->_isTraceeSeized.load(std::memory_order_acquire))
+        cpuRelax();
+
+    // Blocked by the tester threads for the event loop signalfd, not by the spied program
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+
+    DynamicNamespace::createMainThread(tracer->_spiedNamespace);
     return 0;
 }
 
 int Tracer::tkill(pid_t tid, int sig) {
-    _cmdsMutex.lock();
-    _commands.emplace([this, tid, sig] {
-        if(tgkill(_traceePid, tid, sig) == -1)
-            error_log("tgkill(" << tid << ", " << sig << ") failed (" << strerror(errno) << ")");
+    push({TKILL, PTRACE_CONT, tid, nullptr, toWord(sig), nullptr, nullptr});
 
+    return 0;
+}
+
+void Tracer::push(const Command &command) {
+    // Commands issued while handling events on the tracer thread are executed right away
+    if(isTracerThread()) {
+        Command inlineCommand = command;
+        handleCommand(inlineCommand);
+        return;
+    }
+
+    // Busy wait if the ring is full, the tracer thread is the only one able to free a record
+    while(!_commands.tryPush(command))
+        std::this_thread::yield();
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(_sleeping.exchange(false)) {
+        uint64_t val = 1;
+        if(write(_wakeFd, &val, sizeof(val)) == -1)
+            error_log("Failed to wake tracer thread : " << strerror(errno));
+    }
+}
+
+Tracer::CompletionSlot &Tracer::reserveCompletion(uint64_t& ticket) {
+    ticket = _completionTicket.fetch_add(1);
+    CompletionSlot& slot = _completions[ticket % completionsNb];
+
+    // The slot may still be used by a request issued completionsNb requests ago, or claimed by a producer
+    // holding the ticket completionsNb requests later
+    uint32_t state = FREE;
+    while(!slot.state.compare_exchange_weak(state, PENDING, std::memory_order_acquire, std::memory_order_relaxed)) {
+        state = FREE;
+        std::this_thread::yield();
+    }
+
+    slot.ticket = ticket;
+
+    return slot;
+}
+
+Tracer::PendingTransaction &Tracer::reserveTransaction() {
+    for(size_t tries = 1;; tries++) {
+        PendingTransaction& pending = _transactions[_transactionTicket.fetch_add(1) % transactionsNb];
+
+        bool isUsed = false;
+        if(pending.isUsed.compare_exchange_strong(isUsed, true, std::memory_order_acquire))
+            return pending;
+
+        // Every record is parked or being executed, wait for the tracer thread to free one
+        if(tries % transactionsNb == 0)
+            std::this_thread::yield();
+    }
+}
+
+void Tracer::release(Tracer::Completion &completion) {
+    CompletionSlot& slot = _completions[completion._ticket % completionsNb];
+    completion._ticket = 0;
+
+    // Not executed yet, the tracer thread frees the slot once it is
+    uint32_t state = slot.state.load(std::memory_order_acquire);
+    while(state != DONE) {
+        if(slot.state.compare_exchange_weak(state, ABANDONED, std::memory_order_acq_rel))
+            return;
+    }
+
+    slot.state.store(FREE, std::memory_order_release);
+}
+
+void Tracer::release(Tracer::PendingTransaction &pending) {
+    if(pending.owners.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        pending.isUsed.store(false, std::memory_order_release);
+}
+
+void Tracer::complete(Tracer::CompletionSlot &slot, const Tracer::Result &result) {
+    slot.result = result;
+
+    switch(slot.state.exchange(DONE, std::memory_order_acq_rel)) {
+        case WAITED:
+            futexWake(slot.state);
+            break;
+        case ABANDONED:
+            slot.state.store(FREE, std::memory_order_release);
+            break;
+        default:
+            break;
+    }
+}
+
+Tracer::Completion::Completion(Tracer::Completion &&other) noexcept
+: _tracer(other._tracer), _ticket(other._ticket), _transaction(other._transaction) {
+    other._ticket = 0;
+    other._transaction = nullptr;
+}
+
+Tracer::Completion::~Completion() {
+    reset();
+}
+
+Tracer::Completion &Tracer::Completion::operator=(Tracer::Completion &&other) noexcept {
+    if(this != &other) {
+        reset();
+
+        _tracer = other._tracer;
+        _ticket = other._ticket;
+        _transaction = other._transaction;
+        other._ticket = 0;
+        other._transaction = nullptr;
+    }
+
+    return *this;
+}
+
+void Tracer::Completion::reset() {
+    if(valid())
+        _tracer->release(*this);
+
+    if(_transaction != nullptr) {
+        Tracer::release(*_transaction);
+        _transaction = nullptr;
+    }
+}
+
+Span<const Tracer::Result> Tracer::Completion::getResults() const {
+    // Still written by the tracer thread until the completion is polled
+    if(valid() || _transaction == nullptr)
+        return {};
+
+    return {_transaction->results, _transaction->steps.size()};
+}
+
+bool Tracer::poll(Tracer::Completion &completion, Tracer::Result &result) {
+    CompletionSlot& slot = _completions[completion._ticket % completionsNb];
+
+    if(!completion.valid() || slot.ticket != completion._ticket) {
+        error_log("Invalid completion " << completion._ticket);
+        return false;
+    }
+
+    if(slot.state.load(std::memory_order_acquire) != DONE)
+        return false;
+
+    result = slot.result;
+    completion._ticket = 0;
+    slot.state.store(FREE, std::memory_order_release);
+
+    return true;
+}
+
+Tracer::Result Tracer::wait(Tracer::Completion &completion) {
+    CompletionSlot& slot = _completions[completion._ticket % completionsNb];
+    Result result(-1, EINVAL);
+
+    for(uint32_t spin = 0; spin < spinNb; spin++) {
+        if(poll(completion, result) || !completion.valid())
+            return result;
+        cpuRelax();
+    }
+
+    uint32_t state = PENDING;
+    slot.state.compare_exchange_strong(state, WAITED);
+
+    while(!poll(completion, result) && completion.valid())
+        futexWait(slot.state, WAITED);
+
+    return result;
+}
+
+bool Tracer::waitFor(Tracer::Completion &completion, std::chrono::milliseconds timeout, Tracer::Result &result) {
+    CompletionSlot& slot = _completions[completion._ticket % completionsNb];
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    result = Result(-1, EINVAL);
+
+    if(poll(completion, result) || !completion.valid())
         return true;
-    });
-    _cmdsMutex.unlock();
 
-    sem_post(&_cmdsSem);
+    uint32_t state = PENDING;
+    slot.state.compare_exchange_strong(state, WAITED);
 
-    return 0;
+    while(!poll(completion, result) && completion.valid()) {
+        auto remaining = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now());
+        if(remaining.count() <= 0)
+            return false;
+
+        struct timespec ts = {(time_t)(remaining.count() / 1'000'000'000), (long)(remaining.count() % 1'000'000'000)};
+        futexWait(slot.state, WAITED, &ts);
+    }
+
+    return true;
+}
+
+void Tracer::handleCommand(Tracer::Command &command) {
+    switch(command.type) {
+        case PTRACE_REQUEST: {
+            errno = 0;
+            long res = ptrace(command.request, command.tid, command.addr, command.data);
+            Result result(res, (res == -1) ? errno : 0);
+
+            if(command.completion)
+                complete(*command.completion, result);
+        } break;
+
+        case TKILL: {
+            auto sig = (int)(intptr_t)command.data;
+            if(tgkill(_traceePid, command.tid, sig) == -1)
+                error_log("tgkill(" << command.tid << ", " << sig << ") failed (" << strerror(errno) << ")");
+        } break;
+
+        case TRANSACTION:
+            run(*command.transaction);
+            break;
+
+        case ENABLE_EVENT_LOOP:
+            enableEventLoop();
+            break;
+
+        case NOTIFY_STOP:
+            for(auto& pending : _transactions) {
+                if(pending.awaitedTid == command.tid && pending.isUsed.load(std::memory_order_relaxed)) {
+                    pending.awaitedTid = 0;
+                    run(pending);
+                }
+            }
+            break;
+
+        case CANCEL: {
+            auto& pending = *command.transaction;
+            bool isParked = pending.awaitedTid != 0;
+
+            if(isParked) {
+                pending.awaitedTid = 0;
+                pending.next = pending.steps.size();
+                if(succeeded(pending.result))
+                    pending.result = std::make_pair(-1L, ECANCELED);
+                run(pending);
+            }
+
+            complete(*command.completion, std::make_pair((long)isParked, 0));
+        } break;
+    }
 }
 
 void Tracer::setState(Tracer::E_State state) {
@@ -137,12 +523,368 @@ Tracer::~Tracer() {
     munmap(_stack, stackSize);
 
     setState(STOPPED);
-    sem_post(&_cmdsSem);
+
+    uint64_t val = 1;
+    (void)!write(_wakeFd, &val, sizeof(val));
 
     _tracer.join();
-    sem_destroy(&_cmdsSem);
+
+    for(int fd : {_memFd, _signalFd, _pidFd, _epollFd, _wakeFd}) {
+        if(fd != -1)
+            close(fd);
+    }
 }
 
-std::future<std::pair<long, int>> Tracer::writeWord(void *addr, uint64_t val) {
+Tracer::Result Tracer::writeWord(void *addr, uint64_t val) {
     return commandPTrace(PTRACE_POKEDATA, _traceePid, addr, val);
 }
+
+ssize_t Tracer::readMemory(const void *addr, void *buf, size_t len) {
+    struct iovec local = {buf, len};
+    struct iovec remote = {const_cast<void*>(addr), len};
+
+    return transferMemory(false, &local, 1, &remote, 1);
+}
+
+ssize_t Tracer::writeMemory(void *addr, const void *buf, size_t len) {
+    struct iovec local = {const_cast<void*>(buf), len};
+    struct iovec remote = {addr, len};
+
+    return transferMemory(true, &local, 1, &remote, 1);
+}
+
+ssize_t Tracer::readMemory(const struct iovec *local, size_t localNb, const struct iovec *remote, size_t remoteNb) {
+    return transferMemory(false, local, localNb, remote, remoteNb);
+}
+
+ssize_t Tracer::writeMemory(const struct iovec *local, size_t localNb, const struct iovec *remote, size_t remoteNb) {
+    return transferMemory(true, local, localNb, remote, remoteNb);
+}
+
+ssize_t Tracer::transferMemory(bool write, const struct iovec *local, size_t localNb,
+                               const struct iovec *remote, size_t remoteNb) {
+    size_t total = 0;
+    for(size_t idx = 0; idx < remoteNb; idx++)
+        total += remote[idx].iov_len;
+
+    ssize_t res = write ?
+            process_vm_writev(_traceePid, local, localNb, remote, remoteNb, 0) :
+            process_vm_readv(_traceePid, local, localNb, remote, remoteNb, 0);
+
+    if(res == (ssize_t)total)
+        return res;
+
+    // process_vm_writev/readv stop at the first page they cannot access, finish through /proc/<pid>/mem
+    size_t done = (res == -1) ? 0 : (size_t)res;
+    ssize_t fallbackRes = transferMemoryFallback(write, local, localNb, remote, remoteNb, done);
+
+    if(fallbackRes == -1)
+        return (done == 0) ? -1 : (ssize_t)done;
+
+    return (ssize_t)done + fallbackRes;
+}
+
+ssize_t Tracer::transferMemoryFallback(bool write, const struct iovec *local, size_t localNb,
+                                       const struct iovec *remote, size_t remoteNb, size_t offset) {
+    if(_memFd == -1) {
+        errno = EBADF;
+        return -1;
+    }
+
+    size_t localIdx = 0, localOff = offset;
+    size_t remoteIdx = 0, remoteOff = offset;
+
+    // Skip the bytes already transferred
+    while(localIdx < localNb && localOff >= local[localIdx].iov_len)
+        localOff -= local[localIdx++].iov_len;
+    while(remoteIdx < remoteNb && remoteOff >= remote[remoteIdx].iov_len)
+        remoteOff -= remote[remoteIdx++].iov_len;
+
+    size_t done = 0;
+    while(localIdx < localNb && remoteIdx < remoteNb) {
+        size_t len = std::min(local[localIdx].iov_len - localOff, remote[remoteIdx].iov_len - remoteOff);
+        auto localAddr = (uint8_t*)local[localIdx].iov_base + localOff;
+        auto remoteAddr = (off_t)((uint64_t)remote[remoteIdx].iov_base + remoteOff);
+
+        ssize_t res = write ? pwrite(_memFd, localAddr, len, remoteAddr) : pread(_memFd, localAddr, len, remoteAddr);
+        if(res <= 0) {
+            error_log("Memory " << (write ? "write" : "read") << " at " << (void*)remoteAddr << " failed : " << strerror(errno));
+            return (done == 0) ? -1 : (ssize_t)done;
+        }
+
+        done += (size_t)res;
+        localOff += (size_t)res;
+        remoteOff += (size_t)res;
+
+        if(localOff == local[localIdx].iov_len) {
+            localIdx++;
+            localOff = 0;
+        }
+        if(remoteOff == remote[remoteIdx].iov_len) {
+            remoteIdx++;
+            remoteOff = 0;
+        }
+    }
+
+    return (ssize_t)done;
+}
+
+bool Tracer::patchWord(void *addr, uint64_t val) {
+    if(_inProcessPatching)
+        return MemoryPatcher::Batch().writeWord(addr, val).commit();
+
+    auto res = writeWord(addr, val);
+    if(res.first == -1) {
+        error_log("WriteWord failed : " << strerror(res.second));
+        return false;
+    }
+
+    return true;
+}
+
+bool Tracer::patchWords(const std::vector<std::pair<void*, uint64_t>>& words) {
+    if(words.empty())
+        return true;
+
+    if(_inProcessPatching) {
+        MemoryPatcher::Batch batch;
+        for(auto& word : words)
+            batch.writeWord(word.first, word.second);
+        return batch.commit();
+    }
+
+    bool res = true;
+    for(size_t first = 0; first < words.size(); first += maxSteps) {
+        Transaction transaction;
+        for(size_t idx = first; idx < std::min(words.size(), first + maxSteps); idx++)
+            transaction.pokeData(words[idx].first, words[idx].second);
+
+        auto completion = commit(std::move(transaction));
+        res = succeeded(wait(completion)) && res;
+    }
+
+    if(!res)
+        error_log("Failed to write " << words.size() << " words");
+
+    return res;
+}
+
+void Tracer::setInProcessPatching(bool active) {
+    _inProcessPatching = active;
+}
+
+bool Tracer::isPatchingInProcess() const {
+    return _inProcessPatching;
+}
+
+CodeArena &Tracer::getCodeArena() {
+    return _codeArena;
+}
+
+Tracer::Completion Tracer::commit(Tracer::Transaction &&transaction) {
+    uint64_t ticket;
+    CompletionSlot& slot = reserveCompletion(ticket);
+
+    if(transaction._steps.size() > maxSteps) {
+        error_log("Transaction of " << transaction._steps.size() << " steps rejected (" << maxSteps << " at most)");
+        complete(slot, std::make_pair(-1L, E2BIG));
+        return Completion(this, ticket);
+    }
+
+    PendingTransaction& pending = reserveTransaction();
+
+    pending.owners.store(2, std::memory_order_relaxed);
+    pending.steps.assign(transaction._steps.begin(), transaction._steps.end());
+    pending.isIndependent = transaction._isIndependent;
+    pending.next = 0;
+    pending.result = Result(0, 0);
+    std::fill_n(pending.results, pending.steps.size(), std::make_pair(-1L, ECANCELED));
+    pending.completion = &slot;
+
+    push({TRANSACTION, PTRACE_CONT, 0, nullptr, nullptr, nullptr, &pending});
+
+    return Completion(this, ticket, &pending);
+}
+
+void Tracer::notifyStop(pid_t tid) {
+    push({NOTIFY_STOP, PTRACE_CONT, tid, nullptr, nullptr, nullptr, nullptr});
+}
+
+bool Tracer::cancel(Tracer::Completion &completion) {
+    // The handle keeps the record reserved until the command is executed, it cannot be reused meanwhile
+    if(completion._transaction == nullptr || !completion.valid())
+        return false;
+
+    uint64_t ticket;
+    CompletionSlot& slot = reserveCompletion(ticket);
+    push({CANCEL, PTRACE_CONT, 0, nullptr, nullptr, &slot, completion._transaction});
+
+    Completion cancelCompletion(this, ticket);
+    return wait(cancelCompletion).first == 1;
+}
+
+bool Tracer::succeeded(const Result &result) {
+    return result.second == 0;
+}
+
+void Tracer::run(PendingTransaction& pending) {
+    auto& steps = pending.steps;
+
+    while(pending.next < steps.size()) {
+        const auto& step = steps[pending.next++];
+
+        if(step.type == Transaction::AWAIT_STOP) {
+            pending.results[pending.next - 1] = Result(0, 0);
+            pending.awaitedTid = step.tid;
+            return;
+        }
+
+        size_t first = pending.next - 1;
+        Result res = step.type == Transaction::PATCH ? executePatches(pending) : execute(step);
+        if(succeeded(pending.result))
+            pending.result = res;
+
+        // A batch of patches is written (or not) as a whole
+        std::fill(pending.results + first, pending.results + pending.next, res);
+
+        if(res.second != 0) {
+            error_log("Transaction step " << pending.next - 1 << " failed : " << strerror(res.second));
+
+            // Following steps most likely rely on the failed one
+            if(!pending.isIndependent)
+                pending.next = steps.size();
+        }
+    }
+
+    complete(*pending.completion, pending.result);
+    release(pending);
+}
+
+Tracer::Result Tracer::executePatches(PendingTransaction &pending) {
+    auto& steps = pending.steps;
+
+    // Consecutive patches share the mprotect calls of their pages
+    size_t first = pending.next - 1;
+    while(pending.next < steps.size() && steps[pending.next].type == Transaction::PATCH)
+        pending.next++;
+
+    _patchBatch.clear();
+    for(size_t idx = first; idx < pending.next; idx++)
+        _patchBatch.write(steps[idx].addr, &steps[idx].mask, (size_t)steps[idx].data);
+
+    if(!_patchBatch.commit())
+        return std::make_pair(-1L, EFAULT);
+
+    return std::make_pair(0L, 0);
+}
+
+Tracer::Result Tracer::execute(const Tracer::Transaction::Step &step) {
+    long res;
+    errno = 0;
+
+    switch(step.type) {
+        case Transaction::PTRACE:
+            res = ptrace(step.request, step.tid, step.addr, step.data);
+            break;
+
+        case Transaction::POKEDATA:
+            res = ptrace(PTRACE_POKEDATA, _traceePid, step.addr, step.data);
+            break;
+
+        case Transaction::MODIFY_USER:
+            res = ptrace(PTRACE_PEEKUSER, step.tid, step.addr, nullptr);
+            if(errno == 0) {
+                auto val = ((uint64_t)res & ~step.mask) | (uint64_t)step.data;
+                // On failure, errno is the one of PTRACE_POKEUSER
+                res = ptrace(PTRACE_POKEUSER, step.tid, step.addr, val) == 0 ? (long)val : -1;
+            }
+            break;
+
+        case Transaction::SYNC:
+            res = step.function(step.data);
+            break;
+
+        default:
+            res = -1;
+            errno = EINVAL;
+            break;
+    }
+
+    // PTRACE_PEEK* requests may legitimately return -1, errno is the only reliable failure indicator
+    return std::make_pair(res, (res == -1) ? errno : 0);
+}
+
+Tracer::Transaction &Tracer::Transaction::append(const Tracer::Transaction::Step &step) {
+    _steps.push_back(step);
+    return *this;
+}
+
+Tracer::Transaction &Tracer::Transaction::setRegs(pid_t tid, struct user_regs_struct *regs) {
+    return append({PTRACE, PTRACE_SETREGS, tid, nullptr, regs, 0, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::setRegSet(pid_t tid, uint64_t type, struct iovec *regSet) {
+    return append({PTRACE, PTRACE_SETREGSET, tid, (void*)type, regSet, 0, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::peekUser(pid_t tid, uint64_t offset) {
+    return append({PTRACE, PTRACE_PEEKUSER, tid, (void*)offset, nullptr, 0, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::pokeUser(pid_t tid, uint64_t offset, uint64_t val) {
+    return append({PTRACE, PTRACE_POKEUSER, tid, (void*)offset, (void*)val, 0, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::modifyUser(pid_t tid, uint64_t offset, uint64_t clearMask, uint64_t setMask) {
+    return append({MODIFY_USER, PTRACE_POKEUSER, tid, (void*)offset, (void*)setMask, clearMask, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::pokeData(void *addr, uint64_t val) {
+    return append({POKEDATA, PTRACE_POKEDATA, 0, addr, (void*)val, 0, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::patch(void *addr, const void *data, size_t len) {
+    uint64_t bytes = 0;
+    memcpy(&bytes, data, std::min(len, sizeof(bytes)));
+
+    return append({PATCH, PTRACE_POKEDATA, 0, addr, (void*)std::min(len, sizeof(bytes)), bytes, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::singleStep(pid_t tid) {
+    return append({PTRACE, PTRACE_SINGLESTEP, tid, nullptr, nullptr, 0, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::cont(pid_t tid, int signum) {
+    return append({PTRACE, PTRACE_CONT, tid, nullptr, (void*)(intptr_t)signum, 0, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::interrupt(pid_t tid) {
+    return append({PTRACE, PTRACE_INTERRUPT, tid, nullptr, nullptr, 0, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::independent() {
+    _isIndependent = true;
+    return *this;
+}
+
+Tracer::Transaction &Tracer::Transaction::awaitStop(pid_t tid) {
+    return append({AWAIT_STOP, PTRACE_CONT, tid, nullptr, nullptr, 0, nullptr});
+}
+
+Tracer::Transaction &Tracer::Transaction::sync(SyncFunction function, void *param) {
+    return append({SYNC, PTRACE_CONT, 0, nullptr, param, 0, function});
+}
+
+bool Tracer::Transaction::isAwaiting(pid_t tid) const {
+    return std::any_of(_steps.begin(), _steps.end(), [tid](const Step& step){
+        return step.type == AWAIT_STOP && step.tid == tid;
+    });
+}
+
+bool Tracer::Transaction::empty() const {
+    return _steps.empty();
+}
+
+size_t Tracer::Transaction::size() const {
+    return _steps.size();
+}
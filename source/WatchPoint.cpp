@@ -2,6 +2,7 @@
 #include <sys/ptrace.h>
 #include <sys/user.h>
 
+#include "SpiedThread.h"
 #include "Tracer.h"
 #include "WatchPoint.h"
 #include "Logger.h"
@@ -20,35 +21,26 @@ WatchPoint::WatchPoint(Tracer &tracer, CallbackHandler &callbackHandler, SpiedTh
     _onHit(defaultOnHit) {}
 
 bool WatchPoint::set(void *addr, WatchPoint::E_Trigger trigger, E_Size size) {
-    // Read DR7 register
-    auto futureRes = this->_tracer.commandPTrace(PTRACE_PEEKUSER, this->_spiedThread.getTid(), offsetof(struct user, u_debugreg[7]), NULL);
-
     const uint64_t offset = offsetof(struct user, u_debugreg[0]) + _idx * sizeof(user::u_debugreg[0]);
-    this->_tracer.commandPTrace(PTRACE_POKEUSER, _spiedThread.getTid(), offset, addr);
-    this->_addr = addr;
 
-    // Reset dr7 bits corresponding to current watchpoint
-    auto res = futureRes.get();
-    if(res.first == -1){
-        error_log("PTRACE_PEEKUSER for dr7 failed (" << strerror(res.second) << ")");
+    // Reset dr7 bits corresponding to current watchpoint and set them according to parameters
+    const uint64_t clearMask = (0b11ULL << (this->_idx * 2)) | (0b1111ULL << (this->_idx * 4 + 16));
+    const uint64_t setMask = (0b11ULL                   << (this->_idx * 2     ))
+                           | ((uint64_t)trigger << (this->_idx * 4 + 16))
+                           | ((uint64_t)size    << (this->_idx * 4 + 18));
+
+    Tracer::Transaction transaction;
+    transaction
+        .pokeUser(this->_spiedThread.getTid(), offset, (uint64_t)addr)
+        .modifyUser(this->_spiedThread.getTid(), offsetof(struct user, u_debugreg[7]), clearMask, setMask);
+
+    auto completion = this->_tracer.commit(std::move(transaction));
+    auto res = this->_tracer.wait(completion);
+    if (!Tracer::succeeded(res)) {
+        error_log("Failed to set watchpoint " << this->_idx << " (" << strerror(res.second) << ")");
         return false;
     }
 
-    uint64_t dr7 = res.first;
-    dr7 &= ~((0b11 << (this->_idx * 2)) | (0b1111 << (this->_idx * 4 + 16)));
-
-    // Set dr7 bits corresponding to parameters
-    dr7 |= (0b11    << (this->_idx * 2     ));
-    dr7 |= (trigger << (this->_idx * 4 + 16));
-    dr7 |= (size    << (this->_idx * 4 + 18));
-
-    this->_tracer.commandPTrace(
-        PTRACE_POKEUSER,
-        this->_spiedThread.getTid(),
-        offsetof(struct user, u_debugreg[7]),
-        dr7
-    );
-
     this->_addr = addr;
     this->_isSet = true;
 
@@ -56,29 +48,21 @@ bool WatchPoint::set(void *addr, WatchPoint::E_Trigger trigger, E_Size size) {
 }
 
 bool WatchPoint::unset() {
-    auto resFuture = this->_tracer.commandPTrace(
-        PTRACE_PEEKUSER,
+    Tracer::Transaction transaction;
+    transaction.modifyUser(
         this->_spiedThread.getTid(),
         offsetof(struct user, u_debugreg[7]),
-        NULL
+        0b11ULL << (this->_idx * 2),
+        0
     );
-    auto res = resFuture.get();
 
-    if (res.first == -1) {
-        error_log("PTRACE_PEEKUSER for dr7 failed : " << strerror(res.second));
+    auto completion = this->_tracer.commit(std::move(transaction));
+    auto res = this->_tracer.wait(completion);
+    if (!Tracer::succeeded(res)) {
+        error_log("Failed to unset watchpoint " << this->_idx << " (" << strerror(res.second) << ")");
         return false;
     }
 
-    uint64_t dr7 = res.first;
-    dr7 &= ~(0b11 << (this->_idx * 2));
-
-    this->_tracer.commandPTrace(
-        PTRACE_POKEUSER,
-        this->_spiedThread.getTid(),
-        offsetof(struct user, u_debugreg[7]),
-        dr7
-    );
-
     this->_isSet = false;
     return true;
 }
@@ -0,0 +1,124 @@
+#include <algorithm>
+
+#include "WrapScope.h"
+#include "Logger.h"
+
+WrapScope::WrapScope(Tracer &tracer, DynamicNamespace &spiedNamespace, const std::string &binName,
+                     std::string symbolName, void *original) :
+_tracer(tracer), _spiedNamespace(spiedNamespace), _symbolName(std::move(symbolName)), _original(original),
+_isValid(true), _target(nullptr)
+{
+    if(!binName.empty()) {
+        DynamicModule* dynamicModule = _spiedNamespace.load(binName);
+        if(dynamicModule == nullptr) {
+            error_log(binName << " cannot be found or loaded in the spied namespace");
+            _isValid = false;
+            return;
+        }
+
+        _slots = dynamicModule->getFunctionRelocations(_symbolName);
+    } else {
+        _spiedNamespace.iterateOverModule([this](DynamicModule& dynamicModule){
+            addModule(dynamicModule);
+            return true;
+        });
+    }
+
+    // A single module scope only follows the unloading of its module
+    bool isFollowingAdds = binName.empty();
+    _observerId = _spiedNamespace.addModuleObserver([this, isFollowingAdds](DynamicModule& dynamicModule,
+                                                                            DynamicNamespace::E_ModuleEvent event){
+        if(event == DynamicNamespace::MODULE_REMOVED)
+            removeModule(dynamicModule);
+        else if(isFollowingAdds)
+            addModule(dynamicModule);
+    });
+}
+
+WrapScope::~WrapScope() {
+    if(_observerId.has_value())
+        _spiedNamespace.removeModuleObserver(_observerId.value());
+
+    redirect(nullptr);
+}
+
+bool WrapScope::redirect(void *target) {
+    std::lock_guard lk(_mutex);
+    if(target == _target)
+        return true;
+
+    void* addr = target != nullptr ? target : _original;
+    std::vector<std::pair<void*, uint64_t>> words;
+    words.reserve(_slots.size());
+
+    for(auto slot : _slots)
+        words.emplace_back(slot, (uint64_t)addr);
+
+    if(!_tracer.patchWords(words)) {
+        error_log("Failed to patch the relocations of " << _symbolName);
+        return false;
+    }
+
+    _target = target;
+    return true;
+}
+
+bool WrapScope::empty() const {
+    std::lock_guard lk(_mutex);
+    return _slots.empty();
+}
+
+bool WrapScope::isValid() const {
+    return _isValid;
+}
+
+void WrapScope::addModule(DynamicModule &dynamicModule) {
+    std::lock_guard lk(_mutex);
+
+    auto slots = dynamicModule.getFunctionRelocations(_symbolName);
+    if(slots.empty())
+        return;
+
+    _slots.insert(_slots.end(), slots.begin(), slots.end());
+
+    if(_target != nullptr) {
+        std::vector<std::pair<void*, uint64_t>> words;
+        for(auto slot : slots)
+            words.emplace_back(slot, (uint64_t)_target);
+
+        if(!_tracer.patchWords(words))
+            error_log("Failed to patch the relocations of " << _symbolName << " in " << dynamicModule.getName());
+    }
+}
+
+void WrapScope::removeModule(DynamicModule &dynamicModule) {
+    std::lock_guard lk(_mutex);
+
+    auto isInScope = [this](uint64_t* slot){
+        return std::find(_slots.begin(), _slots.end(), slot) != _slots.end();
+    };
+
+    std::vector<uint64_t*> slots;
+    for(auto slot : dynamicModule.getFunctionRelocations(_symbolName)) {
+        if(isInScope(slot))
+            slots.push_back(slot);
+    }
+
+    if(slots.empty())
+        return;
+
+    // The module may stay mapped if the spied program holds it too
+    if(_target != nullptr) {
+        std::vector<std::pair<void*, uint64_t>> words;
+        for(auto slot : slots)
+            words.emplace_back(slot, (uint64_t)_original);
+
+        if(!_tracer.patchWords(words))
+            error_log("Failed to restore the relocations of " << _symbolName << " in " << dynamicModule.getName());
+    }
+
+    auto isRemoved = [&slots](uint64_t* slot){
+        return std::find(slots.begin(), slots.end(), slot) != slots.end();
+    };
+    _slots.erase(std::remove_if(_slots.begin(), _slots.end(), isRemoved), _slots.end());
+}
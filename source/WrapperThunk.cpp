@@ -0,0 +1,49 @@
+#include <cstdint>
+#include <cstring>
+
+#include "WrapperThunk.h"
+#include "Logger.h"
+
+thread_local void* wrapperThunkContext __attribute__((tls_model("initial-exec"))) = nullptr;
+
+namespace {
+    // Offset of wrapperThunkContext from the thread pointer, the same for every thread (static TLS)
+    int32_t getContextOffset() {
+        static const int32_t offset = []{
+            uint64_t threadPointer;
+            asm("mov %%fs:0, %0" : "=r"(threadPointer));
+            return (int32_t)((uint64_t)&wrapperThunkContext - threadPointer);
+        }();
+
+        return offset;
+    }
+}
+
+void *WrapperThunk::create(CodeArena &arena, void *context, void *dispatcher) {
+    void* thunk = arena.allocate(thunkSize, dispatcher);
+    if(thunk == nullptr) {
+        error_log("No memory available for the wrapper thunk of " << context);
+        return nullptr;
+    }
+
+    auto contextAddr = (uint64_t)context;
+    auto dispatcherAddr = (uint64_t)dispatcher;
+    int32_t offset = getContextOffset();
+
+    uint8_t code[thunkSize] = {
+        0x49, 0xBB, 0, 0, 0, 0, 0, 0, 0, 0,     // movabs $context, %r11
+        0x64, 0x4C, 0x89, 0x1C, 0x25, 0, 0, 0, 0, // mov %r11, %fs:offset
+        0x49, 0xBB, 0, 0, 0, 0, 0, 0, 0, 0,     // movabs $dispatcher, %r11
+        0x41, 0xFF, 0xE3                        // jmp *%r11
+    };
+    memcpy(&code[2], &contextAddr, sizeof(contextAddr));
+    memcpy(&code[15], &offset, sizeof(offset));
+    memcpy(&code[21], &dispatcherAddr, sizeof(dispatcherAddr));
+
+    if(!CodeArena::write(thunk, code, sizeof(code))) {
+        arena.release(thunk, thunkSize);
+        return nullptr;
+    }
+
+    return thunk;
+}
@@ -0,0 +1,366 @@
+#include <cstring>
+
+#include "X86Instruction.h"
+
+namespace {
+    typedef enum {
+        MODRM   = 1 << 0,
+        IMM8    = 1 << 1,
+        IMM16   = 1 << 2,
+        IMMZ    = 1 << 3,   // 16 or 32 bits depending on operand size
+        IMMV    = 1 << 4,   // 16, 32 or 64 bits depending on operand size
+        MOFFS   = 1 << 5,   // 32 or 64 bits depending on address size
+        INVALID = 1 << 6
+    } E_OpFlags;
+
+    uint32_t oneByteFlags(uint8_t op) {
+        if(op < 0x40) {
+            // Invalid in 64 bits mode : push/pop segment registers, BCD adjustments
+            switch(op) {
+                case 0x06: case 0x07: case 0x0E: case 0x16: case 0x17:
+                case 0x1E: case 0x1F: case 0x27: case 0x2F: case 0x37: case 0x3F:
+                    return INVALID;
+                default:
+                    break;
+            }
+
+            switch(op & 0x7) {
+                case 0x4: return IMM8;
+                case 0x5: return IMMZ;
+                default:  return MODRM;
+            }
+        }
+
+        if(op >= 0x50 && op <= 0x5F) return 0;
+        if(op >= 0x70 && op <= 0x7F) return IMM8;
+        if(op >= 0x84 && op <= 0x8F) return MODRM;
+        if(op >= 0x90 && op <= 0x9F) return op == 0x9A ? INVALID : 0;
+        if(op >= 0xB0 && op <= 0xB7) return IMM8;
+        if(op >= 0xB8 && op <= 0xBF) return IMMV;
+        if(op >= 0xD8 && op <= 0xDF) return MODRM;
+        if(op >= 0xE0 && op <= 0xE7) return IMM8;
+
+        switch(op) {
+            case 0x63: return MODRM;
+            case 0x68: return IMMZ;
+            case 0x69: return MODRM | IMMZ;
+            case 0x6A: return IMM8;
+            case 0x6B: return MODRM | IMM8;
+            case 0x6C: case 0x6D: case 0x6E: case 0x6F: return 0;
+            case 0x80: return MODRM | IMM8;
+            case 0x81: return MODRM | IMMZ;
+            case 0x83: return MODRM | IMM8;
+            case 0xA0: case 0xA1: case 0xA2: case 0xA3: return MOFFS;
+            case 0xA8: return IMM8;
+            case 0xA9: return IMMZ;
+            case 0xA4: case 0xA5: case 0xA6: case 0xA7:
+            case 0xAA: case 0xAB: case 0xAC: case 0xAD: case 0xAE: case 0xAF: return 0;
+            case 0xC0: case 0xC1: return MODRM | IMM8;
+            case 0xC2: return IMM16;
+            case 0xC3: return 0;
+            case 0xC6: return MODRM | IMM8;
+            case 0xC7: return MODRM | IMMZ;
+            case 0xC8: return IMM16 | IMM8;
+            case 0xC9: return 0;
+            case 0xCA: return IMM16;
+            case 0xCB: case 0xCC: return 0;
+            case 0xCD: return IMM8;
+            case 0xCF: return 0;
+            case 0xD0: case 0xD1: case 0xD2: case 0xD3: return MODRM;
+            case 0xD7: return 0;
+            case 0xE8: case 0xE9: return IMMZ;
+            case 0xEB: return IMM8;
+            case 0xEC: case 0xED: case 0xEE: case 0xEF: return 0;
+            case 0xF1: case 0xF4: case 0xF5: return 0;
+            case 0xF6: case 0xF7: return MODRM;     // Immediate only for test (/0 and /1)
+            case 0xF8: case 0xF9: case 0xFA: case 0xFB: case 0xFC: case 0xFD: return 0;
+            case 0xFE: case 0xFF: return MODRM;
+            default: return INVALID;
+        }
+    }
+
+    uint32_t twoByteFlags(uint8_t op) {
+        if(op >= 0x80 && op <= 0x8F) return IMMZ;
+        if(op >= 0xC8 && op <= 0xCF) return 0;
+
+        switch(op) {
+            case 0x04: case 0x0A: case 0x0C: case 0x24: case 0x25: case 0x26: case 0x27:
+            case 0x36: case 0x39: case 0x3B: case 0x3C: case 0x3D: case 0x3E: case 0x3F:
+            case 0xA6: case 0xA7:
+                return INVALID;
+            case 0x05: case 0x06: case 0x07: case 0x08: case 0x09: case 0x0B: case 0x0E:
+            case 0x30: case 0x31: case 0x32: case 0x33: case 0x34: case 0x35: case 0x37:
+            case 0x77: case 0xA0: case 0xA1: case 0xA2: case 0xA8: case 0xA9: case 0xAA:
+                return 0;
+            case 0x0F:
+            case 0x70: case 0x71: case 0x72: case 0x73:
+            case 0xA4: case 0xAC: case 0xBA:
+            case 0xC2: case 0xC4: case 0xC5: case 0xC6:
+                return MODRM | IMM8;
+            default:
+                return MODRM;
+        }
+    }
+
+    // VEX/EVEX encoded instructions of the 0F map taking an 8 bits immediate
+    bool hasMap1Imm8(uint8_t op) {
+        return (op >= 0x70 && op <= 0x73) || op == 0xC2 || (op >= 0xC4 && op <= 0xC6);
+    }
+
+    bool fitsInt32(int64_t val) {
+        return val >= INT32_MIN && val <= INT32_MAX;
+    }
+}
+
+bool X86Instruction::decode(const uint8_t *code, size_t maxLen, X86Instruction &instruction) {
+    if(maxLen > maxLength)
+        maxLen = maxLength;
+
+    instruction = X86Instruction();
+
+    bool isOpSize16 = false;
+    bool isAddrSize32 = false;
+    bool isRexW = false;
+    bool isRep = false;
+    size_t pos = 0;
+
+    for(; pos < maxLen; pos++) {
+        uint8_t prefix = code[pos];
+        if(prefix == 0x66) {
+            isOpSize16 = true;
+        } else if(prefix == 0x67) {
+            isAddrSize32 = true;
+        } else if(prefix == 0xF2 || prefix == 0xF3) {
+            isRep = true;
+        } else if(prefix != 0xF0 && prefix != 0x26 && prefix != 0x2E
+                  && prefix != 0x36 && prefix != 0x3E && prefix != 0x64 && prefix != 0x65) {
+            break;
+        }
+    }
+    instruction._prefixesLength = (uint8_t)pos;
+
+    if(pos < maxLen && (code[pos] & 0xF0) == 0x40) {
+        isRexW = (code[pos] & 0x8) != 0;
+        pos++;
+    }
+
+    if(pos >= maxLen)
+        return false;
+
+    uint8_t op = code[pos++];
+    uint32_t flags;
+    bool isOneByte = false;
+
+    if(op == 0x0F) {
+        if(pos >= maxLen)
+            return false;
+
+        uint8_t op2 = code[pos++];
+        if(op2 == 0x38) {
+            pos++;
+            flags = MODRM;
+        } else if(op2 == 0x3A) {
+            pos++;
+            flags = MODRM | IMM8;
+        } else {
+            flags = twoByteFlags(op2);
+            if(op2 >= 0x80 && op2 <= 0x8F) {
+                instruction._branch = JCC_REL;
+                instruction._condition = op2 & 0xF;
+            }
+        }
+    } else if(op == 0xC4 || op == 0xC5 || op == 0x62) {
+        // VEX (2 or 3 bytes) and EVEX (4 bytes) prefixes, always followed by an opcode and a ModRM
+        uint8_t map = 1;
+        if(op == 0xC4) {
+            if(pos >= maxLen) return false;
+            map = code[pos] & 0x1F;
+            pos += 2;
+        } else if(op == 0xC5) {
+            pos += 1;
+        } else {
+            if(pos >= maxLen) return false;
+            map = code[pos] & 0x7;
+            pos += 3;
+        }
+
+        if(pos >= maxLen)
+            return false;
+
+        uint8_t vexOp = code[pos++];
+        switch(map) {
+            case 1:
+                flags = (vexOp == 0x77 && op != 0x62) ? 0 : MODRM;
+                if(hasMap1Imm8(vexOp)) flags |= IMM8;
+                break;
+            case 2: case 5: case 6:
+                flags = MODRM;
+                break;
+            case 3:
+                flags = MODRM | IMM8;
+                break;
+            default:
+                return false;
+        }
+    } else {
+        isOneByte = true;
+        flags = oneByteFlags(op);
+
+        if(op >= 0x70 && op <= 0x7F) {
+            instruction._branch = JCC_REL;
+            instruction._condition = op & 0xF;
+        } else if(op >= 0xE0 && op <= 0xE3) {
+            instruction._branch = LOOP_REL;
+        } else if(op == 0xE8) {
+            instruction._branch = CALL_REL;
+        } else if(op == 0xE9 || op == 0xEB) {
+            instruction._branch = JMP_REL;
+        } else if(op == 0xC2 || op == 0xC3 || op == 0xCA || op == 0xCB) {
+            instruction._branch = RET;
+        }
+
+        // ins, outs, movs, cmps, stos, lods, scas
+        instruction._isRepeated = isRep && ((op >= 0x6C && op <= 0x6F) || (op >= 0xA4 && op <= 0xA7)
+                                            || (op >= 0xAA && op <= 0xAF));
+    }
+
+    if(flags & INVALID)
+        return false;
+
+    if(flags & MODRM) {
+        if(pos >= maxLen)
+            return false;
+
+        uint8_t modrm = code[pos++];
+        uint8_t mod = modrm >> 6;
+        uint8_t reg = (modrm >> 3) & 0x7;
+        uint8_t rm = modrm & 0x7;
+        size_t dispSize = 0;
+
+        if(mod != 3 && rm == 4) {
+            if(pos >= maxLen)
+                return false;
+            uint8_t sib = code[pos++];
+            if(mod == 0 && (sib & 0x7) == 5)
+                dispSize = 4;
+        }
+
+        if(mod == 0 && rm == 5) {
+            instruction._dispOffset = (uint8_t)pos;
+            dispSize = 4;
+        } else if(mod == 1) {
+            dispSize = 1;
+        } else if(mod == 2) {
+            dispSize = 4;
+        }
+        pos += dispSize;
+
+        if(isOneByte) {
+            if((op == 0xF6 || op == 0xF7) && reg < 2)
+                flags |= (op == 0xF6) ? IMM8 : IMMZ;
+
+            if(op == 0xFF) {
+                if(reg == 2 || reg == 3)
+                    instruction._branch = CALL_INDIRECT;
+                else if(reg == 4 || reg == 5)
+                    instruction._branch = JMP_INDIRECT;
+            }
+        }
+    }
+
+    size_t immSize = 0;
+    if(flags & IMM8)  immSize += 1;
+    if(flags & IMM16) immSize += 2;
+    if(flags & IMMZ)  immSize += isOpSize16 ? 2 : 4;
+    if(flags & IMMV)  immSize += isRexW ? 8 : (isOpSize16 ? 2 : 4);
+    if(flags & MOFFS) immSize += isAddrSize32 ? 4 : 8;
+
+    if(instruction._branch == JCC_REL || instruction._branch == JMP_REL ||
+       instruction._branch == CALL_REL || instruction._branch == LOOP_REL) {
+        // 16 bits branches behave differently on Intel and AMD
+        if(isOpSize16)
+            return false;
+
+        instruction._relOffset = (uint8_t)pos;
+        instruction._relSize = (uint8_t)immSize;
+    }
+
+    pos += immSize;
+    if(pos > maxLen)
+        return false;
+
+    if(instruction._relSize == 1) {
+        instruction._rel = (int8_t)code[instruction._relOffset];
+    } else if(instruction._relSize == 4) {
+        memcpy(&instruction._rel, &code[instruction._relOffset], sizeof(instruction._rel));
+    }
+
+    instruction._length = (uint8_t)pos;
+
+    return true;
+}
+
+uint64_t X86Instruction::getBranchTarget(uint64_t addr) const {
+    return addr + _length + static_cast<uint64_t>((int64_t)_rel);
+}
+
+size_t X86Instruction::relocate(const uint8_t *code, uint64_t from, uint64_t to, uint8_t *out) const {
+    size_t len = 0;
+
+    // A step runs one iteration and leaves rip on the copy, which maps back to the breakpoint
+    if(_isRepeated)
+        return 0;
+
+    switch(_branch) {
+        case JMP_REL:
+        case JCC_REL:
+        case CALL_REL: {
+            uint64_t target = getBranchTarget(from);
+
+            // Keep the prefixes (e.g. bnd, notrack), use a 32 bits displacement whatever the original size
+            memcpy(out, code, _prefixesLength);
+            len = _prefixesLength;
+
+            if(_branch == JMP_REL) {
+                out[len++] = 0xE9;
+            } else if(_branch == CALL_REL) {
+                out[len++] = 0xE8;
+            } else {
+                out[len++] = 0x0F;
+                out[len++] = 0x80 | _condition;
+            }
+
+            int64_t rel = (int64_t)(target - (to + len + sizeof(int32_t)));
+            if(!fitsInt32(rel))
+                return 0;
+
+            auto rel32 = (int32_t)rel;
+            memcpy(&out[len], &rel32, sizeof(rel32));
+            len += sizeof(rel32);
+            break;
+        }
+
+        case LOOP_REL:
+            return 0;
+
+        default: {
+            memcpy(out, code, _length);
+            len = _length;
+
+            if(_dispOffset != 0) {
+                int32_t disp;
+                memcpy(&disp, &code[_dispOffset], sizeof(disp));
+
+                int64_t newDisp = (int64_t)disp + (int64_t)(from - to);
+                if(!fitsInt32(newDisp))
+                    return 0;
+
+                disp = (int32_t)newDisp;
+                memcpy(&out[_dispOffset], &disp, sizeof(disp));
+            }
+            break;
+        }
+    }
+
+    return len;
+}
@@ -1,7 +1,13 @@
+#include <atomic>
+#include <cstddef>
 #include <cstdlib>
 #include <iostream>
+#include <mutex>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <vector>
 
+#include "CallReplayer.h"
 #include "SpiedProgram.h"
 #include "TestLib.h"
 
@@ -60,19 +66,294 @@ int main(int argc, char* argv[], char* envp[])
 
         prog.stop();
 
+        // Every thread reached the stop barrier, a single step leaves the thread stopped on the next instruction
+        if(mainThread->getState() != SpiedThread::STOPPED || lastCreatedThread->getState() != SpiedThread::STOPPED) {
+            std::cerr << "ERROR: threads are not stopped" << std::endl;
+            std::exit(1);
+        }
+
+        uint64_t ripBeforeStep = lastCreatedThread->getRip();
+        if(!lastCreatedThread->singleStep() || lastCreatedThread->getState() != SpiedThread::STOPPED
+           || lastCreatedThread->getRip() == ripBeforeStep) {
+            std::cerr << "ERROR: single step of thread " << lastCreatedThread->getTid() << " failed" << std::endl;
+            std::exit(1);
+        }
+
+        // Registers are read once per stop, a modified set is only visible through the cache until written back
+        {
+            RegisterCache& registers = lastCreatedThread->getRegisters();
+            user_regs_struct regs;
+            uint32_t mxcsr;
+            RegisterCache::Vec128 xmm, modifiedXmm = {0x0123456789ABCDEF, 0xFEDCBA9876543210}, readXmm;
+
+            if(!registers.getGprs(regs) || regs.rip != lastCreatedThread->getRip() || !registers.getMxcsr(mxcsr)
+               || !registers.getXmm(15, xmm) || !registers.setXmm(15, modifiedXmm) || !registers.getXmm(15, readXmm)
+               || readXmm.low != modifiedXmm.low || readXmm.high != modifiedXmm.high || !registers.setXmm(15, xmm)
+               || !registers.isDirty()) {
+                std::cerr << "ERROR: registers of thread " << lastCreatedThread->getTid() << " not cached" << std::endl;
+                std::exit(1);
+            }
+        }
+
+        // Steps run back to back by the tracer thread, a failed step cancels the following ones unless they are
+        // independent. Each step keeps its own result.
+        {
+            Tracer& tracer = prog.getTracer();
+            pid_t tid = lastCreatedThread->getTid();
+            uint64_t dr7Offset = offsetof(struct user, u_debugreg) + 7 * sizeof(user::u_debugreg[0]);
+
+            for(bool isIndependent : {false, true}) {
+                Tracer::Transaction transaction;
+                transaction.peekUser(tid, dr7Offset).peekUser(-1, dr7Offset).peekUser(tid, dr7Offset);
+                if(isIndependent)
+                    transaction.independent();
+
+                auto completion = tracer.commit(std::move(transaction));
+                Tracer::Result res = tracer.wait(completion);
+                auto results = completion.getResults();
+
+                if(results.size() != 3 || results[0].second != 0 || results[1].second != ESRCH
+                   || results[2].second != (isIndependent ? 0 : ECANCELED) || res.second != ESRCH) {
+                    std::cerr << "ERROR: unexpected results of a " << (isIndependent ? "independent " : "")
+                              << "transaction with a failed step" << std::endl;
+                    std::exit(1);
+                }
+            }
+        }
+
+        // Bulk transfers are scattered over several buffers. The part of a write process_vm_writev cannot do (read
+        // only page) goes through /proc/<pid>/mem.
+        {
+            Tracer& tracer = prog.getTracer();
+            uint64_t words[4] = {1, 2, 3, 4}, first[2] = {}, second[2] = {};
+            struct iovec local[] = {{first, sizeof(first)}, {second, sizeof(second)}};
+            struct iovec remote[] = {{words, sizeof(words)}};
+
+            auto pageSize = (size_t)sysconf(_SC_PAGESIZE);
+            auto pages = (uint8_t*)mmap(nullptr, 2 * pageSize, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            uint64_t written[2] = {0x1122334455667788, 0x99AABBCCDDEEFF00}, read[2] = {};
+            auto straddling = pages + pageSize - sizeof(written[0]);
+
+            if(tracer.readMemory(local, 2, remote, 1) != sizeof(words) || first[0] != 1 || first[1] != 2
+               || second[0] != 3 || second[1] != 4 || pages == MAP_FAILED
+               || mprotect(pages + pageSize, pageSize, PROT_READ) != 0
+               || tracer.writeMemory(straddling, written, sizeof(written)) != sizeof(written)
+               || tracer.readMemory(straddling, read, sizeof(read)) != sizeof(read)
+               || read[0] != written[0] || read[1] != written[1]) {
+                std::cerr << "ERROR: bulk memory transfers failed" << std::endl;
+                std::exit(1);
+            }
+
+            munmap(pages, 2 * pageSize);
+        }
+
+        // Both breakpoints are written by one transaction, each one is checked against its own step result
+        BreakPoint* otherBp = prog.createBreakPoint((void*)&testLibFunction, "testLibFunction");
+        std::vector<BreakPoint*> breakPoints = {bp, otherBp};
+
+        if(bp == nullptr || otherBp == nullptr || !BreakPoint::unsetAll(breakPoints)
+           || *(uint8_t*)&TestLibFunction2 == 0xCC || *(uint8_t*)&testLibFunction == 0xCC) {
+            std::cerr << "ERROR: breakpoints were not unset together" << std::endl;
+            std::exit(1);
+        }
+
+        uint8_t originalBytes[] = {*(uint8_t*)&TestLibFunction2, *(uint8_t*)&testLibFunction};
+        if(!BreakPoint::setAll(breakPoints)
+           || *(uint8_t*)&TestLibFunction2 != 0xCC || *(uint8_t*)&testLibFunction != 0xCC) {
+            std::cerr << "ERROR: breakpoints were not set together" << std::endl;
+            std::exit(1);
+        }
+
+        if(!BreakPoint::unsetAll(breakPoints)
+           || *(uint8_t*)&TestLibFunction2 != originalBytes[0] || *(uint8_t*)&testLibFunction != originalBytes[1]) {
+            std::cerr << "ERROR: breakpoints were not unset together" << std::endl;
+            std::exit(1);
+        }
+        prog.deleteBreakPoint(otherBp);
+
         auto f = prog.wrapFunction<testLibFunction>("TestProgram");
-        f->setWrapper([](int a){
+        std::atomic<uint64_t> wrapperCallNb(0);
+        std::mutex returnedMutex;
+        std::vector<int> returned;
+        f->setWrapper([&](int a){
+            wrapperCallNb++;
             std::cout<< "HELLO!" <<std::endl;
+
+            std::lock_guard lk(returnedMutex);
+            returned.push_back(a+2);
             return a+2;
         });
         f->wrapping(true);
+        f->profiling(true);
+        f->startRecording("testLibFunction.rec");
 
         prog.resume();
         sleep(5);
+
+        prog.stop();
+
+        for(auto& report : prog.getProfile())
+            std::cout << report.name << " : " << report.callNb << " calls, p50 " << report.p50Ns << "ns, p99 "
+                      << report.p99Ns << "ns" << std::endl;
+
+        // Every call went through the wrapper, the one a stopped thread may be running is not recorded yet
+        CallProfiler::Report report = f->getProfiler().getReport();
+        if(report.callNb == 0 || report.callNb > wrapperCallNb || wrapperCallNb - report.callNb > 1
+           || report.p50Ns > report.p99Ns || report.p99Ns > report.maxNs) {
+            std::cerr << "ERROR: profiled " << report.callNb << " calls, the wrapper was called "
+                      << wrapperCallNb << " times" << std::endl;
+            std::exit(1);
+        }
+
+        f->stopRecording();
+
+        // The file holds the values returned by the wrapper, in the same order
+        {
+            std::lock_guard lk(returnedMutex);
+            CallReplayer recorded("testLibFunction.rec", sizeof(int), sizeof(int));
+            if(recorded.getRecordNb() == 0 || recorded.getRecordNb() > returned.size()
+               || returned.size() - recorded.getRecordNb() > 1) {
+                std::cerr << "ERROR: recorded " << recorded.getRecordNb() << " calls out of " << returned.size()
+                          << std::endl;
+                std::exit(1);
+            }
+
+            for(uint64_t idx = 0; idx < recorded.getRecordNb(); idx++) {
+                int ret;
+                if(!recorded.next(&ret) || ret != returned[idx]) {
+                    std::cerr << "ERROR: record " << idx << " does not hold " << returned[idx] << std::endl;
+                    std::exit(1);
+                }
+            }
+        }
+
+        // The recorded results are served back in the same order, without calling the wrapper
+        uint64_t recordedCallNb = wrapperCallNb;
+        f->startReplay("testLibFunction.rec");
+        prog.resume();
+        sleep(1);
         prog.stop();
+        f->stopReplay();
+
+        if(wrapperCallNb != recordedCallNb) {
+            std::cerr << "ERROR: the wrapper was called while replaying" << std::endl;
+            std::exit(1);
+        }
 
         f->wrapping(false);
 
+        // First line of testLibFunction, called by the spied thread loop
+        std::atomic<uint64_t> lineHitNb(0);
+        BreakPoint* lineBp = prog.createBreakPoint("BasicTest/TestLib.cpp", 14);
+        if(lineBp == nullptr || DynamicModule::getMangledName(lineBp->getAddr()) != "_Z15testLibFunctioni") {
+            std::cerr << "ERROR: TestLib.cpp:14 is not resolved in testLibFunction" << std::endl;
+            std::exit(1);
+        }
+
+        // Stepped out of line, the breakpoint stays armed : a thread looping over it hits it again
+        std::atomic<uint64_t> lineStepFailureNb(0);
+        lineBp->setOnHitCallback([&lineHitNb, &lineStepFailureNb](BreakPoint& bp, SpiedThread& sp){
+            lineHitNb++;
+            if(!bp.resumeAndSet(sp))
+                lineStepFailureNb++;
+        });
+        lineBp->set();
+
+        prog.resume();
+        sleep(5);
+
+        // Deleted while being hit, the callbacks already queued keep it alive and it is not set back afterwards
+        auto lineAddr = (uint8_t*)lineBp->getAddr();
+        if(lineHitNb < 2 || lineStepFailureNb != 0 || !prog.deleteBreakPoint(lineBp)) {
+            std::cerr << "ERROR: TestLib.cpp:14 was hit " << lineHitNb << " times, " << lineStepFailureNb
+                      << " steps over it failed" << std::endl;
+            std::exit(1);
+        }
+
+        sleep(1);
+        prog.stop();
+
+        uint64_t lineHitNbAfterDelete = lineHitNb;
+        prog.resume();
+        sleep(1);
+        prog.stop();
+
+        if(*lineAddr == 0xCC || lineHitNb != lineHitNbAfterDelete) {
+            std::cerr << "ERROR: TestLib.cpp:14 is still hit after its deletion" << std::endl;
+            std::exit(1);
+        }
+
+        // Called on the spied thread, which passes the previous result (a + 1) back to testLibFunction
+        struct TraceData {
+            std::atomic<uint64_t> hitNb;
+            std::atomic<uint64_t> lastArg;
+            std::atomic<uint64_t> unexpectedArgNb;
+        } traceData{};
+
+        FastTracePoint* tracePoint = prog.createFastTracePoint((void*)&testLibFunction, "testLibFunction",
+                [](FastTracePoint&, FastTracePoint::Context& context, void* data){
+            auto traceData = static_cast<TraceData*>(data);
+            uint64_t arg = (uint32_t)context.rdi;
+            if(traceData->hitNb++ != 0 && arg != traceData->lastArg + 1)
+                traceData->unexpectedArgNb++;
+            traceData->lastArg = arg;
+        }, &traceData);
+
+        if(tracePoint == nullptr || !tracePoint->set()) {
+            std::cerr << "ERROR: tracepoint cannot be set on testLibFunction" << std::endl;
+            std::exit(1);
+        }
+
+        // Wrapped by name through the generic trampoline, the spied thread loop sleeps 2 seconds after each call
+        std::atomic<uint64_t> loopSleepNb(0);
+        SymbolWrapper* sleepWrapper = prog.wrapFunction("TestProgram", "sleep",
+                [&loopSleepNb](SymbolWrapper::CallContext& context){
+            if((uint32_t)context.getArg(0) == 2)
+                loopSleepNb++;
+            return SymbolWrapper::CALL_ORIGINAL;
+        });
+
+        if(sleepWrapper == nullptr || !sleepWrapper->wrapping(true)) {
+            std::cerr << "ERROR: sleep cannot be wrapped by name in TestProgram" << std::endl;
+            std::exit(1);
+        }
+
+        // Wrapped in every module of the namespace : testLibFunction prints b (87) from libTestLib, not TestProgram
+        std::atomic<uint64_t> printedBNb(0);
+        SymbolWrapper* printWrapper = prog.wrapFunction("", "_ZNSolsEi",
+                [&printedBNb](SymbolWrapper::CallContext& context){
+            if((uint32_t)context.getArg(1) == 87)
+                printedBNb++;
+            return SymbolWrapper::CALL_ORIGINAL;
+        });
+
+        if(printWrapper == nullptr || !printWrapper->wrapping(true)) {
+            std::cerr << "ERROR: std::ostream::operator<<(int) cannot be wrapped in the whole namespace" << std::endl;
+            std::exit(1);
+        }
+
+        prog.resume();
+        sleep(5);
+        prog.stop();
+
+        prog.unwrapFunction("TestProgram", "sleep");
+        prog.unwrapFunction("", "_ZNSolsEi");
+        if(loopSleepNb < 2 || printedBNb < 2) {
+            std::cerr << "ERROR: sleep wrapper was called " << loopSleepNb << " times by the spied thread loop, "
+                      << "std::ostream::operator<<(int) wrapper " << printedBNb << " times by testLibFunction"
+                      << std::endl;
+            std::exit(1);
+        }
+
+        if(traceData.hitNb < 2 || tracePoint->getHitNb() != traceData.hitNb || traceData.unexpectedArgNb != 0
+           || !prog.deleteFastTracePoint(tracePoint)) {
+            std::cerr << "ERROR: tracepoint on testLibFunction was hit " << traceData.hitNb << " times ("
+                      << tracePoint->getHitNb() << " counted), " << traceData.unexpectedArgNb
+                      << " unexpected arguments" << std::endl;
+            std::exit(1);
+        }
+
         WatchPoint* wp = lastCreatedThread->createWatchPoint();
         wp->setOnHit([](WatchPoint& wp, SpiedThread& sp){
             std::cout << "Watchpoint hit" << std::endl;
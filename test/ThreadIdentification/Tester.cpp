@@ -1,3 +1,5 @@
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
 #include "SpiedProgram.h"
 #include "TestedLib.h"
@@ -12,12 +14,18 @@ int main(int argc, char* argv[], char* envp[])
     try{
         SpiedProgram sp(argv[1]);
 
-        sp.setThreadCreationCallback([](SpiedThread& sp){
+        // Single-threaded engine : the events are waited for and the callbacks run by the tracer thread
+        Tracer& tracer = sp.getTracer();
+        std::atomic<uint32_t> outOfTracerNb(0);
+
+        sp.setThreadCreationCallback([&tracer, &outOfTracerNb](SpiedThread& sp){
+            if(!tracer.isTracerThread())
+                outOfTracerNb++;
             sp.resume();
         });
 
         std::cerr << "START" << std::endl;
-        sp.start();
+        sp.start(SpiedProgram::SINGLE_THREADED);
 
         sleep(1);
 
@@ -35,9 +43,11 @@ int main(int argc, char* argv[], char* envp[])
         SpiedThread* st3 = nullptr;
         SpiedThread* st4 = nullptr;
 
-        auto idThread = []( SpiedThread*& psp){
-            return [&psp]( BreakPoint& bp, SpiedThread& sp) {
+        auto idThread = [&tracer, &outOfTracerNb]( SpiedThread*& psp){
+            return [&psp, &tracer, &outOfTracerNb]( BreakPoint& bp, SpiedThread& sp) {
                 std::cout << "BREAKPOINT" << std::endl;
+                if(!tracer.isTracerThread())
+                    outOfTracerNb++;
                 psp = &sp;
                 bp.resumeAndUnset(sp);
             };
@@ -62,6 +72,13 @@ int main(int argc, char* argv[], char* envp[])
         sp.resume();
         sleep(3);
 
+        if(st1 == nullptr || st3 == nullptr || st4 == nullptr || st1 == st3 || st1 == st4 || st3 == st4
+           || outOfTracerNb != 0) {
+            std::cerr << "ERROR: threads not identified by the tracer thread (" << outOfTracerNb
+                      << " callbacks run by another thread)" << std::endl;
+            std::exit(1);
+        }
+
         std::cerr << "TERMINATE" << std::endl;
         sp.terminate();
 
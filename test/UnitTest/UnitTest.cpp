@@ -0,0 +1,727 @@
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <map>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/auxv.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "CodeArena.h"
+#include "ElfFile.h"
+#include "FastTracePoint.h"
+#include "MemoryPatcher.h"
+#include "ModuleIndex.h"
+#include "ModulePrewarmer.h"
+#include "MpscRing.h"
+#include "WrapperThunk.h"
+#include "X86Instruction.h"
+#include "helpers/FlatHashMap.h"
+#include "helpers/Rcu.h"
+#include "helpers/StringInterner.h"
+
+// Focused checks of the building blocks usable without a spied program, the first failed one exits
+
+static void check(bool condition, const std::string& what) {
+    if(!condition) {
+        std::cerr << "ERROR: " << what << std::endl;
+        std::exit(1);
+    }
+}
+
+static int getProtection(const void* addr) {
+    FILE* maps = fopen("/proc/self/maps", "r");
+    char line[512];
+    int prot = -1;
+
+    while(maps != nullptr && fgets(line, sizeof(line), maps) != nullptr) {
+        uint64_t begin, end;
+        char perms[5];
+        if(sscanf(line, "%lx-%lx %4s", &begin, &end, perms) == 3 && (uint64_t)addr >= begin && (uint64_t)addr < end)
+            prot = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0) | (perms[2] == 'x' ? PROT_EXEC : 0);
+    }
+
+    if(maps != nullptr)
+        fclose(maps);
+
+    return prot;
+}
+
+// Link map of a loaded module (of the executable if name is nullptr)
+static struct link_map* getLinkMap(const char* name) {
+    void* handle = dlopen(name, RTLD_LAZY | RTLD_NOLOAD);
+    struct link_map* lm = nullptr;
+
+    if(handle != nullptr) {
+        if(dlinfo(handle, RTLD_DI_LINKMAP, &lm) != 0)
+            lm = nullptr;
+        dlclose(handle);
+    }
+
+    return lm;
+}
+
+static void testMemoryPatcher() {
+    const auto pageSize = (size_t)sysconf(_SC_PAGE_SIZE);
+    auto pages = (uint8_t*)mmap(nullptr, 2 * pageSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    check(pages != MAP_FAILED, "mmap failed");
+
+    // A word straddling two pages of different protections
+    uint64_t val = 0x1122334455667788;
+    mprotect(pages + pageSize, pageSize, PROT_READ | PROT_EXEC);
+    check(MemoryPatcher::write(pages + pageSize - 4, &val, sizeof(val)), "straddling write failed");
+    check(*(uint64_t*)(pages + pageSize - 4) == val, "straddling write not stored");
+    check(getProtection(pages) == PROT_READ && getProtection(pages + pageSize) == (PROT_READ | PROT_EXEC),
+          "protections not restored after a straddling write");
+
+    // Protections changed by the program itself between two batches are the ones restored
+    mprotect(pages, pageSize, PROT_READ | PROT_EXEC);
+    check(MemoryPatcher::Batch().writeByte(pages, 0xCC).writeByte(pages + pageSize, 0xCC).commit(), "batch failed");
+    check(pages[0] == 0xCC && pages[pageSize] == 0xCC, "batch not stored");
+    check(getProtection(pages) == (PROT_READ | PROT_EXEC), "stale protection restored");
+
+    munmap(pages + pageSize, pageSize);
+    check(!MemoryPatcher::write(pages + pageSize, &val, 1), "write to an unmapped page succeeded");
+
+    munmap(pages, pageSize);
+}
+
+// Decode the relocated copy of code (located at from) and check that it still branches to target
+static void checkRelocatedBranch(const std::vector<uint8_t>& code, uint64_t from, uint64_t to, uint64_t target,
+                                 const std::string& name) {
+    X86Instruction instruction, relocatedInstruction;
+    uint8_t relocated[X86Instruction::maxRelocatedLength];
+
+    check(X86Instruction::decode(code.data(), code.size(), instruction) && instruction.getLength() == code.size(),
+          name + " not decoded");
+    check(instruction.getBranchTarget(from) == target, name + " target");
+
+    size_t len = instruction.relocate(code.data(), from, to, relocated);
+    check(len != 0 && X86Instruction::decode(relocated, len, relocatedInstruction)
+          && relocatedInstruction.getLength() == len && relocatedInstruction.getBranch() == instruction.getBranch()
+          && relocatedInstruction.getBranchTarget(to) == target, name + " not relocated");
+}
+
+static void testX86Instruction() {
+    const uint64_t from = 0x400000, to = 0x7F0000;
+
+    // rel8 branches are relocated with a rel32 displacement
+    checkRelocatedBranch({0xEB, 0x10}, from, to, from + 2 + 0x10, "jmp rel8");
+    checkRelocatedBranch({0x74, 0xF0}, from, to, from + 2 - 0x10, "je rel8");
+    checkRelocatedBranch({0x0F, 0x85, 0x00, 0x01, 0x00, 0x00}, from, to, from + 6 + 0x100, "jne rel32");
+    checkRelocatedBranch({0xE8, 0x00, 0x10, 0x00, 0x00}, from, to, from + 5 + 0x1000, "call rel32");
+
+    X86Instruction instruction;
+    uint8_t relocated[X86Instruction::maxRelocatedLength];
+
+    // mov rax, [rip + 0x10] : the displacement is adjusted to reach the same address
+    const uint8_t movRip[] = {0x48, 0x8B, 0x05, 0x10, 0x00, 0x00, 0x00};
+    check(X86Instruction::decode(movRip, sizeof(movRip), instruction) && instruction.getLength() == sizeof(movRip)
+          && instruction.isRipRelative(), "mov [rip] not decoded");
+
+    int32_t disp;
+    check(instruction.relocate(movRip, from, to, relocated) == sizeof(movRip), "mov [rip] not relocated");
+    memcpy(&disp, &relocated[3], sizeof(disp));
+    check(to + sizeof(movRip) + (uint64_t)(int64_t)disp == from + sizeof(movRip) + 0x10, "mov [rip] displacement");
+    check(instruction.relocate(movRip, from, from + 0x100000000, relocated) == 0, "out of reach [rip] relocated");
+
+    // VEX (2 and 3 bytes) and EVEX encodings
+    const std::vector<std::pair<std::vector<uint8_t>, bool>> vexCodes = {
+            {{0xC5, 0xF8, 0x77}, false},                                                  // vzeroupper
+            {{0xC4, 0xE2, 0x79, 0x18, 0x05, 0x00, 0x00, 0x00, 0x00}, true},               // vbroadcastss xmm0, [rip]
+            {{0x62, 0xF1, 0x7C, 0x48, 0x10, 0x05, 0x00, 0x00, 0x00, 0x00}, true},         // vmovups zmm0, [rip]
+            {{0xC5, 0xF9, 0x70, 0x0D, 0x00, 0x00, 0x00, 0x00, 0x01}, true}                // vpshufd xmm1, [rip], 1
+    };
+    for(auto& vexCode : vexCodes) {
+        check(X86Instruction::decode(vexCode.first.data(), vexCode.first.size(), instruction)
+              && instruction.getLength() == vexCode.first.size() && instruction.isRipRelative() == vexCode.second,
+              "VEX/EVEX instruction not decoded");
+    }
+
+    // loop has no rel32 form, a repeated string instruction would be stepped one iteration at a time
+    const uint8_t loop[] = {0xE2, 0xFE};
+    check(X86Instruction::decode(loop, sizeof(loop), instruction) && instruction.getBranch() == X86Instruction::LOOP_REL
+          && instruction.relocate(loop, from, to, relocated) == 0, "loop relocated");
+
+    const uint8_t repMovsb[] = {0xF3, 0xA4};
+    check(X86Instruction::decode(repMovsb, sizeof(repMovsb), instruction) && instruction.isRepeated()
+          && instruction.relocate(repMovsb, from, to, relocated) == 0, "rep movsb relocated");
+
+    // F3 is a mandatory prefix here, not a repetition (movss xmm0, [rip])
+    const uint8_t movss[] = {0xF3, 0x0F, 0x10, 0x05, 0x00, 0x00, 0x00, 0x00};
+    check(X86Instruction::decode(movss, sizeof(movss), instruction) && !instruction.isRepeated()
+          && instruction.relocate(movss, from, to, relocated) == sizeof(movss), "movss not relocated");
+
+    // Truncated instruction
+    check(!X86Instruction::decode(movRip, sizeof(movRip) - 1, instruction), "truncated instruction decoded");
+}
+
+// tracedFunction(a, b) returns a + b + xmm0, or -1 if the carry flag was set on entry. Its first 6 bytes (lea, jc)
+// are covered by the tracepoint jump, the jc is relocated with a rel32 displacement.
+// callTraced(a, b, xmm0, carry) sets xmm0 and the carry flag before jumping to it.
+// selfBranchFunction has a covered branch into its own covered bytes.
+extern "C" int64_t callTraced(uint64_t a, uint64_t b, uint64_t xmm0, uint64_t carry);
+extern "C" void tracedFunction();
+extern "C" void selfBranchFunction();
+asm(R"(
+    .text
+    .p2align 4
+callTraced:
+    movq %rdx, %xmm0
+    test %rcx, %rcx
+    jz 1f
+    stc
+1:  jmp tracedFunction
+
+    .p2align 4
+tracedFunction:
+    lea (%rdi, %rsi), %rax
+    jc 2f
+    movq %xmm0, %rdx
+    add %rdx, %rax
+    ret
+2:  mov $-1, %rax
+    ret
+
+    .p2align 4
+selfBranchFunction:
+    nop
+    nop
+    jne selfBranchFunction + 1
+    nop
+    ret
+)");
+
+struct TraceData {
+    uint64_t callNb;
+    uint64_t rdi;
+    uint64_t rsi;
+    uint64_t newRsi;
+};
+
+static void traceCallback(FastTracePoint&, FastTracePoint::Context& context, void* data) {
+    auto traceData = static_cast<TraceData*>(data);
+    traceData->callNb++;
+    traceData->rdi = context.rdi;
+    traceData->rsi = context.rsi;
+    if(traceData->newRsi != 0)
+        context.rsi = traceData->newRsi;
+
+    // Clobber the flags and a vector register, the trampoline restores them
+    asm volatile("pxor %%xmm0, %%xmm0\n\tcmp %%rsp, %%rsp" ::: "xmm0", "cc");
+}
+
+static void testFastTracePoint() {
+    CodeArena arena;
+    TraceData data = {};
+
+    bool isRejected = false;
+    try {
+        FastTracePoint straddling(arena, "straddling", (uint8_t*)&tracedFunction + 4, traceCallback, &data);
+    } catch(std::invalid_argument&) {
+        isRejected = true;
+    }
+    check(isRejected, "tracepoint jump straddling two words accepted");
+
+    isRejected = false;
+    try {
+        FastTracePoint selfBranch(arena, "selfBranch", (void*)&selfBranchFunction, traceCallback, &data);
+    } catch(std::invalid_argument&) {
+        isRejected = true;
+    }
+    check(isRejected, "tracepoint over a branch into the covered bytes accepted");
+
+    FastTracePoint tracePoint(arena, "tracedFunction", (void*)&tracedFunction, traceCallback, &data);
+    check(tracePoint.set(), "tracepoint not set");
+
+    // Arguments seen by the callback, vector registers and flags restored, relocated jc taken or not
+    check(callTraced(2, 3, 10, 0) == 15 && data.callNb == 1 && data.rdi == 2 && data.rsi == 3,
+          "traced call without carry");
+    check(callTraced(2, 3, 10, 1) == -1 && data.callNb == 2, "traced call with carry");
+
+    // Registers modified by the callback are applied on return
+    data.newRsi = 4;
+    check(callTraced(2, 3, 10, 0) == 16 && data.callNb == 3, "register modified by the callback");
+    data.newRsi = 0;
+
+    check(tracePoint.getHitNb() == 3, "tracepoint hit count");
+
+    check(tracePoint.unset() && callTraced(2, 3, 10, 0) == 15 && data.callNb == 3 && tracePoint.getHitNb() == 3,
+          "tracepoint still hit once unset");
+}
+
+// Returns its argument plus the context set by the thunk which jumped to it
+static int64_t thunkDispatcher(int64_t arg) {
+    return arg + (int64_t)WrapperThunk::getContext();
+}
+
+static void testWrapperThunk() {
+    CodeArena arena;
+
+    using ThunkType = int64_t(*)(int64_t);
+    auto firstThunk = (ThunkType)WrapperThunk::create(arena, (void*)100, (void*)&thunkDispatcher);
+    auto secondThunk = (ThunkType)WrapperThunk::create(arena, (void*)200, (void*)&thunkDispatcher);
+    check(firstThunk != nullptr && secondThunk != nullptr, "wrapper thunks not created");
+
+    // Arguments are passed untouched, each thunk sets its own context
+    check(firstThunk(5) == 105 && secondThunk(5) == 205 && firstThunk(-5) == 95, "wrapper thunk context");
+}
+
+static void testMpscRing() {
+    struct Record {
+        uint32_t producer;
+        uint32_t seq;
+    };
+
+    static const uint32_t producerNb = 4;
+    static const uint32_t recordNb = 10000;
+    static const size_t capacity = 64;
+    MpscRing<Record, capacity> ring;
+
+    // A full ring rejects the push, the records come out in order
+    for(uint32_t idx = 0; idx < capacity; idx++)
+        check(ring.tryPush({0, idx}), "push to a ring which is not full");
+    Record record{};
+    check(!ring.tryPush(record), "push to a full ring");
+    for(uint32_t idx = 0; idx < capacity; idx++)
+        check(ring.tryPop(record) && record.seq == idx, "pop in push order");
+    check(ring.empty() && !ring.tryPop(record), "pop from an empty ring");
+
+    // Concurrent producers : every record is received once, in the order of its producer
+    std::vector<std::thread> producers;
+    for(uint32_t producer = 0; producer < producerNb; producer++) {
+        producers.emplace_back([&ring, producer]{
+            for(uint32_t seq = 0; seq < recordNb; seq++) {
+                while(!ring.tryPush({producer, seq}))
+                    std::this_thread::yield();
+            }
+        });
+    }
+
+    uint32_t nextSeq[producerNb] = {};
+    bool isOrdered = true;
+    for(uint64_t received = 0; received < (uint64_t)producerNb * recordNb;) {
+        if(!ring.tryPop(record)) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        isOrdered = isOrdered && record.producer < producerNb && record.seq == nextSeq[record.producer];
+        if(record.producer < producerNb)
+            nextSeq[record.producer]++;
+        received++;
+    }
+
+    for(auto& producer : producers)
+        producer.join();
+
+    check(isOrdered && ring.empty(), "records of concurrent producers lost, duplicated or reordered");
+}
+
+static void testFlatHashMap() {
+    FlatHashMap<void*, uint64_t> map;
+    std::map<void*, uint64_t> reference;
+
+    // Aligned addresses, as breakpoints, growing the table several times
+    check(map.find(nullptr) == nullptr && !map.erase(nullptr), "lookup in an empty map");
+    for(uint64_t idx = 0; idx < 1000; idx++) {
+        auto key = (void*)(0x400000 + idx * 16);
+        check(map.emplace(key, idx * 3).second, "insertion of a new key");
+        reference.emplace(key, idx * 3);
+    }
+    check(!map.emplace((void*)0x400000, 42).second && *map.find((void*)0x400000) == 0, "insertion of an existing key");
+
+    // Removals shift the following entries of their cluster back, every other key must stay reachable
+    for(uint64_t idx = 0; idx < 1000; idx += 3) {
+        auto key = (void*)(0x400000 + idx * 16);
+        check(map.erase(key) && !map.erase(key), "removal of a key");
+        reference.erase(key);
+    }
+
+    bool isConsistent = map.size() == reference.size();
+    for(uint64_t idx = 0; idx < 1000; idx++) {
+        auto key = (void*)(0x400000 + idx * 16);
+        auto it = reference.find(key);
+        uint64_t* val = map.find(key);
+        isConsistent = isConsistent && (it == reference.end() ? val == nullptr : val != nullptr && *val == it->second);
+    }
+    check(isConsistent, "lookups after removals");
+
+    size_t visitedNb = 0;
+    map.forEach([&visitedNb](void*, uint64_t&){ visitedNb++; });
+    check(visitedNb == reference.size(), "iteration over the entries");
+
+    map.clear();
+    check(map.empty() && map.find((void*)0x400010) == nullptr, "cleared map");
+}
+
+static bool isInReach(const void* addr, const void* near) {
+    auto distance = (uint64_t)addr > (uint64_t)near ? (uint64_t)addr - (uint64_t)near : (uint64_t)near - (uint64_t)addr;
+    return distance <= CodeArena::reach;
+}
+
+static void testCodeArena() {
+    CodeArena arena;
+    int stackVariable = 0;
+
+    // Blocks are aligned, executable and in reach of the code (or of the stack) they are allocated for
+    auto near = (const void*)&testCodeArena;
+    auto first = (uint8_t*)arena.allocate(100, near);
+    auto second = (uint8_t*)arena.allocate(100, near);
+    auto farAway = arena.allocate(16, &stackVariable);
+    check(first != nullptr && second != nullptr && farAway != nullptr, "code arena allocation");
+    check((uint64_t)first % 16 == 0 && (second >= first + 100 || first >= second + 100),
+          "code arena blocks aligned and disjoint");
+    check(isInReach(first, near) && isInReach(second, near) && isInReach(farAway, &stackVariable),
+          "code arena blocks in reach");
+    check(getProtection(first) == (PROT_READ | PROT_EXEC), "code arena protection");
+
+    // mov $42, %eax ; ret
+    const uint8_t code[] = {0xB8, 42, 0, 0, 0, 0xC3};
+    check(CodeArena::write(first, code, sizeof(code)) && ((int(*)())first)() == 42, "code written to the arena");
+
+    // A released block is given back for the same size
+    arena.release(first, 100);
+    check(arena.allocate(100, near) == first, "released block reused");
+}
+
+static void testRcu() {
+    Rcu rcu;
+
+    // synchronize waits for the reader already in its read section
+    std::atomic<bool> isSynchronized(false);
+    std::thread writer;
+    {
+        Rcu::ReadGuard guard(rcu);
+        writer = std::thread([&rcu, &isSynchronized]{
+            rcu.synchronize();
+            isSynchronized = true;
+        });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        check(!isSynchronized, "synchronize returned while a reader was in its read section");
+    }
+    writer.join();
+    check(isSynchronized, "synchronize did not return");
+
+    // A replaced value is poisoned after the grace period, no reader may see it
+    std::atomic<uint64_t*> published(new uint64_t(1));
+    std::atomic<bool> isStopped(false);
+    std::atomic<uint64_t> poisonedNb(0);
+    std::vector<uint64_t*> replaced;
+
+    std::vector<std::thread> readers;
+    for(uint32_t idx = 0; idx < 2; idx++) {
+        readers.emplace_back([&]{
+            while(!isStopped) {
+                Rcu::ReadGuard guard(rcu);
+                if(*published.load() != 1)
+                    poisonedNb++;
+            }
+        });
+    }
+
+    for(uint32_t idx = 0; idx < 1000; idx++) {
+        uint64_t* previous = published.exchange(new uint64_t(1));
+        rcu.synchronize();
+        *previous = 0;
+        replaced.push_back(previous);
+    }
+
+    isStopped = true;
+    for(auto& reader : readers)
+        reader.join();
+
+    check(poisonedNb == 0, "value used after its grace period");
+
+    delete published.load();
+    for(auto value : replaced)
+        delete value;
+}
+
+static void testRelocationIndex() {
+    StringInterner interner;
+    uint32_t firstId = interner.intern("first");
+    uint32_t secondId = interner.intern("second");
+    check(firstId != secondId && interner.intern("first") == firstId && interner.find("second") == secondId
+          && interner.get(secondId) == "second" && interner.find("third") == StringInterner::invalidId,
+          "interned strings");
+
+    // Relocations of mprotect (called by MemoryPatcher) in the executable, in the order of its relocation tables
+    auto elf = ElfFile::getElfFile("");
+    auto dynsym = elf->getDynSymTab();
+    auto dynstr = elf->getDynStrTab();
+
+    std::vector<Elf64_Addr> expected;
+    for(auto& table : elf->getRela()) {
+        for(auto& rela : table) {
+            auto symbIdx = ELF64_R_SYM(rela.r_info);
+            if(symbIdx != 0 && symbIdx < dynsym.size() && strcmp(&dynstr[dynsym[symbIdx].st_name], "mprotect") == 0)
+                expected.push_back(rela.r_offset);
+        }
+    }
+
+    uint32_t symbolId = ElfFile::getSymbolNames().intern("mprotect");
+    std::vector<Elf64_Addr> offsets;
+    bool isSameSymbol = true;
+    for(auto& rela : elf->getSymbolRelocations(symbolId)) {
+        offsets.push_back(rela.offset);
+        isSameSymbol = isSameSymbol && elf->getSymbolId(rela) == symbolId;
+    }
+
+    check(!expected.empty() && offsets == expected && isSameSymbol, "relocations indexed by symbol");
+    check(elf->getSymbolRelocations(ElfFile::getSymbolNames().intern("notRelocated")).empty(),
+          "relocations of a symbol which is not relocated");
+}
+
+static void testSymbolLookup() {
+    struct link_map* libc = getLinkMap("libc.so.6");
+    struct link_map* libstdcxx = getLinkMap("libstdc++.so.6");
+    struct link_map* executable = getLinkMap(nullptr);
+    check(libc != nullptr && libstdcxx != nullptr && executable != nullptr, "link maps of the loaded modules");
+
+    // Dynamic symbols are looked up through .gnu.hash, only the defined ones are returned
+    auto libcElf = ElfFile::getElfFile(libc->l_name);
+    for(auto name : {"process_vm_readv", "mprotect", "getpid"}) {
+        const Elf64_Sym* symb = libcElf->getDefinedDynSym(name);
+        check(symb != nullptr && (void*)(libc->l_addr + symb->st_value) == dlsym(RTLD_DEFAULT, name),
+              std::string("lookup of the dynamic symbol ") + name);
+    }
+    check(libcElf->getDefinedDynSym("notASymbol") == nullptr, "lookup of a missing dynamic symbol");
+    check(ElfFile::getElfFile(libstdcxx->l_name)->getDefinedDynSym("malloc") == nullptr,
+          "lookup of an undefined dynamic symbol");
+
+    // The other symbols are looked up through the hash index of .symtab
+    const Elf64_Sym* symb = ElfFile::getElfFile("")->getDefinedSym("_ZL16testSymbolLookupv");
+    check(symb != nullptr && executable->l_addr + symb->st_value == (uint64_t)&testSymbolLookup,
+          "lookup of a .symtab symbol");
+}
+
+static void testModuleIndex() {
+    struct link_map* executable = getLinkMap(nullptr);
+    struct link_map* libc = getLinkMap("libc.so.6");
+    ModuleIndex index;
+    ModuleIndex::Location location{};
+
+    // The executable heads the default namespace, its local symbols come from .symtab
+    index.addNamespace(executable);
+    auto addr = (const uint8_t*)&testModuleIndex + 1;
+    check(index.find(addr, location) && location.module == executable && location.symbolName != nullptr
+          && strcmp(location.symbolName, "_ZL15testModuleIndexv") == 0
+          && location.symbolAddr == (void*)&testModuleIndex && location.offset == 1,
+          "location of a function of the executable");
+
+    auto getpidAddr = (const uint8_t*)dlsym(RTLD_DEFAULT, "getpid");
+    check(index.find(getpidAddr, location) && location.module == libc && location.symbolName != nullptr
+          && location.symbolAddr == getpidAddr && location.offset == 0, "location of a libc function");
+
+    int stackVariable = 0;
+    check(!index.find(&stackVariable, location), "location of an address out of the modules");
+
+    index.removeNamespace(executable);
+    check(!index.find(addr, location), "location in a removed namespace");
+}
+
+static void testElfFileViews() {
+    struct link_map* executable = getLinkMap(nullptr);
+    auto elf = ElfFile::getElfFile("");
+
+    // The views point into a read-only mapping of the file
+    Elf64_Ehdr header;
+    FILE* file = fopen("/proc/self/exe", "rb");
+    check(file != nullptr && fread(&header, sizeof(header), 1, file) == 1, "read of the executable header");
+    fclose(file);
+
+    auto sections = elf->getShdr();
+    check(sections.size() == header.e_shnum && getProtection(sections.data()) == PROT_READ, "mapped section headers");
+    check(elf->getEntryPoint() == header.e_entry && executable->l_addr + elf->getEntryPoint() == getauxval(AT_ENTRY),
+          "entry point");
+
+    auto dynamic = elf->getDynamic();
+    check(!dynamic.empty() && dynamic[0].d_tag == executable->l_ld[0].d_tag
+          && dynamic[0].d_un.d_val == executable->l_ld[0].d_un.d_val, "dynamic section of the file");
+    check(!elf->getSymTab().empty() && !elf->getStrTab().empty() && !elf->getDynSymTab().empty(), "symbol tables");
+
+    auto range = elf->getLoadedRange();
+    auto offset = (Elf64_Addr)&testElfFileViews - executable->l_addr;
+    check(range.first <= offset && offset < range.second, "loaded range of the executable");
+    check(elf->getMemoryUsage() >= (size_t)header.e_shoff + header.e_shnum * sizeof(Elf64_Shdr), "memory usage");
+}
+
+static void testIndexCache() {
+    struct link_map* libc = getLinkMap("libc.so.6");
+    auto getpidOffset = (Elf64_Addr)dlsym(RTLD_DEFAULT, "getpid") - libc->l_addr;
+
+    char cacheDir[] = "/tmp/spytesterCacheXXXXXX";
+    check(mkdtemp(cacheDir) != nullptr, "creation of the cache directory");
+    setenv("SPYTESTER_INDEX_CACHE", cacheDir, 1);
+
+    // Each index is saved once built, outside the registry so that the file is mapped again
+    std::string cachePath;
+    std::vector<ElfFile::Relocation> relocations;
+    ElfFile::SymbolRange range{};
+    std::string name;
+    {
+        ElfFile first(libc->l_name);
+        auto firstRange = first.findSymbolRange(getpidOffset);
+        check(firstRange != nullptr && firstRange->start <= getpidOffset
+              && getpidOffset < firstRange->start + firstRange->size, "symbol range of getpid");
+        range = *firstRange;
+        name = first.getName(*firstRange);
+        auto firstRelocations = first.getSymbolRelocations();
+        relocations.assign(firstRelocations.begin(), firstRelocations.end());
+
+        DIR* dir = opendir(cacheDir);
+        check(dir != nullptr, "listing of the cache directory");
+        for(struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+            std::string fileName(entry->d_name);
+            if(fileName.size() > 4 && fileName.compare(fileName.size() - 4, 4, ".idx") == 0)
+                cachePath = std::string(cacheDir) + "/" + fileName;
+        }
+        closedir(dir);
+    }
+    check(!cachePath.empty(), "saved index cache");
+
+    // The next instance maps the saved indexes instead of building them
+    struct stat fileStat, cacheStat;
+    check(stat(libc->l_name, &fileStat) == 0 && stat(cachePath.c_str(), &cacheStat) == 0, "size of the cache");
+    auto mappedSize = (size_t)fileStat.st_size + (size_t)cacheStat.st_size;
+    {
+        ElfFile second(libc->l_name);
+        check(second.getMemoryUsage() == mappedSize, "mapped index cache");
+
+        auto secondRange = second.findSymbolRange(getpidOffset);
+        check(secondRange != nullptr && secondRange->start == range.start && secondRange->size == range.size
+              && strcmp(second.getName(*secondRange), name.c_str()) == 0, "cached symbol range");
+        auto secondRelocations = second.getSymbolRelocations();
+        check(secondRelocations.size() == relocations.size()
+              && memcmp(secondRelocations.data(), relocations.data(),
+                        relocations.size() * sizeof(ElfFile::Relocation)) == 0, "cached relocations");
+        check(second.getMemoryUsage() == mappedSize, "lookups in the index cache");
+    }
+
+    unsetenv("SPYTESTER_INDEX_CACHE");
+    unlink(cachePath.c_str());
+    rmdir(cacheDir);
+}
+
+static void testElfFileRegistry() {
+    struct link_map* libstdcxx = getLinkMap("libstdc++.so.6");
+    char realPath[PATH_MAX];
+    check(realpath(libstdcxx->l_name, realPath) != nullptr, "real path of libstdc++");
+
+    // A file is mapped once, whatever the path reaching it
+    auto file = ElfFile::getElfFile(libstdcxx->l_name);
+    check(ElfFile::getElfFile(realPath) == file, "file reached through its real path");
+
+    const int threadNb = 4;
+    ElfFile* handles[threadNb] = {};
+    std::vector<std::thread> threads;
+    for(int idx = 0; idx < threadNb; idx++) {
+        threads.emplace_back([&handles, libstdcxx, idx](){
+            handles[idx] = ElfFile::getElfFile(libstdcxx->l_name).get();
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+    for(auto handle : handles)
+        check(handle == file.get(), "file requested concurrently");
+
+    // The files without handle are closed beyond the budget
+    std::weak_ptr<ElfFile> weakFile = file;
+    ElfFile::setMemoryBudget(0);
+    check(!weakFile.expired(), "file kept by its handle");
+    file.reset();
+    ElfFile::trimRegistry();
+    check(weakFile.expired(), "file closed beyond the budget");
+    ElfFile::setMemoryBudget(256 << 20);
+}
+
+static void testModulePrewarmer() {
+    struct link_map* executable = getLinkMap(nullptr);
+    struct link_map* libc = getLinkMap("libc.so.6");
+
+    // Held here, the images stay in the registry once the prewarmer releases them
+    auto image = ElfFile::getElfImage(libc);
+    size_t usage = image->getMemoryUsage();
+
+    setenv("SPYTESTER_PREWARM_THREADS", "0", 1);
+    check(ModulePrewarmer::getThreadNb() == 0, "disabled prewarm");
+    {
+        ModulePrewarmer prewarmer(executable);
+    }
+    check(image->getMemoryUsage() == usage, "images left unindexed");
+
+    // The indexes are built on the prewarm threads, the destructor waits for them
+    setenv("SPYTESTER_PREWARM_THREADS", "2", 1);
+    check(ModulePrewarmer::getThreadNb() == 2, "number of prewarm threads");
+    {
+        ModulePrewarmer prewarmer(executable);
+    }
+    check(image->getMemoryUsage() > usage, "prewarmed image indexes");
+    check(ElfFile::getElfImage(libc) == image, "prewarmed image shared through the registry");
+    unsetenv("SPYTESTER_PREWARM_THREADS");
+}
+
+static void testElfImage() {
+    struct link_map* libc = getLinkMap("libc.so.6");
+    auto image = ElfFile::getElfImage(libc);
+    auto file = ElfFile::getElfFile(libc->l_name);
+
+    // The dynamic tables are read in memory, the file is not opened
+    // The file section also holds the DT_NULL ending the table, the pointers of the loaded one are relocated
+    auto imageDynamic = image->getDynamic();
+    auto fileDynamic = file->getDynamic();
+    check(imageDynamic.data() == libc->l_ld && !imageDynamic.empty() && imageDynamic.size() < fileDynamic.size()
+          && fileDynamic[imageDynamic.size()].d_tag == DT_NULL, "dynamic section of the image");
+    for(size_t idx = 0; idx < imageDynamic.size(); idx++)
+        check(imageDynamic[idx].d_tag == fileDynamic[idx].d_tag, "dynamic entry of the image");
+    check(image->getSymTab().empty() && image->getDynSymTab().size() == file->getDynSymTab().size(),
+          "symbol tables of the image");
+
+    auto imageSymbol = image->getDefinedDynSym("process_vm_readv");
+    auto fileSymbol = file->getDefinedDynSym("process_vm_readv");
+    check(imageSymbol != nullptr && fileSymbol != nullptr && imageSymbol->st_value == fileSymbol->st_value
+          && libc->l_addr + imageSymbol->st_value == (Elf64_Addr)dlsym(RTLD_DEFAULT, "process_vm_readv"),
+          "dynamic symbol of the image");
+
+    size_t imageRelaNb = 0, fileRelaNb = 0;
+    for(auto& rela : image->getRela())
+        imageRelaNb += rela.size();
+    for(auto& rela : file->getRela())
+        fileRelaNb += rela.size();
+    check(imageRelaNb != 0 && imageRelaNb == fileRelaNb, "relocations of the image");
+}
+
+int main() {
+    testMemoryPatcher();
+    testX86Instruction();
+    testFastTracePoint();
+    testWrapperThunk();
+    testMpscRing();
+    testFlatHashMap();
+    testCodeArena();
+    testRcu();
+    testRelocationIndex();
+    testSymbolLookup();
+    testModuleIndex();
+    testElfFileViews();
+    testIndexCache();
+    testElfFileRegistry();
+    testModulePrewarmer();
+    testElfImage();
+
+    std::cout << "Unit tests passed" << std::endl;
+    return 0;
+}